@@ -0,0 +1,12 @@
+#!/bin/sh
+# Headless tools for Linux, need no SDL
+mkdir -p bin
+cc -O2 src/jumbo_bench.c -o bin/bench
+cc -O2 src/jumbo_capexport.c -o bin/capexport
+cc -O2 -pthread src/jumbo_fuzz.c -o bin/fuzz
+cc -O2 src/jumbo_microbench.c -o bin/microbench
+cc -O2 -pthread src/jumbo_regress.c -o bin/regress
+cc -O2 src/jumbo_nestest.c -o bin/nestest
+cc -O2 src/jumbo_lockstep.c -o bin/lockstep
+# CPU conformance, fails at the first instruction that differs from misc/ref.txt
+bin/nestest
@@ -1,8 +1,7 @@
 @echo off
 if not exist bin mkdir bin
-cl src\jumbo.c /fsanitize=address /link /DEBUG /Feneske.exe
-move neske.pdb bin
-move neske.exe bin
+cl src\jumbo_nestest.c /fsanitize=address /link /DEBUG /Fenestest.exe
+move nestest.pdb bin
+move nestest.exe bin
 del *.obj
-bin\neske.exe misc/nestest.nes > bin/nestest_out.txt
-vimdiff bin/nestest_out.txt misc/ref.txt
\ No newline at end of file
+bin\nestest.exe misc/nestest.nes misc/ref.txt
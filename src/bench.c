@@ -0,0 +1,165 @@
+// Headless front end: runs a ROM for a number of frames without a window or audio
+// device and reports how fast each part of the emulator went. Only needs the core.
+#include "neske.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SAMPLE_RATE 44100
+#define BENCH_FPS 60
+#define BENCH_CPU_HZ 1789773.0
+
+enum bench_part
+{
+    BENCH_EMULATE,
+    BENCH_DRAW,
+    BENCH_AUDIO,
+    BENCH_BLIT,
+    BENCH_PARTS
+};
+
+static const char *bench_part_names[BENCH_PARTS] = { "emulate", "draw", "audio", "blit" };
+
+static void bench_usage()
+{
+    printf("usage: bench ROM [-f FRAMES] [-m MOVIE.fm2] [-r]\n");
+    printf("  -f  frames to run, 1800 by default\n");
+    printf("  -m  FCEUX movie to take the first controller from\n");
+    printf("  -r  draw on the emulating PPU instead of replaying its log\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *rom_path = NULL;
+    const char *movie_path = NULL;
+    int frames = 1800;
+    bool inline_render = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-f") == 0 && i+1 < argc)      frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i+1 < argc) movie_path = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0)               inline_render = true;
+        else if (argv[i][0] != '-' && !rom_path)           rom_path = argv[i];
+        else
+        {
+            bench_usage();
+            return 1;
+        }
+    }
+
+    if (!rom_path || frames <= 0)
+    {
+        bench_usage();
+        return 1;
+    }
+
+    struct controller_state *movie = NULL;
+    int movie_frames = 0;
+    if (movie_path && !(movie = player_load_movie(movie_path, &movie_frames)))
+    {
+        printf("Can't read movie %s\n", movie_path);
+        return 1;
+    }
+
+    struct mux_api mux = { NULL, headless_mux_nop, headless_mux_nop };
+    struct rom_cache roms = rom_cache_make(mux);
+    struct rom_image *image = rom_cache_open(&roms, rom_path);
+    if (!image)
+    {
+        return 1;
+    }
+
+    struct player player = player_init(image, mux);
+    rom_image_release(image);
+    if (!player.is_valid)
+    {
+        printf("Can't run %s\n", rom_path);
+        return 1;
+    }
+
+    struct system *sys = player_get_system(&player);
+
+    // Same split as the SDL front end, unless -r draws on the emulating PPU
+    struct headless_replay *replay = inline_render ? NULL : headless_replay_make(sys);
+    struct ppu *drawn = replay ? &replay->replica : &sys->ppu;
+
+    static struct blit_lut lut;
+    static uint32_t pixels[256*240];
+    static uint16_t samples[BENCH_SAMPLE_RATE/BENCH_FPS];
+    blit_lut_init(&lut, blit_palette, BLIT_RGBA8888);
+
+    uint64_t part_ns[BENCH_PARTS] = { 0 };
+    uint64_t hash = 1469598103934665603ULL;
+    uint64_t cycles_start = sys->cpu.cycles;
+    int frame = 0;
+
+    for (; frame < frames && !player_crash(&player); frame++)
+    {
+        if (movie)
+        {
+            player_set_controller(&player, movie[frame < movie_frames ? frame : movie_frames-1]);
+        }
+
+        uint64_t t0 = headless_now_ns();
+        player_frame(&player);
+
+        uint64_t t1 = headless_now_ns();
+        if (replay)
+        {
+            headless_replay_frame(replay, sys);
+        }
+
+        uint64_t t2 = headless_now_ns();
+        player_generate_samples(&player, samples, BENCH_SAMPLE_RATE/BENCH_FPS);
+
+        uint64_t t3 = headless_now_ns();
+        blit_rows(&lut, drawn->screen, drawn->emphasis, 0, 240, 1, pixels, 256*sizeof(uint32_t));
+
+        uint64_t t4 = headless_now_ns();
+        part_ns[BENCH_EMULATE] += t1-t0;
+        part_ns[BENCH_DRAW] += t2-t1;
+        part_ns[BENCH_AUDIO] += t3-t2;
+        part_ns[BENCH_BLIT] += t4-t3;
+
+        // Lets runs be checked against each other, not just timed
+        for (int i = 0; i < 256*240; i++)
+        {
+            hash = (hash ^ drawn->screen[i]) * 1099511628211ULL;
+        }
+    }
+
+    uint64_t total_ns = 0;
+    for (int i = 0; i < BENCH_PARTS; i++)
+    {
+        total_ns += part_ns[i];
+    }
+
+    double seconds = total_ns / 1e9;
+    double cycles = sys->cpu.cycles - cycles_start;
+
+    printf("%s: %d frames in %.3f s\n", rom_path, frame, seconds);
+    printf("%.1f fps, %.1fx real time\n", frame/seconds, frame/seconds/BENCH_FPS);
+    printf("%.2f MHz emulated CPU (%.1fx a real one)\n", cycles/seconds/1e6, cycles/seconds/BENCH_CPU_HZ);
+    for (int i = 0; i < BENCH_PARTS; i++)
+    {
+        printf("%-8s %8.3f s %6.2f%% %8.1f us/frame\n",
+            bench_part_names[i], part_ns[i]/1e9, 100.0*part_ns[i]/total_ns, part_ns[i]/1e3/frame);
+    }
+    printf("hash %016llx\n", (unsigned long long)hash);
+
+    bool crashed = player_crash(&player);
+    if (crashed)
+    {
+        debug_report(sys);
+    }
+
+    if (replay)
+    {
+        headless_replay_free(replay, sys);
+    }
+    player_free(&player);
+    free(movie);
+
+    return crashed ? 2 : 0;
+}
@@ -0,0 +1,285 @@
+#include "neske.h"
+#include <string.h>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define BLIT_X86
+#define BLIT_AVX2_FN
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BLIT_X86
+#define BLIT_AVX2_FN __attribute__((target("avx2")))
+#endif
+
+const uint32_t blit_palette[64] = {
+    0x626262ff, 0x001fb2ff, 0x2404c8ff, 0x5200b2ff,
+    0x730076ff, 0x800024ff, 0x730b00ff, 0x522800ff,
+    0x244400ff, 0x005700ff, 0x005c00ff, 0x005324ff,
+    0x003c76ff, 0x000000ff, 0x000000ff, 0x000000ff,
+    0xabababff, 0x0d57ffff, 0x4b30ffff, 0x8a13ffff,
+    0xbc08d6ff, 0xd21269ff, 0xc72e00ff, 0x9d5400ff,
+    0x607b00ff, 0x209800ff, 0x00a300ff, 0x009942ff,
+    0x007db4ff, 0x000000ff, 0x000000ff, 0x000000ff,
+    0xffffffff, 0x53aeffff, 0x9085ffff, 0xd365ffff,
+    0xff57ffff, 0xff5dcfff, 0xff7757ff, 0xfa9e00ff,
+    0xbdc700ff, 0x7ae700ff, 0x43f611ff, 0x26ef7eff,
+    0x2cd5f6ff, 0x4e4e4eff, 0x000000ff, 0x000000ff,
+    0xffffffff, 0xb6e1ffff, 0xced1ffff, 0xe9c3ffff,
+    0xffbcffff, 0xffbdf4ff, 0xffc6c3ff, 0xffd59aff,
+    0xe9e681ff, 0xcef481ff, 0xb6fb9aff, 0xa9fac3ff,
+    0xa9f0f4ff, 0xb8b8b8ff, 0x000000ff, 0x000000ff,
+};
+
+static bool blit_cpu_has_avx2()
+{
+#if defined(BLIT_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+
+    // The OS must save the YMM registers too
+    __cpuid(info, 1);
+    if (!(info[2] & (1<<27))) return false;
+    if ((_xgetbv(0) & 6) != 6) return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1<<5)) != 0;
+#elif defined(BLIT_X86)
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+static uint32_t blit_pack(uint8_t r, uint8_t g, uint8_t b, enum blit_format format)
+{
+    switch (format)
+    {
+        case BLIT_RGBA8888: return (r<<24)|(g<<16)|(b<<8)|0xFF;
+        case BLIT_BGRA8888: return (b<<24)|(g<<16)|(r<<8)|0xFF;
+        case BLIT_RGB565:   return ((r>>3)<<11)|((g>>2)<<5)|(b>>3);
+    }
+
+    return 0;
+}
+
+size_t blit_bytes_per_pixel(enum blit_format format)
+{
+    return format == BLIT_RGB565 ? 2 : 4;
+}
+
+void blit_lut_init(struct blit_lut *lut, const uint32_t *rgba, enum blit_format format)
+{
+    lut->format = format;
+    lut->use_avx2 = blit_cpu_has_avx2();
+
+    for (int emphasis = 0; emphasis < 8; emphasis++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            uint8_t r = rgba[i]>>24, g = rgba[i]>>16, b = rgba[i]>>8;
+
+            // Emphasis bits are red, green, blue; each one darkens the other two channels
+            if (emphasis & 0b110) r = r*3/4;
+            if (emphasis & 0b101) g = g*3/4;
+            if (emphasis & 0b011) b = b*3/4;
+
+            lut->colors[emphasis][i] = blit_pack(r, g, b, format);
+        }
+    }
+}
+
+static void blit_row_32(const uint32_t *colors, const uint8_t *src, uint32_t *dst)
+{
+    for (int x = 0; x < 256; x++)
+    {
+        dst[x] = colors[src[x]&0x3F];
+    }
+}
+
+static void blit_row_16(const uint32_t *colors, const uint8_t *src, uint16_t *dst)
+{
+    for (int x = 0; x < 256; x++)
+    {
+        dst[x] = colors[src[x]&0x3F];
+    }
+}
+
+#ifdef BLIT_X86
+static BLIT_AVX2_FN void blit_row_32_avx2(const uint32_t *colors, const uint8_t *src, uint32_t *dst)
+{
+    const __m256i mask = _mm256_set1_epi32(0x3F);
+
+    for (int x = 0; x < 256; x += 8)
+    {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src+x)));
+        __m256i rgb = _mm256_i32gather_epi32((const int *)colors, _mm256_and_si256(idx, mask), 4);
+        _mm256_storeu_si256((__m256i *)(dst+x), rgb);
+    }
+}
+
+static BLIT_AVX2_FN void blit_row_16_avx2(const uint32_t *colors, const uint8_t *src, uint16_t *dst)
+{
+    const __m256i mask = _mm256_set1_epi32(0x3F);
+
+    for (int x = 0; x < 256; x += 16)
+    {
+        __m256i idx_lo = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src+x)));
+        __m256i idx_hi = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src+x+8)));
+        __m256i lo = _mm256_i32gather_epi32((const int *)colors, _mm256_and_si256(idx_lo, mask), 4);
+        __m256i hi = _mm256_i32gather_epi32((const int *)colors, _mm256_and_si256(idx_hi, mask), 4);
+        // packus works within 128 bit lanes, so the quarters need reordering
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst+x), packed);
+    }
+}
+
+// Which of 8 pixels goes in each lane of the scale outputs they widen to
+static const int blit_widen[3][4][8] = {
+    { { 0,0,1,1,2,2,3,3 }, { 4,4,5,5,6,6,7,7 } },
+    { { 0,0,0,1,1,1,2,2 }, { 2,3,3,3,4,4,4,5 }, { 5,5,6,6,6,7,7,7 } },
+    { { 0,0,0,0,1,1,1,1 }, { 2,2,2,2,3,3,3,3 }, { 4,4,4,4,5,5,5,5 }, { 6,6,6,6,7,7,7,7 } },
+};
+
+// Row widened 2 to 4 times, each pixel repeated in registers
+static BLIT_AVX2_FN void blit_row_32_avx2_scaled(const uint32_t *colors, const uint8_t *src, uint32_t *dst, int scale)
+{
+    const __m256i mask = _mm256_set1_epi32(0x3F);
+    __m256i widen[4];
+    for (int k = 0; k < scale; k++)
+    {
+        widen[k] = _mm256_loadu_si256((const __m256i *)blit_widen[scale-2][k]);
+    }
+
+    for (int x = 0; x < 256; x += 8)
+    {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src+x)));
+        __m256i rgb = _mm256_i32gather_epi32((const int *)colors, _mm256_and_si256(idx, mask), 4);
+        for (int k = 0; k < scale; k++)
+        {
+            _mm256_storeu_si256((__m256i *)(dst + x*scale + k*8), _mm256_permutevar8x32_epi32(rgb, widen[k]));
+        }
+    }
+}
+
+static BLIT_AVX2_FN void blit_row_16_avx2_scaled(const uint32_t *colors, const uint8_t *src, uint16_t *dst, int scale)
+{
+    const __m256i mask = _mm256_set1_epi32(0x3F);
+    __m256i widen[4];
+    for (int k = 0; k < scale; k++)
+    {
+        widen[k] = _mm256_loadu_si256((const __m256i *)blit_widen[scale-2][k]);
+    }
+
+    for (int x = 0; x < 256; x += 16)
+    {
+        __m256i idx_lo = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src+x)));
+        __m256i idx_hi = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src+x+8)));
+        __m256i rgb[2] = {
+            _mm256_i32gather_epi32((const int *)colors, _mm256_and_si256(idx_lo, mask), 4),
+            _mm256_i32gather_epi32((const int *)colors, _mm256_and_si256(idx_hi, mask), 4),
+        };
+
+        // Widened while still 32 bit, then packed two vectors at a time
+        __m256i wide[8];
+        for (int k = 0; k < scale; k++)
+        {
+            wide[k] = _mm256_permutevar8x32_epi32(rgb[0], widen[k]);
+            wide[scale+k] = _mm256_permutevar8x32_epi32(rgb[1], widen[k]);
+        }
+        for (int k = 0; k < scale; k++)
+        {
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(wide[k*2], wide[k*2+1]), 0xD8);
+            _mm256_storeu_si256((__m256i *)(dst + x*scale + k*16), packed);
+        }
+    }
+}
+#endif
+
+static void blit_row(const struct blit_lut *lut, const uint32_t *colors, const uint8_t *src, void *dst)
+{
+    bool wide = blit_bytes_per_pixel(lut->format) == 4;
+
+#ifdef BLIT_X86
+    if (lut->use_avx2)
+    {
+        if (wide) blit_row_32_avx2(colors, src, dst);
+        else      blit_row_16_avx2(colors, src, dst);
+        return;
+    }
+#endif
+
+    if (wide) blit_row_32(colors, src, dst);
+    else      blit_row_16(colors, src, dst);
+}
+
+void blit_rows(
+    const struct blit_lut *lut,
+    const uint8_t *screen,
+    const uint8_t *emphasis,
+    int from, int to,
+    int scale,
+    void *dest, size_t pitch
+)
+{
+    size_t bpp = blit_bytes_per_pixel(lut->format);
+    uint32_t row[256];
+
+    for (int y = from; y < to; y++)
+    {
+        const uint32_t *colors = lut->colors[emphasis ? emphasis[y]&7 : 0];
+        uint8_t *out = (uint8_t *)dest + (size_t)(y-from)*scale*pitch;
+
+        if (scale == 1)
+        {
+            blit_row(lut, colors, screen+y*256, out);
+            continue;
+        }
+
+#ifdef BLIT_X86
+        if (lut->use_avx2 && scale <= 4)
+        {
+            if (bpp == 4) blit_row_32_avx2_scaled(colors, screen+y*256, (uint32_t *)out, scale);
+            else          blit_row_16_avx2_scaled(colors, screen+y*256, (uint16_t *)out, scale);
+
+            for (int s = 1; s < scale; s++)
+            {
+                memcpy(out + s*pitch, out, 256*scale*bpp);
+            }
+            continue;
+        }
+#endif
+
+        blit_row(lut, colors, screen+y*256, row);
+
+        if (bpp == 4)
+        {
+            uint32_t *dst = (uint32_t *)out;
+            for (int x = 0; x < 256; x++)
+            {
+                for (int s = 0; s < scale; s++)
+                {
+                    *dst++ = row[x];
+                }
+            }
+        }
+        else
+        {
+            uint16_t *src = (uint16_t *)row;
+            uint16_t *dst = (uint16_t *)out;
+            for (int x = 0; x < 256; x++)
+            {
+                for (int s = 0; s < scale; s++)
+                {
+                    *dst++ = src[x];
+                }
+            }
+        }
+
+        for (int s = 1; s < scale; s++)
+        {
+            memcpy(out + s*pitch, out, 256*scale*bpp);
+        }
+    }
+}
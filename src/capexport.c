@@ -0,0 +1,28 @@
+// Turns a capture recorded with F8 into a Y4M video and a WAV, offline so the
+// recording itself stays cheap. Only needs the core.
+#include "neske.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        printf("usage: capexport CAPTURE [OUTPUT]\n");
+        printf("  writes OUTPUT.y4m and OUTPUT.wav, OUTPUT is CAPTURE without its extension by default\n");
+        return 1;
+    }
+
+    const char *base = argc == 3 ? argv[2] : argv[1];
+
+    // rom_sibling_path swaps the extension, which works for any file
+    char *y4m_path = rom_sibling_path(base, ".y4m");
+    char *wav_path = rom_sibling_path(base, ".wav");
+
+    bool ok = capture_export(argv[1], y4m_path, wav_path);
+
+    free(y4m_path);
+    free(wav_path);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,331 @@
+#include "neske.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// File layout: a header, then chunks of a type byte and a 32 bit length.
+// Video chunks hold a frame XORed with the one before it and packed, an empty
+// one means nothing changed. Audio chunks hold 16 bit samples. All little endian.
+#define CAPTURE_MAGIC "NESCAP1"
+#define CAPTURE_VIDEO 'V'
+#define CAPTURE_AUDIO 'A'
+
+// NTSC frame rate, 60.0988 Hz
+#define CAPTURE_FPS_NUM 39375000
+#define CAPTURE_FPS_DEN 655171
+
+// Packing can grow data that doesn't repeat by one byte in 128
+#define CAPTURE_PACKED_MAX (CAPTURE_FRAME_SIZE + CAPTURE_FRAME_SIZE/128 + 16)
+
+static void capture_put_u32(uint8_t *dest, uint32_t value)
+{
+    dest[0] = value;
+    dest[1] = value>>8;
+    dest[2] = value>>16;
+    dest[3] = value>>24;
+}
+
+static uint32_t capture_get_u32(const uint8_t *src)
+{
+    return src[0] | src[1]<<8 | src[2]<<16 | (uint32_t)src[3]<<24;
+}
+
+// PackBits: a control byte below 128 is followed by that many plus one literal
+// bytes, from 128 up it's a run of the next byte, 3 to 130 long
+static size_t capture_pack(const uint8_t *src, size_t size, uint8_t *dest)
+{
+    size_t out = 0;
+    size_t i = 0;
+
+    while (i < size)
+    {
+        size_t run = 1;
+        while (i+run < size && run < 130 && src[i+run] == src[i])
+        {
+            run++;
+        }
+
+        if (run >= 3)
+        {
+            dest[out++] = 128 + run-3;
+            dest[out++] = src[i];
+            i += run;
+            continue;
+        }
+
+        // Literals go on until a run of 3 starts
+        size_t start = i;
+        while (i < size && i-start < 128)
+        {
+            if (i+2 < size && src[i] == src[i+1] && src[i] == src[i+2])
+            {
+                break;
+            }
+            i++;
+        }
+
+        dest[out++] = i-start-1;
+        memcpy(dest+out, src+start, i-start);
+        out += i-start;
+    }
+
+    return out;
+}
+
+static bool capture_unpack(const uint8_t *src, size_t size, uint8_t *dest, size_t dest_size)
+{
+    size_t out = 0;
+    size_t i = 0;
+
+    while (i < size)
+    {
+        uint8_t control = src[i++];
+
+        if (control < 128)
+        {
+            size_t count = control+1;
+            if (i+count > size || out+count > dest_size)
+            {
+                return false;
+            }
+            memcpy(dest+out, src+i, count);
+            i += count;
+            out += count;
+        }
+        else
+        {
+            size_t count = control-128+3;
+            if (i >= size || out+count > dest_size)
+            {
+                return false;
+            }
+            memset(dest+out, src[i++], count);
+            out += count;
+        }
+    }
+
+    return out == dest_size;
+}
+
+static bool capture_write_chunk(struct capture *cap, uint8_t type, const uint8_t *data, uint32_t size)
+{
+    uint8_t head[5] = { type };
+    capture_put_u32(head+1, size);
+
+    return fwrite(head, 1, sizeof head, cap->file) == sizeof head
+        && fwrite(data, 1, size, cap->file) == size;
+}
+
+struct capture *capture_open(const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        printf("Can't write capture %s\n", path);
+        return NULL;
+    }
+
+    uint8_t header[20];
+    memcpy(header, CAPTURE_MAGIC, 8);
+    capture_put_u32(header+8, CAPTURE_SAMPLE_RATE);
+    capture_put_u32(header+12, CAPTURE_FPS_NUM);
+    capture_put_u32(header+16, CAPTURE_FPS_DEN);
+    fwrite(header, 1, sizeof header, fp);
+
+    struct capture *cap = calloc(1, sizeof(struct capture));
+    assert(cap != NULL);
+
+    cap->file = fp;
+    cap->ok = true;
+    cap->packed = malloc(CAPTURE_PACKED_MAX);
+    assert(cap->packed != NULL);
+
+    return cap;
+}
+
+bool capture_frame(struct capture *cap, const uint8_t *frame)
+{
+    bool changed = false;
+
+    for (size_t i = 0; i < CAPTURE_FRAME_SIZE; i++)
+    {
+        cap->delta[i] = frame[i] ^ cap->prev[i];
+        changed |= cap->delta[i] != 0;
+    }
+    memcpy(cap->prev, frame, CAPTURE_FRAME_SIZE);
+
+    size_t size = changed ? capture_pack(cap->delta, CAPTURE_FRAME_SIZE, cap->packed) : 0;
+
+    cap->frames++;
+    cap->bytes += 5 + size;
+    cap->ok = cap->ok && capture_write_chunk(cap, CAPTURE_VIDEO, cap->packed, size);
+    return cap->ok;
+}
+
+bool capture_samples(struct capture *cap, const uint16_t *samples, uint32_t count)
+{
+    uint8_t data[4096];
+
+    while (count)
+    {
+        uint32_t n = count < sizeof data/2 ? count : sizeof data/2;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            data[i*2] = samples[i];
+            data[i*2+1] = samples[i]>>8;
+        }
+
+        cap->samples += n;
+        cap->bytes += 5 + n*2;
+        cap->ok = cap->ok && capture_write_chunk(cap, CAPTURE_AUDIO, data, n*2);
+
+        samples += n;
+        count -= n;
+    }
+
+    return cap->ok;
+}
+
+bool capture_close(struct capture *cap)
+{
+    bool ok = fclose(cap->file) == 0 && cap->ok;
+
+    free(cap->packed);
+    free(cap);
+
+    return ok;
+}
+
+static void capture_wav_header(uint8_t *header, uint32_t sample_rate, uint32_t samples)
+{
+    memcpy(header, "RIFF", 4);
+    capture_put_u32(header+4, 36 + samples*2);
+    memcpy(header+8, "WAVEfmt ", 8);
+    capture_put_u32(header+16, 16);
+    // PCM, mono, 16 bit
+    capture_put_u32(header+20, 1 | 1<<16);
+    capture_put_u32(header+24, sample_rate);
+    capture_put_u32(header+28, sample_rate*2);
+    capture_put_u32(header+32, 2 | 16<<16);
+    memcpy(header+36, "data", 4);
+    capture_put_u32(header+40, samples*2);
+}
+
+// Turns a capture into a Y4M video (4:4:4, studio range BT.601) and a WAV.
+// A capture cut short, like by a crash, exports up to its last whole chunk.
+bool capture_export(const char *path, const char *y4m_path, const char *wav_path)
+{
+    FILE *in = fopen(path, "rb");
+    if (!in)
+    {
+        printf("Can't open capture %s\n", path);
+        return false;
+    }
+
+    uint8_t header[20];
+    if (fread(header, 1, sizeof header, in) != sizeof header || memcmp(header, CAPTURE_MAGIC, 8) != 0)
+    {
+        printf("%s isn't a capture\n", path);
+        fclose(in);
+        return false;
+    }
+
+    FILE *y4m = fopen(y4m_path, "wb");
+    FILE *wav = fopen(wav_path, "wb");
+    if (!y4m || !wav)
+    {
+        printf("Can't write %s\n", !y4m ? y4m_path : wav_path);
+        if (y4m) fclose(y4m);
+        if (wav) fclose(wav);
+        fclose(in);
+        return false;
+    }
+
+    uint32_t sample_rate = capture_get_u32(header+8);
+    fprintf(y4m, "YUV4MPEG2 W256 H240 F%u:%u Ip A1:1 C444\n", capture_get_u32(header+12), capture_get_u32(header+16));
+
+    uint8_t wav_header[44];
+    capture_wav_header(wav_header, sample_rate, 0);
+    fwrite(wav_header, 1, sizeof wav_header, wav);
+
+    // Every color the blitter can make, converted once
+    struct blit_lut lut;
+    blit_lut_init(&lut, blit_palette, BLIT_RGBA8888);
+    uint8_t yuv[8][64][3];
+    for (int e = 0; e < 8; e++)
+    {
+        for (int c = 0; c < 64; c++)
+        {
+            int r = lut.colors[e][c]>>24, g = (lut.colors[e][c]>>16) & 0xFF, b = (lut.colors[e][c]>>8) & 0xFF;
+            yuv[e][c][0] = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+            yuv[e][c][1] = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+            yuv[e][c][2] = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+        }
+    }
+
+    uint8_t *frame = calloc(1, CAPTURE_FRAME_SIZE);
+    uint8_t *delta = malloc(CAPTURE_FRAME_SIZE);
+    uint8_t *data = malloc(CAPTURE_PACKED_MAX);
+    uint8_t *planes = malloc(256*240*3);
+    assert(frame && delta && data && planes);
+
+    uint32_t frames = 0, samples = 0;
+    bool ok = true;
+
+    uint8_t head[5];
+    while (ok && fread(head, 1, sizeof head, in) == sizeof head)
+    {
+        uint32_t size = capture_get_u32(head+1);
+        if (size > CAPTURE_PACKED_MAX || fread(data, 1, size, in) != size)
+        {
+            break;
+        }
+
+        if (head[0] == CAPTURE_VIDEO)
+        {
+            if (size && !capture_unpack(data, size, delta, CAPTURE_FRAME_SIZE))
+            {
+                printf("Frame %u of %s is damaged\n", frames, path);
+                break;
+            }
+            for (size_t i = 0; size && i < CAPTURE_FRAME_SIZE; i++)
+            {
+                frame[i] ^= delta[i];
+            }
+
+            const uint8_t *emphasis = frame + 256*240;
+            for (int i = 0; i < 256*240; i++)
+            {
+                const uint8_t *color = yuv[emphasis[i/256] & 7][frame[i] & 63];
+                planes[i] = color[0];
+                planes[256*240 + i] = color[1];
+                planes[256*240*2 + i] = color[2];
+            }
+
+            ok = fwrite("FRAME\n", 1, 6, y4m) == 6 && fwrite(planes, 1, 256*240*3, y4m) == 256*240*3;
+            frames++;
+        }
+        else if (head[0] == CAPTURE_AUDIO)
+        {
+            // Already little endian 16 bit
+            ok = fwrite(data, 1, size, wav) == size;
+            samples += size/2;
+        }
+    }
+
+    capture_wav_header(wav_header, sample_rate, samples);
+    ok = fseek(wav, 0, SEEK_SET) == 0 && fwrite(wav_header, 1, sizeof wav_header, wav) == sizeof wav_header && ok;
+
+    ok = fclose(y4m) == 0 && ok;
+    ok = fclose(wav) == 0 && ok;
+    fclose(in);
+
+    free(frame);
+    free(delta);
+    free(data);
+    free(planes);
+
+    printf("%s: %u frames to %s, %u samples to %s\n", path, frames, y4m_path, samples, wav_path);
+    return ok;
+}
@@ -0,0 +1,90 @@
+#include "neske.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct cdl *cdl_make(const uint8_t *prg_rom, size_t prg_size, const uint8_t *chr_rom, size_t chr_size, const char *rom_path)
+{
+    struct cdl *cdl = calloc(1, sizeof(struct cdl));
+    assert(cdl != NULL);
+
+    cdl->prg_rom = prg_rom;
+    cdl->prg_size = prg_size;
+    cdl->prg = calloc(prg_size, 1);
+    assert(cdl->prg != NULL);
+
+    // CHR RAM has nothing to log
+    cdl->chr_rom = chr_rom;
+    cdl->chr_size = chr_size;
+    if (chr_size)
+    {
+        cdl->chr = calloc(chr_size, 1);
+        assert(cdl->chr != NULL);
+    }
+
+    cdl->path = rom_path ? rom_sibling_path(rom_path, ".cdl") : NULL;
+
+    return cdl;
+}
+
+void cdl_free(struct cdl *cdl)
+{
+    free(cdl->prg);
+    free(cdl->chr);
+    free(cdl->path);
+    free(cdl);
+}
+
+void cdl_clear(struct cdl *cdl)
+{
+    memset(cdl->prg, 0, cdl->prg_size);
+    if (cdl->chr)
+    {
+        memset(cdl->chr, 0, cdl->chr_size);
+    }
+}
+
+size_t cdl_count(const uint8_t *flags, size_t size, uint8_t mask)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        count += (flags[i] & mask) != 0;
+    }
+
+    return count;
+}
+
+bool cdl_write_file(const struct cdl *cdl)
+{
+    if (!cdl->path)
+    {
+        return false;
+    }
+
+    size_t size = cdl->prg_size + cdl->chr_size;
+    uint8_t *data = malloc(size);
+    assert(data != NULL);
+
+    // FCEUX keeps code in bit 0 and data in bit 1 for PRG, drawn and read for CHR
+    for (size_t i = 0; i < cdl->prg_size; i++)
+    {
+        uint8_t flags = cdl->prg[i];
+        data[i] = ((flags & (CDL_OPCODE|CDL_OPERAND)) ? 1 : 0) | ((flags & CDL_DATA) ? 2 : 0);
+    }
+    if (cdl->chr_size)
+    {
+        memcpy(data + cdl->prg_size, cdl->chr, cdl->chr_size);
+    }
+
+    bool ok = save_write_file_atomic(cdl->path, data, size);
+    if (!ok)
+    {
+        printf("Can't write code/data log %s\n", cdl->path);
+    }
+
+    free(data);
+    return ok;
+}
@@ -0,0 +1,23 @@
+#include "ricoh.c"
+#include "apu.c"
+#include "ppu.c"
+#include "imap.c"
+#include "rom.c"
+#include "save.c"
+#include "cdl.c"
+#include "debug.c"
+#include "prof.c"
+#include "trace.c"
+#include "rtc.c"
+#include "blit.c"
+#include "capture.c"
+#include "player.c"
+#include "system.c"
+#include "mapper/banked.c"
+#include "mapper/nrom.c"
+#include "mapper/mmc1.c"
+#include "mapper/unrom.c"
+#include "mapper/m228.c"
+#include "mapper/cnrom.c"
+#include "mapper/axrom.c"
+#include "mapper/mmc3.c"
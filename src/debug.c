@@ -0,0 +1,174 @@
+#include "neske.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void debug_update_pages(struct debugger *debug)
+{
+    memset(debug->pages, 0, sizeof debug->pages);
+
+    for (int i = 0; i < debug->count; i++)
+    {
+        struct debug_point *point = &debug->points[i];
+        for (int page = point->lo>>8; page <= point->hi>>8; page++)
+        {
+            debug->pages[page] |= point->kinds;
+        }
+    }
+}
+
+bool debug_add(struct debugger *debug, uint16_t lo, uint16_t hi, uint8_t kinds)
+{
+    if (debug->count == DEBUG_MAX_POINTS || lo > hi || !kinds)
+    {
+        return false;
+    }
+
+    debug->points[debug->count++] = (struct debug_point){ lo, hi, kinds };
+    debug_update_pages(debug);
+
+    return true;
+}
+
+void debug_remove(struct debugger *debug, uint16_t lo, uint16_t hi)
+{
+    for (int i = 0; i < debug->count; i++)
+    {
+        if (debug->points[i].lo == lo && debug->points[i].hi == hi)
+        {
+            debug->points[i--] = debug->points[--debug->count];
+        }
+    }
+
+    debug_update_pages(debug);
+}
+
+void debug_clear(struct debugger *debug)
+{
+    debug->count = 0;
+    debug_update_pages(debug);
+}
+
+bool debug_parse(struct debugger *debug, const char *spec)
+{
+    while (*spec)
+    {
+        uint8_t kinds = 0;
+        for (; *spec && *spec != ':'; spec++)
+        {
+            switch (*spec)
+            {
+                case 'x': kinds |= DEBUG_EXEC; break;
+                case 'r': kinds |= DEBUG_READ; break;
+                case 'w': kinds |= DEBUG_WRITE; break;
+                default: return false;
+            }
+        }
+        if (*spec++ != ':')
+        {
+            return false;
+        }
+
+        char *end;
+        unsigned long lo = strtoul(spec, &end, 16), hi = lo;
+        if (end == spec || lo > 0xFFFF)
+        {
+            return false;
+        }
+        if (*end == '-')
+        {
+            spec = end+1;
+            hi = strtoul(spec, &end, 16);
+            if (end == spec || hi > 0xFFFF)
+            {
+                return false;
+            }
+        }
+
+        if (!debug_add(debug, lo, hi, kinds))
+        {
+            return false;
+        }
+
+        spec = end;
+        if (*spec == ',')
+        {
+            spec++;
+        }
+        else if (*spec)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The page matched, see if a point does. Pauses on a hit.
+bool debug_check(struct system *system, uint8_t kind, uint16_t addr, uint8_t value)
+{
+    struct debugger *debug = &system->debug;
+
+    // The instruction the CPU was resumed on mustn't stop it again
+    if (kind == DEBUG_EXEC && system->cpu.cycles == debug->resume_cycles)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < debug->count; i++)
+    {
+        struct debug_point *point = &debug->points[i];
+        if ((point->kinds & kind) && addr >= point->lo && addr <= point->hi)
+        {
+            // The first hit of an instruction is the one reported
+            if (!debug->paused)
+            {
+                debug->paused = true;
+                debug->hit = (struct debug_hit){ kind, addr, value, system->instr_pc };
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void debug_resume(struct system *system)
+{
+    system->debug.paused = false;
+    system->debug.resume_cycles = system->cpu.cycles;
+}
+
+void debug_report(struct system *system)
+{
+    struct debug_hit *hit = &system->debug.hit;
+    struct ricoh_state *cpu = &system->cpu;
+    struct ppu *ppu = &system->ppu;
+
+    if (system->debug.paused)
+    {
+        const char *kind = hit->kind == DEBUG_EXEC ? "exec" : hit->kind == DEBUG_READ ? "read" : "write";
+        printf("Break on %s of $%04X", kind, hit->addr);
+        if (hit->kind != DEBUG_EXEC)
+        {
+            printf(" (value $%02X, instruction at $%04X)", hit->value, hit->pc);
+        }
+        printf("\n");
+    }
+    else if (cpu->crash)
+    {
+        printf("CPU crashed\n");
+    }
+
+    char text[IMAP_TEXT_SIZE];
+    system->fetching = true;
+    ricoh_format_decoded_instr(text, sizeof text, ricoh_decode_instr(&system->decoder, &system->mem, cpu->pc));
+    system->fetching = false;
+
+    printf("CPU: PC=%04X A=%02X X=%02X Y=%02X P=%02X SP=%02X CYC=%llu  %s\n",
+        cpu->pc, cpu->a, cpu->x, cpu->y, cpu->flags, cpu->sp, (unsigned long long)cpu->cycles, text);
+    printf("PPU: LINE=%d DOT=%d CYC=%llu CTRL=%02X MASK=%02X STATUS=%02X V=%04X T=%04X\n",
+        ppu->scanline, ppu->beam, (unsigned long long)ppu->cycles,
+        ppu->regs[PPUIR_CTRL], ppu->regs[PPUIR_MASK], ppu->regs[PPUIR_STATUS], (unsigned)ppu->v, ppu->t);
+}
@@ -0,0 +1,484 @@
+// Headless fuzzer: runs many seeded instances of a ROM across cores, each one
+// corrupting RAM on its own schedule like the Fun window does, and reports the
+// ones that crash, hang or freeze. A failure is cut down to the fewest
+// corruptions that still cause it and saved as a case file that -r replays.
+#include "neske.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// NMI off for 3 seconds after running with it on
+#define FUZZ_HANG_FRAMES 180
+// Nothing on screen changed for 10 seconds
+#define FUZZ_STUCK_FRAMES 600
+// Corruptions start after this, the game gets to boot first
+#define FUZZ_FIRST_CORRUPTION 60
+// Replays spent on cutting down one failure
+#define FUZZ_MINIMIZE_RUNS 64
+// Start is only pressed in the first seconds, to get past the title screen.
+// Pausing later would look like a frozen game.
+#define FUZZ_START_FRAMES 300
+
+enum fuzz_result
+{
+    FUZZ_OK,
+    FUZZ_CRASH,
+    FUZZ_HANG,
+    FUZZ_STUCK,
+    FUZZ_RESULTS
+};
+
+static const char *fuzz_result_names[FUZZ_RESULTS] = { "ok", "crash", "hang", "stuck" };
+
+struct fuzz_poke
+{
+    uint32_t frame;
+    uint16_t addr;
+    uint8_t value;
+};
+
+struct fuzz_run
+{
+    uint64_t input_seed;
+    int frames;
+
+    // With rtc.level set the corruptions are made up from frame rtc_start on
+    // and recorded in pokes, otherwise the ones in pokes are made
+    struct rtc_state rtc;
+    int rtc_start;
+    struct fuzz_poke *pokes;
+    int poke_count;
+    int poke_cap;
+    // Judged from FUZZ_FIRST_CORRUPTION on without any corruptions, to see
+    // what the game does by itself
+    bool baseline;
+
+    enum fuzz_result result;
+    int fail_frame;
+};
+
+// What the PPU draws from, cheaper than the picture and changes with it
+static uint64_t fuzz_screen_hash(struct ppu *ppu)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    const uint8_t *parts[] = { ppu->vram, (const uint8_t *)ppu->oam, ppu->pallete };
+    size_t sizes[] = { sizeof ppu->vram, sizeof ppu->oam, sizeof ppu->pallete };
+
+    for (int p = 0; p < 3; p++)
+    {
+        for (size_t i = 0; i < sizes[p]; i++)
+        {
+            hash = (hash ^ parts[p][i]) * 1099511628211ULL;
+        }
+    }
+
+    hash = (hash ^ ppu->t ^ (uint64_t)ppu->x<<16 ^ (uint64_t)ppu->regs[PPUIR_CTRL]<<24 ^ (uint64_t)ppu->regs[PPUIR_MASK]<<32) * 1099511628211ULL;
+    return hash;
+}
+
+static void fuzz_add_poke(struct fuzz_run *run, struct fuzz_poke poke)
+{
+    if (run->poke_count == run->poke_cap)
+    {
+        run->poke_cap = run->poke_cap ? run->poke_cap*2 : 64;
+        run->pokes = realloc(run->pokes, run->poke_cap*sizeof(struct fuzz_poke));
+        assert(run->pokes != NULL);
+    }
+
+    run->pokes[run->poke_count++] = poke;
+}
+
+static void fuzz_write_state(FILE *fp, struct system *sys)
+{
+    struct ricoh_state *cpu = &sys->cpu;
+    struct ppu *ppu = &sys->ppu;
+
+    fprintf(fp, "# CPU: PC=%04X A=%02X X=%02X Y=%02X P=%02X SP=%02X CYC=%llu%s\n",
+        cpu->pc, cpu->a, cpu->x, cpu->y, cpu->flags, cpu->sp, (unsigned long long)cpu->cycles, cpu->crash ? " crashed" : "");
+    fprintf(fp, "# PPU: LINE=%d DOT=%d CTRL=%02X MASK=%02X STATUS=%02X V=%04X T=%04X\n",
+        ppu->scanline, ppu->beam, ppu->regs[PPUIR_CTRL], ppu->regs[PPUIR_MASK], ppu->regs[PPUIR_STATUS], (unsigned)ppu->v, ppu->t);
+
+    for (int addr = 0; addr < 0x2000; addr += 32)
+    {
+        fprintf(fp, "# %04X:", addr);
+        for (int i = 0; i < 32; i++)
+        {
+            fprintf(fp, " %02X", sys->memory[addr+i]);
+        }
+        fprintf(fp, "\n");
+    }
+}
+
+// Runs one instance from power on. state gets the machine as it was at the end.
+static void fuzz_run(struct rom_image *image, struct fuzz_run *run, FILE *state)
+{
+    struct player player = player_init(image, (struct mux_api){ NULL, headless_mux_nop, headless_mux_nop });
+    assert(player.is_valid);
+    struct system *sys = player_get_system(&player);
+
+    // Only the timing is needed, not the picture
+    player_set_skip_render(&player, true);
+
+    uint64_t input_rng = run->input_seed;
+    int hold = 0;
+    struct controller_state controller = { 0 };
+
+    bool corrupted = false;
+    bool nmi_seen = false;
+    int nmi_off_frames = 0;
+    uint64_t screen = 0;
+    int same_frames = 0;
+    int next_poke = 0;
+
+    run->result = FUZZ_OK;
+
+    int frame = 0;
+    for (; frame < run->frames; frame++)
+    {
+        // The input has a stream of its own, so dropping corruptions leaves it as it was
+        headless_next_input(&input_rng, frame, FUZZ_START_FRAMES, &hold, &controller);
+        player_set_controller(&player, controller);
+
+        struct rtc_poke poke;
+        if (run->rtc.level)
+        {
+            if (frame >= run->rtc_start && rtc_iter(&run->rtc, sys, &poke))
+            {
+                fuzz_add_poke(run, (struct fuzz_poke){ frame, poke.addr, poke.value });
+                corrupted = true;
+            }
+        }
+        else
+        {
+            for (; next_poke < run->poke_count && run->pokes[next_poke].frame == frame; next_poke++)
+            {
+                sys->memory[run->pokes[next_poke].addr] = run->pokes[next_poke].value;
+                corrupted = true;
+            }
+        }
+
+        player_frame(&player);
+
+        if (player_crash(&player))
+        {
+            run->result = FUZZ_CRASH;
+            break;
+        }
+
+        bool nmi = sys->ppu.regs[PPUIR_CTRL] & 0x80;
+        nmi_seen |= nmi;
+        nmi_off_frames = nmi ? 0 : nmi_off_frames+1;
+
+        uint64_t hash = fuzz_screen_hash(&sys->ppu);
+        same_frames = hash == screen ? same_frames+1 : 0;
+        screen = hash;
+
+        // Games are allowed to do anything before the first corruption
+        corrupted |= run->baseline && frame >= FUZZ_FIRST_CORRUPTION;
+        if (corrupted && nmi_seen && nmi_off_frames >= FUZZ_HANG_FRAMES)
+        {
+            run->result = FUZZ_HANG;
+            break;
+        }
+        if (corrupted && same_frames >= FUZZ_STUCK_FRAMES)
+        {
+            run->result = FUZZ_STUCK;
+            break;
+        }
+    }
+
+    run->fail_frame = frame;
+
+    if (state)
+    {
+        fuzz_write_state(state, sys);
+    }
+
+    player_free(&player);
+}
+
+// Drops corruptions for as long as the same failure still happens without them
+static void fuzz_minimize(struct rom_image *image, struct fuzz_run *failed)
+{
+    // Whatever came after the failure didn't cause it
+    while (failed->poke_count && failed->pokes[failed->poke_count-1].frame > (uint32_t)failed->fail_frame)
+    {
+        failed->poke_count--;
+    }
+
+    struct fuzz_run try = { failed->input_seed };
+    try.pokes = malloc((failed->poke_count+1)*sizeof(struct fuzz_poke));
+    assert(try.pokes != NULL);
+
+    int runs = 0;
+    for (int chunk = (failed->poke_count+1)/2; chunk >= 1 && runs < FUZZ_MINIMIZE_RUNS; chunk /= 2)
+    {
+        for (int at = 0; at < failed->poke_count && runs < FUZZ_MINIMIZE_RUNS; runs++)
+        {
+            int cut = at+chunk < failed->poke_count ? chunk : failed->poke_count-at;
+            memcpy(try.pokes, failed->pokes, at*sizeof(struct fuzz_poke));
+            memcpy(try.pokes+at, failed->pokes+at+cut, (failed->poke_count-at-cut)*sizeof(struct fuzz_poke));
+            try.poke_count = failed->poke_count-cut;
+            // A bit more room, the failure may show up later without the corruptions
+            try.frames = failed->fail_frame + FUZZ_STUCK_FRAMES + 1;
+            if (try.frames > failed->frames)
+            {
+                try.frames = failed->frames;
+            }
+
+            fuzz_run(image, &try, NULL);
+
+            if (try.result == failed->result)
+            {
+                memcpy(failed->pokes, try.pokes, try.poke_count*sizeof(struct fuzz_poke));
+                failed->poke_count = try.poke_count;
+                failed->fail_frame = try.fail_frame;
+            }
+            else
+            {
+                at += cut;
+            }
+        }
+    }
+
+    free(try.pokes);
+}
+
+static bool fuzz_write_case(struct rom_image *image, struct fuzz_run *run, const char *path, const char *rom_path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        printf("Can't write %s\n", path);
+        return false;
+    }
+
+    fprintf(fp, "# neske fuzz case, replay with: fuzz %s -r %s\n", rom_path, path);
+    fprintf(fp, "result %s\n", fuzz_result_names[run->result]);
+    fprintf(fp, "frames %d\n", run->fail_frame+1);
+    fprintf(fp, "inputs %016llx\n", (unsigned long long)run->input_seed);
+    for (int i = 0; i < run->poke_count; i++)
+    {
+        fprintf(fp, "poke %u %04X %02X\n", run->pokes[i].frame, run->pokes[i].addr, run->pokes[i].value);
+    }
+
+    // Replay once more for the machine state at the failure
+    struct fuzz_run replay = *run;
+    replay.rtc.level = 0;
+    replay.frames = run->fail_frame+1;
+    fprintf(fp, "# state at the end\n");
+    fuzz_run(image, &replay, fp);
+
+    return fclose(fp) == 0;
+}
+
+static bool fuzz_read_case(const char *path, struct fuzz_run *run)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        printf("Can't open %s\n", path);
+        return false;
+    }
+
+    char line[256];
+    unsigned long long seed;
+    unsigned frame, addr, value;
+
+    while (fgets(line, sizeof line, fp))
+    {
+        if (sscanf(line, "frames %d", &run->frames) == 1) continue;
+        if (sscanf(line, "inputs %llx", &seed) == 1) run->input_seed = seed;
+        if (sscanf(line, "poke %u %x %x", &frame, &addr, &value) == 3)
+        {
+            fuzz_add_poke(run, (struct fuzz_poke){ frame, addr & 0x1FFF, value });
+        }
+    }
+
+    fclose(fp);
+    return run->frames > 0;
+}
+
+struct fuzz_job
+{
+    workers_mutex mutex;
+    struct rom_image *image;
+    const char *rom_path;
+    uint64_t seed;
+    uint64_t input_seed;
+    int frames;
+    int instances;
+    // Failures the uncorrupted run has too aren't reported
+    bool ignore[FUZZ_RESULTS];
+
+    int next;
+    int done;
+    int counts[FUZZ_RESULTS];
+};
+
+static void fuzz_worker(void *arg)
+{
+    struct fuzz_job *job = arg;
+
+    for (;;)
+    {
+        workers_lock(&job->mutex);
+        int index = job->next++;
+        workers_unlock(&job->mutex);
+
+        if (index >= job->instances)
+        {
+            break;
+        }
+
+        // Each instance gets its own corruption schedule, the input is the same for all
+        uint64_t seed = job->seed + index;
+        uint64_t rng = seed;
+        struct fuzz_run run = { job->input_seed, job->frames };
+        run.rtc = rtc_make(1 + rtc_rand(&rng)%2, rtc_rand(&rng));
+        run.rtc.period = 1 + rtc_rand(&rng)%30;
+        run.rtc_start = FUZZ_FIRST_CORRUPTION + rtc_rand(&rng)%(job->frames/2 + 1);
+
+        fuzz_run(job->image, &run, NULL);
+
+        bool failed = run.result != FUZZ_OK && !job->ignore[run.result];
+        if (failed)
+        {
+            int made = run.poke_count;
+            fuzz_minimize(job->image, &run);
+
+            char path[64];
+            snprintf(path, sizeof path, "fuzz-%llu.txt", (unsigned long long)seed);
+            fuzz_write_case(job->image, &run, path, job->rom_path);
+
+            workers_lock(&job->mutex);
+            printf("Seed %llu: %s at frame %d, %d of %d corruptions needed, saved %s\n",
+                (unsigned long long)seed, fuzz_result_names[run.result], run.fail_frame, run.poke_count, made, path);
+            workers_unlock(&job->mutex);
+        }
+
+        workers_lock(&job->mutex);
+        job->counts[failed ? run.result : FUZZ_OK]++;
+        job->done++;
+        workers_unlock(&job->mutex);
+
+        free(run.pokes);
+    }
+}
+
+static void fuzz_usage()
+{
+    printf("usage: fuzz ROM [-n INSTANCES] [-f FRAMES] [-s SEED] [-j THREADS] [-r CASE]\n");
+    printf("  -n  instances to run, 256 by default\n");
+    printf("  -f  frames each instance runs, 1800 by default\n");
+    printf("  -s  first seed, the instances use the ones after it\n");
+    printf("  -j  threads, one per core by default\n");
+    printf("  -r  replay a saved case and print the state it ends in\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *rom_path = NULL;
+    const char *case_path = NULL;
+    int instances = 256;
+    int frames = 1800;
+    int threads = workers_cpu_count();
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i+1 < argc)      instances = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i+1 < argc) frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-j") == 0 && i+1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) case_path = argv[++i];
+        else if (argv[i][0] != '-' && !rom_path)           rom_path = argv[i];
+        else
+        {
+            fuzz_usage();
+            return 1;
+        }
+    }
+
+    if (!rom_path || instances <= 0 || frames <= 0 || threads <= 0)
+    {
+        fuzz_usage();
+        return 1;
+    }
+
+    struct fuzz_job job = { 0 };
+    workers_mutex_init(&job.mutex);
+
+    // Players on every thread share the mapped ROM
+    struct rom_cache roms = rom_cache_make((struct mux_api){ &job.mutex, workers_lock, workers_unlock });
+    struct rom_image *image = rom_cache_open(&roms, rom_path);
+    if (!image)
+    {
+        return 1;
+    }
+
+    struct player check = player_init(image, (struct mux_api){ NULL, headless_mux_nop, headless_mux_nop });
+    if (!check.is_valid)
+    {
+        printf("Can't run %s\n", rom_path);
+        return 1;
+    }
+    player_free(&check);
+
+    if (case_path)
+    {
+        struct fuzz_run run = { 0 };
+        if (!fuzz_read_case(case_path, &run))
+        {
+            printf("%s isn't a fuzz case\n", case_path);
+            return 1;
+        }
+
+        fuzz_run(image, &run, stdout);
+        printf("%s: %s at frame %d\n", case_path, fuzz_result_names[run.result], run.fail_frame);
+        free(run.pokes);
+        rom_image_release(image);
+        return run.result == FUZZ_OK ? 0 : 2;
+    }
+
+    job.image = image;
+    job.rom_path = rom_path;
+    job.seed = seed;
+    uint64_t input_rng = seed;
+    job.input_seed = rtc_rand(&input_rng);
+    job.frames = frames;
+    job.instances = instances;
+
+    // The same input without corruptions shows what the game does by itself
+    struct fuzz_run baseline = { job.input_seed, frames };
+    baseline.baseline = true;
+    fuzz_run(image, &baseline, NULL);
+    if (baseline.result == FUZZ_CRASH)
+    {
+        printf("%s crashes at frame %d without corruptions, nothing to fuzz\n", rom_path, baseline.fail_frame);
+        return 1;
+    }
+    if (baseline.result != FUZZ_OK)
+    {
+        printf("Without corruptions the game looks %s at frame %d, not reporting that\n", fuzz_result_names[baseline.result], baseline.fail_frame);
+        job.ignore[baseline.result] = true;
+    }
+
+    uint64_t start = headless_now_ns();
+
+    workers_run(threads, fuzz_worker, &job);
+
+    double seconds = (headless_now_ns() - start) / 1e9;
+
+    printf("%d instances of %d frames in %.1f s on %d threads, %.1f instances/s\n",
+        job.done, frames, seconds, threads, job.done/seconds);
+    for (int i = 0; i < FUZZ_RESULTS; i++)
+    {
+        printf("%-6s %d\n", fuzz_result_names[i], job.counts[i]);
+    }
+
+    rom_image_release(image);
+
+    return job.counts[FUZZ_OK] == job.done ? 0 : 2;
+}
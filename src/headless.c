@@ -0,0 +1,86 @@
+// What the headless tools share: a clock, a mutex for running on one thread,
+// made up input and drawing from the PPU log like the SDL front end.
+#include "neske.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t headless_now_ns()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart * (1e9 / freq.QuadPart));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+#endif
+}
+
+void headless_mux_nop(void *mux)
+{
+}
+
+// Buttons held for 8 to 63 frames, never Select. Start now and then before
+// start_frames, to get past title screens without pausing the game later.
+void headless_next_input(uint64_t *rng, int frame, int start_frames, int *hold, struct controller_state *controller)
+{
+    if (--*hold > 0)
+    {
+        return;
+    }
+
+    uint64_t bits = rtc_rand(rng);
+    *hold = 8 + bits%56;
+    bits >>= 8;
+
+    for (int i = 0; i < 8; i++)
+    {
+        controller->btns[i] = (bits >> i) & 1;
+    }
+    controller->btns[BTN_SELECT] = false;
+    controller->btns[BTN_START] = frame < start_frames && (bits & 0x300) == 0;
+}
+
+// The emulating PPU only keeps timing and logs what it did, the replica
+// replays the log after each frame to draw
+struct headless_replay
+{
+    struct ppu replica;
+    struct ppu_log log;
+};
+
+struct headless_replay *headless_replay_make(struct system *sys)
+{
+    struct headless_replay *replay = calloc(1, sizeof(struct headless_replay));
+    assert(replay != NULL);
+
+    ppu_clone(&replay->replica, &sys->ppu);
+    sys->ppu.log = &replay->log;
+    sys->ppu.skip_render = true;
+
+    return replay;
+}
+
+void headless_replay_frame(struct headless_replay *replay, struct system *sys)
+{
+    replay->log.end_cycle = sys->ppu.cycles;
+    ppu_log_replay(&replay->replica, &replay->log, NULL);
+    ppu_log_clear(&replay->log);
+}
+
+void headless_replay_free(struct headless_replay *replay, struct system *sys)
+{
+    sys->ppu.log = NULL;
+    ppu_log_free(&replay->log);
+    free(replay);
+}
@@ -1,49 +1,319 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 #include "neske.h"
 
-struct imap *imap_mk()
+#define IMAP_INSTRS_INITIAL 256
+#define IMAP_ADDRS_INITIAL 64
+
+static void imap_push_addr(struct imap_addrs *list, uint16_t addr)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity*2 : IMAP_ADDRS_INITIAL;
+        list->addr = realloc(list->addr, list->capacity*sizeof(uint16_t));
+        assert(list->addr != NULL);
+    }
+
+    list->addr[list->count++] = addr;
+}
+
+static struct imap_instr *imap_alloc(struct imap_bank *bank, uint16_t offset)
+{
+    if (bank->count == bank->capacity)
+    {
+        // The offset table holds indices, so growing doesn't invalidate it
+        bank->capacity = bank->capacity ? bank->capacity*2 : IMAP_INSTRS_INITIAL;
+        bank->instrs = realloc(bank->instrs, bank->capacity*sizeof(struct imap_instr));
+        assert(bank->instrs != NULL);
+    }
+
+    bank->index[offset] = ++bank->count;
+    return &bank->instrs[bank->count-1];
+}
+
+static uint8_t imap_bank_read(void *instance, uint16_t addr)
+{
+    struct imap_bank *bank = (struct imap_bank *)instance;
+    return bank->data[(addr-bank->base) & (IMAP_BANK_SIZE-1)];
+}
+
+static void imap_bank_write(void *instance, uint16_t addr, uint8_t val)
+{
+}
+
+// Queues a jump target, targets in other windows are routed after the round
+static void imap_follow(struct imap_bank *bank, uint16_t addr)
 {
-    struct imap *result = calloc(sizeof (struct imap), 1);
+    if (addr >= bank->base && addr - bank->base < IMAP_BANK_SIZE)
+    {
+        if (!bank->index[addr-bank->base])
+        {
+            imap_push_addr(&bank->seeds, addr-bank->base);
+        }
+    }
+    else if (addr >= 0x8000)
+    {
+        imap_push_addr(&bank->exits, addr);
+    }
+}
 
-    return result;
+// Decodes everything reachable from the bank's seeds without leaving its window
+static void imap_analyze_bank(void *arg, int index)
+{
+    struct imap *imap = (struct imap *)arg;
+    struct imap_bank *bank = &imap->banks[imap->round[index]];
+    struct ricoh_mem_interface mem = { bank, imap_bank_read, imap_bank_write };
+
+    while (bank->seeds.count > 0)
+    {
+        uint16_t offset = bank->seeds.addr[--bank->seeds.count];
+
+        while (offset < IMAP_BANK_SIZE && !bank->index[offset])
+        {
+            uint16_t at = bank->base + offset;
+            struct instr_decoded decoded = ricoh_decode_instr(&imap->decoder, &mem, at);
+
+            // Illegal opcodes and instructions cut by the window end are most likely data
+            if (decoded.id == _ICOUNT || offset + decoded.size > IMAP_BANK_SIZE)
+            {
+                break;
+            }
+
+            struct imap_instr *instr = imap_alloc(bank, offset);
+            instr->at = at;
+            instr->bank = bank - imap->banks;
+            instr->opcode = bank->data[offset];
+            instr->operand[0] = decoded.operand[0];
+            instr->operand[1] = decoded.operand[1];
+            instr->size = decoded.size;
+
+            uint16_t target = decoded.operand[0] | (decoded.operand[1]<<8);
+
+            if (decoded.addr_mode == AM_REL)
+            {
+                imap_follow(bank, at + 2 + (int8_t)decoded.operand[0]);
+            }
+            else if (decoded.id == JSR)
+            {
+                imap_follow(bank, target);
+            }
+            else if (decoded.id == JMP)
+            {
+                // Indirect jumps go wherever RAM says, nothing to follow
+                if (decoded.addr_mode == AM_ABS)
+                {
+                    imap_follow(bank, target);
+                }
+                break;
+            }
+            else if (decoded.id == RTS || decoded.id == RTI || decoded.id == BRK)
+            {
+                break;
+            }
+
+            offset += decoded.size;
+            if (offset == IMAP_BANK_SIZE)
+            {
+                imap_follow(bank, at + decoded.size);
+            }
+        }
+    }
 }
 
-void imap_populate(struct imap *imap, struct ricoh_decoder *decoder, struct ricoh_mem_interface *mem, uint16_t entry)
+// Hands an address outside the window it was found in to the banks that can be mapped there
+static void imap_route(struct imap *imap, uint16_t addr)
 {
-    if (imap->addr[entry]) 
+    // Vectors can point into RAM or the cartridge's $6000-$7FFF, no PRG banks there
+    if (addr < 0x8000)
     {
         return;
     }
-    
-    struct instr_decoded decoded = ricoh_decode_instr(decoder, mem, entry);
-    struct print_instr *prev = NULL;
 
-    while (decoded.id != RTS && decoded.id != RTI && decoded.id != BRK)
+    int window = (addr-0x8000)/IMAP_BANK_SIZE;
+    uint16_t base = 0x8000 + window*IMAP_BANK_SIZE;
+    uint16_t offset = addr & (IMAP_BANK_SIZE-1);
+
+    for (size_t i = 0; i < imap->bank_count; i++)
     {
-        struct print_instr *pi = calloc(1, sizeof(struct print_instr));
-        ricoh_format_decoded_instr(pi->value, decoded);
-        pi->at = entry;
-        imap->addr[entry] = pi;
+        struct imap_bank *bank = &imap->banks[i];
+        bool mapped = imap->windows[window] == i;
 
-        if (prev)
+        // Banks switched in later are assumed to go where they were found
+        if ((mapped || (!bank->mapped && bank->base == base)) && !bank->index[offset])
         {
-            prev->next = pi;
-            pi->prev = prev;
+            imap_push_addr(&bank->seeds, offset);
         }
+    }
+}
+
+struct imap *imap_analyze(
+    struct ricoh_decoder decoder,
+    const uint8_t *prg, size_t prg_size,
+    const uint16_t windows[IMAP_WINDOWS],
+    struct pool_api *pool
+)
+{
+    assert(prg_size >= IMAP_BANK_SIZE && prg_size%IMAP_BANK_SIZE == 0);
+
+    struct imap *imap = calloc(1, sizeof(struct imap));
+    assert(imap != NULL);
+
+    imap->decoder = decoder;
+    imap->bank_count = prg_size/IMAP_BANK_SIZE;
+    memcpy(imap->windows, windows, sizeof(imap->windows));
+
+    imap->banks = calloc(imap->bank_count, sizeof(struct imap_bank));
+    imap->round = calloc(imap->bank_count, sizeof(int));
+    assert(imap->banks != NULL && imap->round != NULL);
+
+    for (size_t i = 0; i < imap->bank_count; i++)
+    {
+        struct imap_bank *bank = &imap->banks[i];
+        bank->data = prg + i*IMAP_BANK_SIZE;
+        bank->index = calloc(IMAP_BANK_SIZE, sizeof(uint16_t));
+        assert(bank->index != NULL);
+        // Unmapped banks are guessed to switch into $8000-$BFFF
+        bank->base = 0x8000 + (i%2)*IMAP_BANK_SIZE;
+    }
+
+    // Banks mapped in several windows use the last one, where the vectors are
+    for (int w = 0; w < IMAP_WINDOWS; w++)
+    {
+        assert(windows[w] < imap->bank_count);
+        struct imap_bank *bank = &imap->banks[windows[w]];
+        bank->base = 0x8000 + w*IMAP_BANK_SIZE;
+        bank->mapped = true;
+    }
+
+    const uint8_t *vectors = imap->banks[windows[IMAP_WINDOWS-1]].data + 0x1FFA;
+    for (int i = 0; i < 3; i++)
+    {
+        imap_route(imap, vectors[i*2] | (vectors[i*2+1]<<8));
+    }
+
+    // Each round decodes the banks with new seeds in parallel; jumps across windows
+    // are routed between rounds, when nothing else touches the banks
+    while (true)
+    {
+        int jobs = 0;
+        for (size_t i = 0; i < imap->bank_count; i++)
+        {
+            if (imap->banks[i].seeds.count > 0)
+            {
+                imap->round[jobs++] = i;
+            }
+        }
+
+        if (jobs == 0)
+        {
+            break;
+        }
+
+        if (pool && jobs > 1)
+        {
+            pool->run(pool->pool, jobs, imap_analyze_bank, imap);
+        }
+        else
+        {
+            for (int i = 0; i < jobs; i++)
+            {
+                imap_analyze_bank(imap, i);
+            }
+        }
+
+        for (int i = 0; i < jobs; i++)
+        {
+            struct imap_bank *bank = &imap->banks[imap->round[i]];
+            for (uint32_t j = 0; j < bank->exits.count; j++)
+            {
+                imap_route(imap, bank->exits.addr[j]);
+            }
+            bank->exits.count = 0;
+        }
+    }
+
+    for (size_t i = 0; i < imap->bank_count; i++)
+    {
+        struct imap_bank *bank = &imap->banks[i];
+        free(bank->seeds.addr);
+        free(bank->exits.addr);
+        bank->seeds = bank->exits = (struct imap_addrs){ 0 };
+        bank->data = NULL;
+    }
+    free(imap->round);
+    imap->round = NULL;
+
+    return imap;
+}
+
+void imap_free(struct imap *imap)
+{
+    for (size_t i = 0; i < imap->bank_count; i++)
+    {
+        free(imap->banks[i].index);
+        free(imap->banks[i].instrs);
+    }
 
-        if (decoded.id == JSR)
+    free(imap->banks);
+    free(imap);
+}
+
+const struct imap_instr *imap_find(struct imap *imap, uint16_t bank, uint16_t addr)
+{
+    if (bank >= imap->bank_count)
+    {
+        return NULL;
+    }
+
+    struct imap_bank *b = &imap->banks[bank];
+    uint16_t index = b->index[addr & (IMAP_BANK_SIZE-1)];
+
+    return index ? &b->instrs[index-1] : NULL;
+}
+
+void imap_format(struct imap *imap, const struct imap_instr *instr, char *dest, size_t size)
+{
+    struct instr_decoded decoded = {
+        .id = imap->decoder.itbl[instr->opcode],
+        .addr_mode = imap->decoder.atbl[instr->opcode],
+        .operand = { instr->operand[0], instr->operand[1] },
+        .size = instr->size,
+    };
+
+    ricoh_format_decoded_instr(dest, size, decoded);
+}
+
+// Instruction ending right where instr starts
+static const struct imap_instr *imap_prev(struct imap *imap, const struct imap_instr *instr)
+{
+    for (int size = 1; size <= 3; size++)
+    {
+        const struct imap_instr *prev = imap_find(imap, instr->bank, instr->at - size);
+        if (prev && prev->size == size && ((instr->at - size) & (IMAP_BANK_SIZE-1)) < (instr->at & (IMAP_BANK_SIZE-1)))
         {
-            imap_populate(imap, decoder, mem, *(uint16_t*)decoded.operand);
+            return prev;
         }
+    }
+
+    return NULL;
+}
+
+static const struct imap_instr *imap_next(struct imap *imap, const struct imap_instr *instr)
+{
+    uint16_t next = instr->at + instr->size;
 
-        entry += decoded.size;
-        decoded = ricoh_decode_instr(decoder, mem, entry);
-        prev = pi;
+    // Running off the bank continues in whatever is mapped next
+    if ((next & (IMAP_BANK_SIZE-1)) < (instr->at & (IMAP_BANK_SIZE-1)))
+    {
+        return NULL;
     }
+
+    return imap_find(imap, instr->bank, next);
 }
 
-void imap_list_range(struct imap *imap, uint16_t entry, struct print_instr **dest, int from, int to)
+void imap_list_range(struct imap *imap, uint16_t bank, uint16_t addr, const struct imap_instr **dest, int from, int to)
 {
     int size = -from + to;
 
@@ -51,26 +321,116 @@ void imap_list_range(struct imap *imap, uint16_t entry, struct print_instr **des
     {
         dest[i] = NULL;
     }
-    
-    if (imap->addr[entry] == NULL)
+
+    const struct imap_instr *instr = imap_find(imap, bank, addr);
+    if (!instr)
     {
         return;
     }
 
-
-    struct print_instr *pi = imap->addr[entry];
-
-    while (pi->prev && from != 0)
+    const struct imap_instr *prev;
+    while (from != 0 && (prev = imap_prev(imap, instr)))
     {
         from++;
-        pi = pi->prev;
+        instr = prev;
     }
 
     int start = -from;
 
-    for (int i = start; pi && i < size; i++)
+    for (int i = start; instr && i < size; i++)
     {
-        dest[i] = pi;
-        pi = pi->next;
-    } 
-}
\ No newline at end of file
+        dest[i] = instr;
+        instr = imap_next(imap, instr);
+    }
+}
+
+int imap_list_addr_range(struct imap *imap, uint16_t bank, uint16_t lo, uint16_t hi, const struct imap_instr **dest, int max)
+{
+    int count = 0;
+
+    if (bank >= imap->bank_count)
+    {
+        return 0;
+    }
+
+    struct imap_bank *b = &imap->banks[bank];
+    uint32_t from = lo & (IMAP_BANK_SIZE-1);
+    uint32_t to = hi - lo + from;
+    if (to >= IMAP_BANK_SIZE) to = IMAP_BANK_SIZE-1;
+
+    for (uint32_t offset = from; offset <= to && count < max; offset++)
+    {
+        if (b->index[offset])
+        {
+            dest[count++] = &b->instrs[b->index[offset]-1];
+        }
+    }
+
+    return count;
+}
+
+static uint64_t imap_hash(const uint8_t *prg, size_t prg_size, const uint16_t windows[IMAP_WINDOWS])
+{
+    uint64_t hash = 1469598103934665603ULL;
+
+    for (size_t i = 0; i < prg_size; i++)
+    {
+        hash = (hash ^ prg[i]) * 1099511628211ULL;
+    }
+    for (int i = 0; i < IMAP_WINDOWS; i++)
+    {
+        hash = (hash ^ windows[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+struct imap_cache imap_cache_make(struct mux_api mux)
+{
+    return (struct imap_cache){ mux, NULL };
+}
+
+struct imap *imap_cache_analyze(
+    struct imap_cache *cache,
+    struct ricoh_decoder decoder,
+    const uint8_t *prg, size_t prg_size,
+    const uint16_t windows[IMAP_WINDOWS],
+    struct pool_api *pool
+)
+{
+    uint64_t hash = imap_hash(prg, prg_size, windows);
+
+    cache->mux.lock(cache->mux.mux);
+
+    for (struct imap *imap = cache->imaps; imap; imap = imap->next)
+    {
+        if (imap->hash == hash && imap->bank_count*IMAP_BANK_SIZE == prg_size)
+        {
+            cache->mux.unlock(cache->mux.mux);
+            return imap;
+        }
+    }
+
+    // Analyzing under the lock keeps two players of one ROM from doing it twice
+    struct imap *imap = imap_analyze(decoder, prg, prg_size, windows, pool);
+    imap->hash = hash;
+    imap->next = cache->imaps;
+    cache->imaps = imap;
+
+    cache->mux.unlock(cache->mux.mux);
+
+    return imap;
+}
+
+void imap_cache_free(struct imap_cache *cache)
+{
+    struct imap *imap = cache->imaps;
+    while (imap)
+    {
+        struct imap *next = imap->next;
+        imap_free(imap);
+        imap = next;
+    }
+
+    cache->imaps = NULL;
+}
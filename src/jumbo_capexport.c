@@ -0,0 +1,2 @@
+#include "core.c"
+#include "capexport.c"
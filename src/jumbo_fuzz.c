@@ -0,0 +1,4 @@
+#include "core.c"
+#include "headless.c"
+#include "workers.c"
+#include "fuzz.c"
@@ -0,0 +1,3 @@
+#include "core.c"
+#include "headless.c"
+#include "lockstep.c"
@@ -0,0 +1,336 @@
+// Differential check of the fast paths: runs a ROM twice side by side with the
+// same input. The reference keeps the CPU in step with the PPU and draws on it.
+// The fast one runs the CPU ahead and draws from the PPU log, like the SDL
+// front end. Reports the first instruction or frame where the two disagree.
+#include "neske.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOCKSTEP_FPS 60
+
+// One of the two machines
+struct lockstep_side
+{
+    const char *name;
+    struct player player;
+    struct system *sys;
+    // What gets drawn, sys->ppu or the replica
+    struct ppu *drawn;
+    struct headless_replay *replay;
+};
+
+static bool lockstep_init(struct lockstep_side *side, const char *name, struct rom_image *image, bool fast, bool trace)
+{
+    side->name = name;
+    side->player = player_init(image, (struct mux_api){ NULL, headless_mux_nop, headless_mux_nop });
+    if (!side->player.is_valid)
+    {
+        return false;
+    }
+
+    side->sys = player_get_system(&side->player);
+    side->drawn = &side->sys->ppu;
+
+    // Cartridge RAM is blank on both, whatever .sav is next to the ROM
+    struct save_ram *save_ram = player_get_save_ram(&side->player);
+    if (save_ram)
+    {
+        memset(save_ram->data, 0, SAVE_RAM_SIZE);
+    }
+
+    if (fast)
+    {
+        side->replay = headless_replay_make(side->sys);
+        side->drawn = &side->replay->replica;
+    }
+    else
+    {
+        side->sys->lockstep = true;
+    }
+
+    if (trace)
+    {
+        side->sys->trace = trace_make();
+    }
+
+    return true;
+}
+
+static void lockstep_frame(struct lockstep_side *side, struct controller_state controller)
+{
+    player_set_controller(&side->player, controller);
+    player_frame(&side->player);
+
+    if (side->replay)
+    {
+        headless_replay_frame(side->replay, side->sys);
+    }
+}
+
+static void lockstep_free(struct lockstep_side *side)
+{
+    if (side->sys && side->sys->trace)
+    {
+        trace_free(side->sys->trace);
+        side->sys->trace = NULL;
+    }
+    if (side->replay)
+    {
+        headless_replay_free(side->replay, side->sys);
+    }
+    player_free(&side->player);
+}
+
+// First byte where two blocks differ, -1 if they're the same
+static long lockstep_first_diff(const void *a, const void *b, size_t size)
+{
+    if (memcmp(a, b, size) == 0)
+    {
+        return -1;
+    }
+
+    const uint8_t *pa = a, *pb = b;
+    size_t i = 0;
+    while (pa[i] == pb[i])
+    {
+        i++;
+    }
+    return i;
+}
+
+// Compares the instructions both ran this frame, from *checked on. Prints the
+// first one that differs with the ones before it.
+static bool lockstep_check_trace(struct lockstep_side *ref, struct lockstep_side *fast, uint64_t *checked, int frame, int context)
+{
+    struct trace *a = ref->sys->trace, *b = fast->sys->trace;
+
+    if (a->count-*checked > TRACE_SIZE || b->count-*checked > TRACE_SIZE)
+    {
+        printf("Frame %d: more than %d instructions, the trace lost some, try without -i\n", frame, TRACE_SIZE);
+        return false;
+    }
+
+    for (; *checked < a->count && *checked < b->count; (*checked)++)
+    {
+        const struct trace_entry *want = trace_get(a, *checked);
+        const struct trace_entry *got = trace_get(b, *checked);
+        char fields[64];
+        trace_diff(got, want, fields, sizeof fields);
+        if (!fields[0])
+        {
+            continue;
+        }
+
+        char line[160];
+        uint64_t first = *checked > (uint64_t)context ? *checked-context : 0;
+        for (uint64_t i = first; i < *checked; i++)
+        {
+            trace_format(line, sizeof line, trace_get(a, i));
+            printf("      %s\n", line);
+        }
+        trace_format(line, sizeof line, want);
+        printf("%-5s %s\n", ref->name, line);
+        trace_format(line, sizeof line, got);
+        printf("%-5s %s\n", fast->name, line);
+        printf("Frame %d, instruction %llu differs in%s\n", frame, (unsigned long long)*checked+1, fields);
+        return false;
+    }
+
+    if (a->count != b->count)
+    {
+        printf("Frame %d: %s ran %llu instructions, %s %llu\n", frame,
+            ref->name, (unsigned long long)a->count, fast->name, (unsigned long long)b->count);
+        return false;
+    }
+
+    return true;
+}
+
+// Compares the machines at the end of a frame, prints the first part that differs
+static bool lockstep_check_frame(struct lockstep_side *ref, struct lockstep_side *fast, int frame)
+{
+    struct ricoh_state *ca = &ref->sys->cpu, *cb = &fast->sys->cpu;
+    if (ca->pc != cb->pc || ca->a != cb->a || ca->x != cb->x || ca->y != cb->y || ca->sp != cb->sp
+        || ca->flags != cb->flags || ca->cycles != cb->cycles || ca->crash != cb->crash)
+    {
+        printf("Frame %d: CPU differs\n", frame);
+        printf("%-5s PC=%04X A=%02X X=%02X Y=%02X P=%02X SP=%02X CYC=%llu\n", ref->name,
+            ca->pc, ca->a, ca->x, ca->y, ca->flags, ca->sp, (unsigned long long)ca->cycles);
+        printf("%-5s PC=%04X A=%02X X=%02X Y=%02X P=%02X SP=%02X CYC=%llu\n", fast->name,
+            cb->pc, cb->a, cb->x, cb->y, cb->flags, cb->sp, (unsigned long long)cb->cycles);
+        return false;
+    }
+
+    long at = lockstep_first_diff(ref->sys->memory, fast->sys->memory, 0x800);
+    if (at >= 0)
+    {
+        printf("Frame %d: RAM differs at $%04lX, %s has %02X, %s %02X\n", frame, at,
+            ref->name, ref->sys->memory[at], fast->name, fast->sys->memory[at]);
+        return false;
+    }
+
+    struct save_ram *sa = player_get_save_ram(&ref->player), *sb = player_get_save_ram(&fast->player);
+    if (sa && sb && (at = lockstep_first_diff(sa->data, sb->data, SAVE_RAM_SIZE)) >= 0)
+    {
+        printf("Frame %d: cartridge RAM differs at $%04lX, %s has %02X, %s %02X\n", frame, 0x6000+at,
+            ref->name, sa->data[at], fast->name, sb->data[at]);
+        return false;
+    }
+
+    // A crash stops the frame wherever the PPU happens to be
+    if (ca->crash)
+    {
+        return true;
+    }
+
+    struct ppu *pa = &ref->sys->ppu, *pb = &fast->sys->ppu;
+    const char *part = NULL;
+    if (pa->cycles != pb->cycles || pa->scanline != pb->scanline || pa->beam != pb->beam) part = "timing";
+    else if (memcmp(pa->regs, pb->regs, sizeof pa->regs) != 0) part = "registers";
+    else if (pa->v != pb->v || pa->t != pb->t || pa->x != pb->x || pa->w != pb->w) part = "scroll";
+    else if ((at = lockstep_first_diff(pa->vram, pb->vram, sizeof pa->vram)) >= 0) part = "nametables";
+    else if ((at = lockstep_first_diff(pa->pallete, pb->pallete, sizeof pa->pallete)) >= 0) part = "palette";
+    else if ((at = lockstep_first_diff(pa->oam, pb->oam, sizeof pa->oam)) >= 0) part = "OAM";
+    else if ((at = lockstep_first_diff(pa->pins.chr, pb->pins.chr, sizeof pa->pins.chr)) >= 0) part = "CHR";
+    else if (pa->pins.mirroring_mode != pb->pins.mirroring_mode) part = "mirroring";
+    if (part)
+    {
+        printf("Frame %d: PPU %s differs\n", frame, part);
+        printf("%-5s LINE=%d DOT=%d CYC=%llu CTRL=%02X MASK=%02X STATUS=%02X V=%04X T=%04X\n", ref->name,
+            pa->scanline, pa->beam, (unsigned long long)pa->cycles, pa->regs[PPUIR_CTRL], pa->regs[PPUIR_MASK], pa->regs[PPUIR_STATUS], (unsigned)pa->v, pa->t);
+        printf("%-5s LINE=%d DOT=%d CYC=%llu CTRL=%02X MASK=%02X STATUS=%02X V=%04X T=%04X\n", fast->name,
+            pb->scanline, pb->beam, (unsigned long long)pb->cycles, pb->regs[PPUIR_CTRL], pb->regs[PPUIR_MASK], pb->regs[PPUIR_STATUS], (unsigned)pb->v, pb->t);
+        return false;
+    }
+
+    if ((at = lockstep_first_diff(ref->drawn->screen, fast->drawn->screen, sizeof ref->drawn->screen)) >= 0)
+    {
+        printf("Frame %d: picture differs from x=%ld y=%ld, %s has color %02X, %s %02X\n", frame, at%256, at/256,
+            ref->name, ref->drawn->screen[at], fast->name, fast->drawn->screen[at]);
+        return false;
+    }
+    if ((at = lockstep_first_diff(ref->drawn->emphasis, fast->drawn->emphasis, sizeof ref->drawn->emphasis)) >= 0)
+    {
+        printf("Frame %d: emphasis of row %ld differs\n", frame, at);
+        return false;
+    }
+
+    return true;
+}
+
+static void lockstep_usage()
+{
+    printf("usage: lockstep ROM [-f FRAMES] [-m MOVIE.fm2] [-s SEED] [-i] [-c LINES]\n");
+    printf("  -f  frames to run, 3600 by default\n");
+    printf("  -m  FCEUX movie to take the first controller from\n");
+    printf("  -s  seed of the random buttons pressed without a movie\n");
+    printf("  -i  compare every instruction, not just the state after each frame\n");
+    printf("  -c  instructions to show before a difference, 16 by default\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *rom_path = NULL;
+    const char *movie_path = NULL;
+    int frames = 3600;
+    uint64_t seed = 1;
+    bool by_instruction = false;
+    int context = 16;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-f") == 0 && i+1 < argc)      frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i+1 < argc) movie_path = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-c") == 0 && i+1 < argc) context = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-i") == 0)               by_instruction = true;
+        else if (argv[i][0] != '-' && !rom_path)           rom_path = argv[i];
+        else
+        {
+            lockstep_usage();
+            return 1;
+        }
+    }
+
+    if (!rom_path || frames <= 0 || context < 0 || context > TRACE_SIZE)
+    {
+        lockstep_usage();
+        return 1;
+    }
+
+    struct controller_state *movie = NULL;
+    int movie_frames = 0;
+    if (movie_path && !(movie = player_load_movie(movie_path, &movie_frames)))
+    {
+        printf("Can't read movie %s\n", movie_path);
+        return 1;
+    }
+
+    struct mux_api mux = { NULL, headless_mux_nop, headless_mux_nop };
+    struct rom_cache roms = rom_cache_make(mux);
+    struct rom_image *image = rom_cache_open(&roms, rom_path);
+    if (!image)
+    {
+        return 1;
+    }
+
+    struct lockstep_side ref = { 0 }, fast = { 0 };
+    bool valid = lockstep_init(&ref, "ref", image, false, by_instruction)
+        && lockstep_init(&fast, "fast", image, true, by_instruction);
+    rom_image_release(image);
+    if (!valid)
+    {
+        printf("Can't run %s\n", rom_path);
+        return 1;
+    }
+
+    uint64_t start = headless_now_ns();
+    uint64_t rng = seed;
+    int hold = 0;
+    struct controller_state controller = { 0 };
+    uint64_t checked = 0;
+    bool same = true;
+    int ran = 0;
+
+    for (int frame = 1; frame <= frames && same; frame++)
+    {
+        if (movie)
+        {
+            controller = movie[frame-1 < movie_frames ? frame-1 : movie_frames-1];
+        }
+        else
+        {
+            headless_next_input(&rng, frame, INT_MAX, &hold, &controller);
+        }
+
+        lockstep_frame(&ref, controller);
+        lockstep_frame(&fast, controller);
+        ran = frame;
+
+        same = (!by_instruction || lockstep_check_trace(&ref, &fast, &checked, frame, context))
+            && lockstep_check_frame(&ref, &fast, frame);
+
+        if (same && player_crash(&ref.player))
+        {
+            printf("Both crashed at frame %d\n", frame);
+            debug_report(ref.sys);
+            break;
+        }
+    }
+
+    double seconds = (headless_now_ns() - start) / 1e9;
+
+    if (same)
+    {
+        printf("%s: %d frames match in %.1f s, %.1fx real time for both\n", rom_path, ran, seconds, ran/seconds/LOCKSTEP_FPS);
+    }
+
+    lockstep_free(&ref);
+    lockstep_free(&fast);
+    free(movie);
+
+    return same ? 0 : 2;
+}
@@ -0,0 +1,288 @@
+#include "../neske.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+struct mapper_vtbl banked_vtbl = {
+    .new                = banked_new,
+    .free               = banked_free,
+    .frame              = banked_frame,
+    .generate_samples   = banked_generate_samples,
+    .reset              = banked_reset,
+    .crash              = banked_crash,
+    .set_controller     = banked_set_controller,
+    .get_system         = banked_get_system,
+    .get_save_ram       = banked_get_save_ram,
+    .enable_cdl         = banked_enable_cdl,
+};
+
+void banked_map_prg(struct banked *mapper, uint16_t addr, size_t size, size_t bank)
+{
+    assert(addr >= 0x8000 && size%BANKED_PRG_WINDOW == 0);
+
+    size_t offset = bank*size;
+    for (size_t i = 0; i < size/BANKED_PRG_WINDOW; i++)
+    {
+        size_t window_offset = (offset + i*BANKED_PRG_WINDOW) % mapper->rom.prg_size;
+        mapper->prg[(addr-0x8000)/BANKED_PRG_WINDOW + i] = mapper->rom.prg + window_offset;
+    }
+}
+
+void banked_map_chr(struct banked *mapper, uint16_t addr, size_t size, size_t bank)
+{
+    assert(addr < 0x2000 && size%BANKED_CHR_WINDOW == 0);
+
+    // CHR RAM stays in the PPU
+    if (mapper->rom.chr_size == 0)
+    {
+        return;
+    }
+
+    size_t offset = bank*size;
+    for (size_t i = 0; i < size/BANKED_CHR_WINDOW; i++)
+    {
+        size_t window_offset = (offset + i*BANKED_CHR_WINDOW) % mapper->rom.chr_size;
+        mapper->chr[addr/BANKED_CHR_WINDOW + i] = mapper->rom.chr + window_offset;
+    }
+}
+
+// Pushes windows and mirroring that changed since the last call into the PPU
+static void _banked_sync_ppu(struct banked *mapper, bool force)
+{
+    struct ppu *ppu = &mapper->system.ppu;
+
+    if (force || ppu->pins.mirroring_mode != mapper->mirroring)
+    {
+        ppu_set_mirroring(ppu, mapper->mirroring);
+    }
+
+    for (int i = 0; i < BANKED_CHR_WINDOWS; i++)
+    {
+        if (mapper->chr[i] && (force || mapper->chr[i] != mapper->chr_loaded[i]))
+        {
+            ppu_load_chr(ppu, i*BANKED_CHR_WINDOW, mapper->chr[i], BANKED_CHR_WINDOW);
+            mapper->chr_loaded[i] = mapper->chr[i];
+        }
+    }
+}
+
+void banked_update(struct banked *mapper)
+{
+    mapper->desc->update(mapper);
+    _banked_sync_ppu(mapper, false);
+}
+
+static uint8_t _banked_mem_read_mapped(struct banked *mapper, uint16_t addr);
+
+static uint8_t _banked_mem_read(void *mapper_data, uint16_t addr)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+    uint8_t val = _banked_mem_read_mapped(mapper, addr);
+
+    if ((mapper->system.debug.pages[addr>>8] & DEBUG_READ) && !mapper->system.fetching)
+    {
+        debug_check(&mapper->system, DEBUG_READ, addr, val);
+    }
+
+    return val;
+}
+
+static uint8_t _banked_mem_read_mapped(struct banked *mapper, uint16_t addr)
+{
+    if (addr >= 0x8000)
+    {
+        const uint8_t *ptr = mapper->prg[(addr-0x8000)/BANKED_PRG_WINDOW] + addr%BANKED_PRG_WINDOW;
+
+        if (mapper->cdl)
+        {
+            uint8_t flag = CDL_DATA;
+            if (mapper->system.fetching)
+            {
+                flag = addr == mapper->system.cpu.pc ? CDL_OPCODE : CDL_OPERAND;
+            }
+            mapper->cdl->prg[ptr - mapper->rom.prg] |= flag;
+        }
+
+        return *ptr;
+    }
+    else if (addr >= 0x6000)
+    {
+        return mapper->prg_ram.data[addr-0x6000];
+    }
+
+    uint8_t val = system_mem_read(&mapper->system, addr);
+
+    if (addr >= 0x2000 && addr < 0x4000 && mapper->desc->watch_read)
+    {
+        mapper->desc->watch_read(mapper, addr);
+    }
+
+    return val;
+}
+
+static void _banked_mem_write(void *mapper_data, uint16_t addr, uint8_t val)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+
+    if (mapper->system.debug.pages[addr>>8] & DEBUG_WRITE)
+    {
+        debug_check(&mapper->system, DEBUG_WRITE, addr, val);
+    }
+
+    if (addr >= 0x8000 && mapper->desc->write)
+    {
+        // Bank switches can change what the PPU is drawing
+        system_sync_ppu(&mapper->system);
+        mapper->desc->write(mapper, addr, val);
+        banked_update(mapper);
+    }
+    else if (addr >= 0x6000 && addr < 0x8000)
+    {
+        mapper->prg_ram.data[addr-0x6000] = val;
+        mapper->prg_ram.dirty |= 1u << ((addr-0x6000)/SAVE_PAGE_SIZE);
+    }
+    else
+    {
+        system_mem_write(&mapper->system, addr, val);
+
+        if (mapper->desc->watch)
+        {
+            mapper->desc->watch(mapper, addr, val);
+        }
+    }
+}
+
+void* banked_new(struct mapper_data data, struct mux_api apu_mux)
+{
+    const struct banked_desc *desc = data.banked;
+    assert(desc != NULL && desc->size >= sizeof(struct banked));
+
+    struct banked *mapper = calloc(1, desc->size);
+    assert(mapper != NULL);
+
+    mapper->desc = desc;
+    mapper->mirroring = data.mirroring;
+
+    mapper->rom = mapper_rom_share(&data);
+
+    if (desc->init && !desc->init(mapper, &data))
+    {
+        mapper_rom_free(&mapper->rom);
+        free(mapper);
+        return NULL;
+    }
+
+    // The reset vector is read through the PRG windows in system_init
+    desc->update(mapper);
+
+    mapper->system = system_init(apu_mux, (struct ricoh_mem_interface){
+        .instance = mapper,
+        .get = _banked_mem_read,
+        .set = _banked_mem_write,
+    });
+    _banked_sync_ppu(mapper, true);
+
+    // Code map of the banks as they're mapped now, shared by every player of the ROM
+    uint16_t windows[IMAP_WINDOWS];
+    for (int i = 0; i < IMAP_WINDOWS; i++)
+    {
+        windows[i] = banked_prg_bank(mapper, 0x8000 + i*BANKED_PRG_WINDOW);
+    }
+    struct rom_cache *cache = data.image->cache;
+    mapper->system.imap = imap_cache_analyze(&cache->imaps, mapper->system.decoder,
+        mapper->rom.prg, mapper->rom.prg_size, windows, cache->pool);
+
+    return mapper;
+}
+
+void banked_free(void *mapper_data)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+    banked_enable_cdl(mapper, false);
+    save_ram_free(&mapper->prg_ram);
+    mapper_rom_free(&mapper->rom);
+    free(mapper);
+}
+
+struct system_frame_result banked_frame(void *mapper_data)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+    return system_frame(&mapper->system);
+}
+
+void banked_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+    system_generate_samples(&mapper->system, samples, count);
+}
+
+void banked_reset(void *mapper_data)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+
+    if (mapper->desc->reset)
+    {
+        system_sync_ppu(&mapper->system);
+        mapper->desc->reset(mapper);
+        banked_update(mapper);
+    }
+
+    system_reset(&mapper->system);
+}
+
+bool banked_crash(void *mapper_data)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+    return mapper->system.cpu.crash;
+}
+
+void banked_set_controller(void *mapper_data, struct controller_state controller)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+    system_update_controller(&mapper->system, controller);
+}
+
+struct system *banked_get_system(void *mapper_data)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+    return &mapper->system;
+}
+
+struct save_ram *banked_get_save_ram(void *mapper_data)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+    return &mapper->prg_ram;
+}
+
+uint16_t banked_prg_bank(void *mapper_data, uint16_t addr)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+
+    if (addr < 0x8000)
+    {
+        return 0xFFFF;
+    }
+
+    return (mapper->prg[(addr-0x8000)/BANKED_PRG_WINDOW] - mapper->rom.prg) / BANKED_PRG_WINDOW;
+}
+
+struct cdl *banked_enable_cdl(void *mapper_data, bool enable)
+{
+    struct banked *mapper = (struct banked *)mapper_data;
+
+    if (enable && !mapper->cdl)
+    {
+        const char *path = mapper->rom.image ? mapper->rom.image->path : NULL;
+        mapper->cdl = cdl_make(mapper->rom.prg, mapper->rom.prg_size, mapper->rom.chr, mapper->rom.chr_size, path);
+    }
+    else if (!enable && mapper->cdl)
+    {
+        cdl_free(mapper->cdl);
+        mapper->cdl = NULL;
+    }
+
+    mapper->system.ppu.cdl = mapper->cdl;
+
+    return mapper->cdl;
+}
@@ -4,17 +4,6 @@
 #include <string.h>
 #include <stdio.h>
 
-struct mapper_vtbl m228_vtbl = {
-    .new                = m228_new,
-    .free               = m228_free,
-    .frame              = m228_frame,
-    .generate_samples   = m228_generate_samples,
-    .reset              = m228_reset,
-    .crash              = m228_crash,
-    .set_controller     = m228_set_controller,
-    .get_system         = m228_get_system,
-};
-
 struct parsed_data
 {
     size_t chr_bank;
@@ -51,106 +40,44 @@ static struct parsed_data _parse_data(struct m228 *mapper)
     return data;
 }
 
-static uint8_t _m228_mem_read(void *mapper_data, uint16_t addr)
-{
-    struct m228 *mapper = (struct m228 *)mapper_data;
-    struct parsed_data data = _parse_data(mapper);
-
-    if (addr >= 0x8000 && addr < 0xC000)
-    {
-        return mapper->rom.prg[addr - 0x8000 + data.prg_addr_1];
-    }
-    else if (addr >= 0xC000 && addr <= 0xFFFF)
-    {
-        return mapper->rom.prg[addr - 0xC000 + data.prg_addr_2];
-    }
-
-    return system_mem_read(&mapper->system, addr);
-}
-
-static void _update_chr_and_mirroring(struct m228 *mapper)
+static bool _m228_init(struct banked *mapper, struct mapper_data *data)
 {
-    struct parsed_data data = _parse_data(mapper);
-
-    memcpy(mapper->system.ppu.pins.chr, mapper->rom.chr+data.chr_bank*0x2000, 0x2000);
-    mapper->system.ppu.pins.mirroring_mode = data.mirroring;
-}
-
-static void _m228_mem_write(void *mapper_data, uint16_t addr, uint8_t val)
-{
-    struct m228 *mapper = (struct m228 *)mapper_data;
-    if (addr >= 0x8000 && addr <= 0xFFFF)
-    {
-        mapper->reg_data = val;
-        mapper->reg_addr = addr;
-        _update_chr_and_mirroring(mapper);
-    }
-    else
-    {
-        system_mem_write(&mapper->system, addr, val);
-    }
-}
-
-void* m228_new(struct mapper_data data, struct mux_api apu_mux)
-{
-    struct m228 *mapper = calloc(1, sizeof(struct m228));
-    assert(mapper != NULL);
+    struct m228 *m228 = (struct m228 *)mapper;
 
     printf("MAKE YOUR SELECTION, NOW!\n");
 
-    mapper->rom = mapper_rom_copy(&data);
+    m228->reg_data = 0x00;
+    m228->reg_addr = 0x8000;
 
-    mapper->system = system_init(apu_mux, (struct ricoh_mem_interface){
-        .instance = mapper,
-        .get = _m228_mem_read,
-        .set = _m228_mem_write,
-    });
-    
-    _m228_mem_write(mapper, 0x8000, 0x00);
-
-    return mapper;
+    return true;
 }
 
-void m228_free(void *mapper_data)
+static void _m228_write(struct banked *mapper, uint16_t addr, uint8_t val)
 {
-    struct m228 *mapper = (struct m228 *)mapper_data;
-    mapper_rom_free(&mapper->rom);
-    free(mapper);
+    struct m228 *m228 = (struct m228 *)mapper;
+    m228->reg_data = val;
+    m228->reg_addr = addr;
 }
 
-struct system_frame_result m228_frame(void *mapper_data)
+static void _m228_reset(struct banked *mapper)
 {
-    struct m228 *mapper = (struct m228 *)mapper_data;
-    return system_frame(&mapper->system);
+    _m228_write(mapper, 0x8000, 0x00);
 }
 
-void m228_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count)
+static void _m228_update(struct banked *mapper)
 {
-    struct m228 *mapper = (struct m228 *)mapper_data;
-    system_generate_samples(&mapper->system, samples, count);
-}
+    struct parsed_data data = _parse_data((struct m228 *)mapper);
 
-void m228_reset(void *mapper_data)
-{
-    struct m228 *mapper = (struct m228 *)mapper_data;
-    _m228_mem_write(mapper, 0x8000, 0x00);
-    system_reset(&mapper->system);
+    banked_map_prg(mapper, 0x8000, 0x4000, data.prg_addr_1/0x4000);
+    banked_map_prg(mapper, 0xC000, 0x4000, data.prg_addr_2/0x4000);
+    banked_map_chr(mapper, 0x0000, 0x2000, data.chr_bank);
+    mapper->mirroring = data.mirroring;
 }
 
-bool m228_crash(void *mapper_data)
-{
-    struct m228 *mapper = (struct m228 *)mapper_data;
-    return mapper->system.cpu.crash;
-}
-
-void m228_set_controller(void *mapper_data, struct controller_state controller)
-{
-    struct m228 *mapper = (struct m228 *)mapper_data;
-    system_update_controller(&mapper->system, controller);
-}
-
-struct system *m228_get_system(void *mapper_data)
-{
-    struct m228 *mapper = (struct m228 *)mapper_data;
-    return &mapper->system;
-}
\ No newline at end of file
+const struct banked_desc m228_banked = {
+    .size   = sizeof(struct m228),
+    .init   = _m228_init,
+    .write  = _m228_write,
+    .update = _m228_update,
+    .reset  = _m228_reset,
+};
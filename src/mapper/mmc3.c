@@ -0,0 +1,260 @@
+#include "../neske.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+// Dot on which A12 rises once per rendered line, -1 if it doesn't. The MMC3
+// only counts a rise after A12 was low for a few CPU cycles, so the short
+// lows between pattern fetches don't count, only a switch of pattern table
+// between the background and the objects does.
+static int _mmc3_a12_dot(struct ppu *ppu)
+{
+    uint8_t ctrl = ppu->regs[PPUIR_CTRL];
+    bool bg_high = ctrl & (1<<4);
+    bool obj_high = ctrl & (1<<3);
+
+    if (!(ppu->regs[PPUIR_MASK] & ((1<<3)|(1<<4))))
+    {
+        return -1;
+    }
+
+    // 8x16 objects pick the table by tile. Unused slots fetch tile $FF, which
+    // is in $1000, so that's where the fetches go unless a line has 8 objects
+    // from $0000.
+    if (ctrl & (1<<5))
+    {
+        obj_high = true;
+    }
+
+    // Background at $1000 rises when fetching the next line's tiles,
+    // objects at $1000 on the object fetches
+    if (bg_high && !obj_high)
+    {
+        return 324;
+    }
+    if (!bg_high && obj_high)
+    {
+        return 260;
+    }
+
+    return -1;
+}
+
+// Returns true if the counter asks for an IRQ
+static bool _mmc3_clock(struct mmc3 *mmc3)
+{
+    if (mmc3->irq_counter == 0 || mmc3->irq_reload)
+    {
+        mmc3->irq_counter = mmc3->irq_latch;
+        mmc3->irq_reload = false;
+    }
+    else
+    {
+        mmc3->irq_counter -= 1;
+    }
+
+    return mmc3->irq_counter == 0 && mmc3->irq_enabled;
+}
+
+// Brings the counter up to the PPU's current cycle, IRQs on the way were already scheduled
+static void _mmc3_irq_catch_up(struct mmc3 *mmc3)
+{
+    struct ppu *ppu = &mmc3->banked.system.ppu;
+
+    if (mmc3->irq_dot >= 0)
+    {
+        uint64_t cycle = ppu_next_line_dot_cycle(ppu, mmc3->irq_synced, mmc3->irq_dot);
+        while (cycle <= ppu->cycles)
+        {
+            _mmc3_clock(mmc3);
+            cycle = ppu_next_line_dot_cycle(ppu, cycle, mmc3->irq_dot);
+        }
+    }
+
+    mmc3->irq_synced = ppu->cycles;
+}
+
+// Works out when the counter will next ask for an IRQ, assuming the PPU setup stays as it is
+static void _mmc3_irq_schedule(struct mmc3 *mmc3)
+{
+    struct system *system = &mmc3->banked.system;
+
+    mmc3->irq_dot = _mmc3_a12_dot(&system->ppu);
+    system->irq_cycle = UINT64_MAX;
+
+    if (mmc3->irq_dot < 0 || !mmc3->irq_enabled)
+    {
+        return;
+    }
+
+    uint8_t counter = mmc3->irq_counter;
+    bool reload = mmc3->irq_reload;
+
+    // The counter reloads at most every 257 clocks
+    uint64_t cycle = mmc3->irq_synced;
+    for (int i = 0; i < 258; i++)
+    {
+        cycle = ppu_next_line_dot_cycle(&system->ppu, cycle, mmc3->irq_dot);
+        if (_mmc3_clock(mmc3))
+        {
+            system->irq_cycle = cycle;
+            break;
+        }
+    }
+
+    mmc3->irq_counter = counter;
+    mmc3->irq_reload = reload;
+}
+
+// Outside rendering the PPU address bus follows v, so PPUADDR and PPUDATA
+// accesses move A12 themselves and a rise clocks the counter
+static void _mmc3_bus(struct mmc3 *mmc3)
+{
+    struct system *system = &mmc3->banked.system;
+    struct ppu *ppu = &system->ppu;
+    bool enabled = ppu->regs[PPUIR_MASK] & ((1<<3)|(1<<4));
+
+    if (enabled && ppu->scanline < 240)
+    {
+        mmc3->a12 = false;
+        mmc3->a12_cycle = ppu->cycles;
+        return;
+    }
+
+    // Rendering ends on nametable fetches, which leave A12 low
+    uint64_t vblank_start = ppu->cycles - (uint64_t)((ppu->scanline-240)*341 + ppu->beam);
+    if (enabled && mmc3->a12_cycle < vblank_start)
+    {
+        mmc3->a12 = false;
+    }
+
+    bool a12 = ppu->v & 0x1000;
+    if (a12 && !mmc3->a12)
+    {
+        _mmc3_irq_catch_up(mmc3);
+        if (_mmc3_clock(mmc3))
+        {
+            system->cpu.irq = true;
+        }
+        _mmc3_irq_schedule(mmc3);
+    }
+
+    mmc3->a12 = a12;
+    mmc3->a12_cycle = ppu->cycles;
+}
+
+static bool _mmc3_init(struct banked *mapper, struct mapper_data *data)
+{
+    struct mmc3 *mmc3 = (struct mmc3 *)mapper;
+
+    mmc3->irq_dot = -1;
+
+    return true;
+}
+
+static void _mmc3_write(struct banked *mapper, uint16_t addr, uint8_t val)
+{
+    struct mmc3 *mmc3 = (struct mmc3 *)mapper;
+    bool odd = addr & 1;
+
+    if (addr < 0xA000)
+    {
+        if (!odd) mmc3->bank_select = val;
+        else      mmc3->regs[mmc3->bank_select & 7] = val;
+    }
+    else if (addr < 0xC000)
+    {
+        // Odd is PRG RAM protect, PRG RAM is always on here
+        if (!odd) mapper->mirroring = (val & 1) ? PPUMIR_HOR : PPUMIR_VER;
+    }
+    else
+    {
+        _mmc3_irq_catch_up(mmc3);
+
+        if (addr < 0xE000)
+        {
+            if (!odd)
+            {
+                mmc3->irq_latch = val;
+            }
+            else
+            {
+                mmc3->irq_counter = 0;
+                mmc3->irq_reload = true;
+            }
+        }
+        else
+        {
+            mmc3->irq_enabled = odd;
+            if (!odd)
+            {
+                // Disabling also acknowledges
+                mapper->system.cpu.irq = false;
+            }
+        }
+
+        _mmc3_irq_schedule(mmc3);
+    }
+}
+
+static void _mmc3_watch(struct banked *mapper, uint16_t addr, uint8_t val)
+{
+    struct mmc3 *mmc3 = (struct mmc3 *)mapper;
+
+    // PPUCTRL and PPUMASK decide if and when A12 rises
+    if (addr >= 0x2000 && addr < 0x4000 && (addr&7) <= 1)
+    {
+        _mmc3_irq_catch_up(mmc3);
+        _mmc3_irq_schedule(mmc3);
+    }
+    else if (addr >= 0x2000 && addr < 0x4000 && (addr&7) >= 6)
+    {
+        _mmc3_bus(mmc3);
+    }
+}
+
+static void _mmc3_watch_read(struct banked *mapper, uint16_t addr)
+{
+    if ((addr&7) == 7)
+    {
+        _mmc3_bus((struct mmc3 *)mapper);
+    }
+}
+
+static void _mmc3_update(struct banked *mapper)
+{
+    struct mmc3 *mmc3 = (struct mmc3 *)mapper;
+    size_t last = mapper->rom.prg_size/0x2000 - 1;
+    uint16_t chr_invert = (mmc3->bank_select & 0x80) ? 0x1000 : 0;
+
+    if (mmc3->bank_select & 0x40)
+    {
+        banked_map_prg(mapper, 0x8000, 0x2000, last-1);
+        banked_map_prg(mapper, 0xC000, 0x2000, mmc3->regs[6]&0x3F);
+    }
+    else
+    {
+        banked_map_prg(mapper, 0x8000, 0x2000, mmc3->regs[6]&0x3F);
+        banked_map_prg(mapper, 0xC000, 0x2000, last-1);
+    }
+    banked_map_prg(mapper, 0xA000, 0x2000, mmc3->regs[7]&0x3F);
+    banked_map_prg(mapper, 0xE000, 0x2000, last);
+
+    // R0 and R1 pick 2 KB banks, ignoring their low bit
+    banked_map_chr(mapper, 0x0000^chr_invert, 0x800, mmc3->regs[0]>>1);
+    banked_map_chr(mapper, 0x0800^chr_invert, 0x800, mmc3->regs[1]>>1);
+    banked_map_chr(mapper, 0x1000^chr_invert, 0x400, mmc3->regs[2]);
+    banked_map_chr(mapper, 0x1400^chr_invert, 0x400, mmc3->regs[3]);
+    banked_map_chr(mapper, 0x1800^chr_invert, 0x400, mmc3->regs[4]);
+    banked_map_chr(mapper, 0x1C00^chr_invert, 0x400, mmc3->regs[5]);
+}
+
+const struct banked_desc mmc3_banked = {
+    .size   = sizeof(struct mmc3),
+    .init   = _mmc3_init,
+    .write  = _mmc3_write,
+    .update = _mmc3_update,
+    .watch  = _mmc3_watch,
+    .watch_read = _mmc3_watch_read,
+};
@@ -0,0 +1,563 @@
+// Microbenchmarks for the hot paths, one subsystem at a time, with warmup and
+// repetitions. Results are written as JSON so two runs can be compared, -c
+// does that against an earlier file. Only needs the core.
+#include "neske.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MB_WARMUP 3
+#define MB_MAX_REPS 101
+#define MB_MAX_BENCHES 32
+
+struct mb_result
+{
+    const char *name;
+    const char *unit;
+    // Units done in one repetition
+    uint64_t ops;
+    int reps;
+    // Per unit
+    double min_ns;
+    double median_ns;
+    double mean_ns;
+    double max_ns;
+};
+
+struct mb_bench
+{
+    const char *name;
+    const char *unit;
+    uint64_t ops;
+    // Puts the state back before each repetition, not timed
+    void (*setup)(void *arg);
+    void (*run)(void *arg, uint64_t ops);
+    void *arg;
+};
+
+// Keeps results the compiler could otherwise drop
+static volatile uint64_t mb_sink;
+
+static int mb_double_cmp(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static struct mb_result mb_measure(struct mb_bench *bench, int reps)
+{
+    double times[MB_MAX_REPS];
+
+    for (int i = 0; i < MB_WARMUP + reps; i++)
+    {
+        if (bench->setup)
+        {
+            bench->setup(bench->arg);
+        }
+
+        uint64_t start = headless_now_ns();
+        bench->run(bench->arg, bench->ops);
+        uint64_t end = headless_now_ns();
+
+        if (i >= MB_WARMUP)
+        {
+            times[i-MB_WARMUP] = (double)(end-start) / bench->ops;
+        }
+    }
+
+    qsort(times, reps, sizeof(double), mb_double_cmp);
+
+    struct mb_result result = { bench->name, bench->unit, bench->ops, reps };
+    result.min_ns = times[0];
+    result.max_ns = times[reps-1];
+    result.median_ns = reps % 2 ? times[reps/2] : (times[reps/2-1] + times[reps/2]) / 2;
+    for (int i = 0; i < reps; i++)
+    {
+        result.mean_ns += times[i] / reps;
+    }
+
+    return result;
+}
+
+// CPU: decode and run over small loops placed in RAM, away from any I/O
+
+struct mb_cpu
+{
+    struct system *sys;
+    uint16_t start;
+    struct ricoh_state cpu;
+};
+
+// Arithmetic and register ops
+static const uint8_t mb_mix_alu[] = {
+    0xA2, 0x00,             // $0300 LDX #$00
+    0x18,                   // $0302 CLC
+    0x69, 0x13,             //       ADC #$13
+    0x49, 0x5A,             //       EOR #$5A
+    0x29, 0xF7,             //       AND #$F7
+    0x09, 0x21,             //       ORA #$21
+    0x0A,                   //       ASL A
+    0x6A,                   //       ROR A
+    0xC9, 0x40,             //       CMP #$40
+    0xA8,                   //       TAY
+    0xC8,                   //       INY
+    0xCA,                   //       DEX
+    0xD0, 0xEE,             //       BNE $0302
+    0x4C, 0x00, 0x03,       //       JMP $0300
+};
+
+// Loads, stores and read-modify-write over the addressing modes
+static const uint8_t mb_mix_memory[] = {
+    0xA2, 0x00,             // $0400 LDX #$00
+    0xBD, 0x00, 0x05,       // $0402 LDA $0500,X
+    0x85, 0x10,             //       STA $10
+    0xFE, 0x00, 0x06,       //       INC $0600,X
+    0xB1, 0x20,             //       LDA ($20),Y
+    0x9D, 0x00, 0x07,       //       STA $0700,X
+    0x06, 0x11,             //       ASL $11
+    0xA4, 0x12,             //       LDY $12
+    0xE8,                   //       INX
+    0xD0, 0xEC,             //       BNE $0402
+    0x4C, 0x00, 0x04,       //       JMP $0400
+};
+
+// Calls, the stack and branches
+static const uint8_t mb_mix_control[] = {
+    0x20, 0x10, 0x08,       // $0800 JSR $0810
+    0xA5, 0x13,             //       LDA $13
+    0xF0, 0x02,             //       BEQ $0809
+    0x30, 0x00,             //       BMI $0809
+    0x48,                   // $0809 PHA
+    0x68,                   //       PLA
+    0x4C, 0x00, 0x08,       //       JMP $0800
+    0xEA, 0xEA,             //       NOP NOP
+    0x08,                   // $0810 PHP
+    0xE6, 0x13,             //       INC $13
+    0x28,                   //       PLP
+    0x60,                   //       RTS
+};
+
+static void mb_cpu_setup(void *arg)
+{
+    struct mb_cpu *bench = arg;
+
+    bench->cpu = bench->sys->cpu;
+    bench->cpu.pc = bench->start;
+    bench->cpu.sp = 0xFD;
+    bench->cpu.flags = 0x24;
+    bench->cpu.crash = 0;
+    bench->cpu.y = 0;
+
+    // LDA ($20),Y reads $0500-$05FF whatever Y the loop picks up from $12
+    bench->sys->memory[0x20] = 0x00;
+    bench->sys->memory[0x21] = 0x05;
+}
+
+static void mb_cpu_run(void *arg, uint64_t ops)
+{
+    struct mb_cpu *bench = arg;
+    struct system *sys = bench->sys;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        struct instr_decoded decoded = ricoh_decode_instr(&sys->decoder, &sys->mem, bench->cpu.pc);
+        ricoh_run_instr(&bench->cpu, decoded, &sys->mem);
+    }
+
+    mb_sink += bench->cpu.a + bench->cpu.crash;
+}
+
+// PPU: whole frames of dots from a state the game left behind
+
+struct mb_ppu
+{
+    const struct ppu *from;
+    struct ppu ppu;
+    bool skip_render;
+};
+
+static void mb_ppu_setup(void *arg)
+{
+    struct mb_ppu *bench = arg;
+
+    ppu_clone(&bench->ppu, bench->from);
+    bench->ppu.skip_render = bench->skip_render;
+}
+
+static void mb_ppu_run(void *arg, uint64_t ops)
+{
+    struct mb_ppu *bench = arg;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        ppu_cycle(&bench->ppu, NULL);
+    }
+
+    mb_sink += bench->ppu.screen[256*120];
+}
+
+// APU: raw cycles, and the samples of a frame the way the audio device asks for them
+
+struct mb_apu
+{
+    const struct apu *from;
+    struct apu apu;
+};
+
+static void mb_apu_setup(void *arg)
+{
+    struct mb_apu *bench = arg;
+
+    bench->apu = *bench->from;
+}
+
+static void mb_apu_cycle_run(void *arg, uint64_t ops)
+{
+    struct mb_apu *bench = arg;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        apu_cycle(&bench->apu);
+    }
+
+    mb_sink += bench->apu.sample_ring_write_at;
+}
+
+static void mb_apu_samples_run(void *arg, uint64_t ops)
+{
+    struct mb_apu *bench = arg;
+    uint16_t samples[735];
+
+    for (uint64_t i = 0; i < ops; i += 735)
+    {
+        apu_catchup_samples(&bench->apu, 735);
+        apu_ring_read(&bench->apu, samples, 735);
+    }
+
+    mb_sink += samples[0];
+}
+
+// Mapper: PRG reads through the memory interface, stepping around the banks
+
+static void mb_prg_run(void *arg, uint64_t ops)
+{
+    struct system *sys = arg;
+    uint64_t sum = 0;
+    uint16_t addr = 0x8000;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        sum += sys->mem.get(sys->mem.instance, addr);
+        addr = 0x8000 | (addr + 0x0F1D);
+    }
+
+    mb_sink += sum;
+}
+
+// Code map: analyzing the whole PRG from the vectors, as loading a ROM does
+
+struct mb_imap
+{
+    struct ricoh_decoder decoder;
+    const uint8_t *prg;
+    size_t prg_size;
+    uint16_t windows[IMAP_WINDOWS];
+};
+
+static void mb_imap_run(void *arg, uint64_t ops)
+{
+    struct mb_imap *bench = arg;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        struct imap *imap = imap_analyze(bench->decoder, bench->prg, bench->prg_size, bench->windows, NULL);
+        mb_sink += imap->banks[0].count;
+        imap_free(imap);
+    }
+}
+
+// Blit: palette indices to RGBA, what the front end does before uploading
+
+struct mb_blit
+{
+    const struct ppu *ppu;
+    struct blit_lut lut;
+    int scale;
+    uint32_t *pixels;
+};
+
+static void mb_blit_run(void *arg, uint64_t ops)
+{
+    struct mb_blit *bench = arg;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        blit_rows(&bench->lut, bench->ppu->screen, bench->ppu->emphasis, 0, 240, bench->scale,
+            bench->pixels, 256*bench->scale*sizeof(uint32_t));
+    }
+
+    mb_sink += bench->pixels[0];
+}
+
+// Whole frames of the game, as the front ends run them
+
+struct mb_frame
+{
+    struct player *player;
+    struct ppu_log log;
+    bool inline_render;
+};
+
+static void mb_frame_run(void *arg, uint64_t ops)
+{
+    struct mb_frame *bench = arg;
+    struct system *sys = player_get_system(bench->player);
+
+    sys->ppu.skip_render = !bench->inline_render;
+    sys->ppu.log = bench->inline_render ? NULL : &bench->log;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        player_frame(bench->player);
+        ppu_log_clear(&bench->log);
+    }
+
+    sys->ppu.log = NULL;
+    sys->ppu.skip_render = false;
+}
+
+static void mb_write_json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            fputc('\\', fp);
+        }
+        if ((unsigned char)*str < 0x20)
+        {
+            fprintf(fp, "\\u%04x", *str);
+            continue;
+        }
+        fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+static void mb_write_json(FILE *fp, const char *rom_path, struct mb_result *results, int count)
+{
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"rom\": ");
+    mb_write_json_string(fp, rom_path);
+    fprintf(fp, ",\n");
+    fprintf(fp, "  \"warmup\": %d,\n", MB_WARMUP);
+    fprintf(fp, "  \"benchmarks\": [\n");
+    for (int i = 0; i < count; i++)
+    {
+        struct mb_result *r = &results[i];
+        // One per line, -c reads them back that way
+        fprintf(fp, "    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, \"reps\": %d, "
+            "\"min_ns\": %.3f, \"median_ns\": %.3f, \"mean_ns\": %.3f, \"max_ns\": %.3f}%s\n",
+            r->name, r->unit, (unsigned long long)r->ops, r->reps,
+            r->min_ns, r->median_ns, r->mean_ns, r->max_ns, i+1 < count ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+}
+
+// Prints how each median moved against an earlier run
+static void mb_compare(const char *path, struct mb_result *results, int count)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        printf("Can't open %s\n", path);
+        return;
+    }
+
+    printf("\n%-16s %12s %12s %8s\n", "vs", path, "now", "change");
+
+    char line[512];
+    while (fgets(line, sizeof line, fp))
+    {
+        char name[64];
+        const char *median = strstr(line, "\"median_ns\": ");
+        if (sscanf(line, " {\"name\": \"%63[^\"]\"", name) != 1 || !median)
+        {
+            continue;
+        }
+
+        double before = atof(median + strlen("\"median_ns\": "));
+        for (int i = 0; i < count; i++)
+        {
+            if (strcmp(results[i].name, name) == 0)
+            {
+                printf("%-16s %12.2f %12.2f %+7.1f%%\n", name, before, results[i].median_ns,
+                    before > 0 ? 100.0*(results[i].median_ns-before)/before : 0.0);
+            }
+        }
+    }
+
+    fclose(fp);
+}
+
+static void mb_usage()
+{
+    printf("usage: microbench [ROM] [-r REPS] [-o OUT.json] [-c OLD.json]\n");
+    printf("  ROM  game for the PPU state and whole frames, misc/nestest.nes by default\n");
+    printf("  -r   repetitions of each benchmark after %d of warmup, 15 by default\n", MB_WARMUP);
+    printf("  -o   where the results go, microbench.json by default\n");
+    printf("  -c   compare against the results of an earlier run\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *rom_path = NULL;
+    const char *out_path = "microbench.json";
+    const char *compare_path = NULL;
+    int reps = 15;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-r") == 0 && i+1 < argc)      reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i+1 < argc) out_path = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0 && i+1 < argc) compare_path = argv[++i];
+        else if (argv[i][0] != '-' && !rom_path)           rom_path = argv[i];
+        else
+        {
+            mb_usage();
+            return 1;
+        }
+    }
+
+    if (!rom_path)
+    {
+        rom_path = "misc/nestest.nes";
+    }
+
+    if (reps <= 0 || reps > MB_MAX_REPS)
+    {
+        mb_usage();
+        return 1;
+    }
+
+    struct mux_api mux = { NULL, headless_mux_nop, headless_mux_nop };
+    struct rom_cache roms = rom_cache_make(mux);
+    struct rom_image *image = rom_cache_open(&roms, rom_path);
+    if (!image)
+    {
+        return 1;
+    }
+
+    struct player player = player_init(image, mux);
+    rom_image_release(image);
+    if (!player.is_valid)
+    {
+        printf("Can't run %s\n", rom_path);
+        return 1;
+    }
+
+    struct system *sys = player_get_system(&player);
+
+    // Let the game set up the PPU and APU first
+    for (int i = 0; i < 120; i++)
+    {
+        uint16_t samples[735];
+        player_frame(&player);
+        player_generate_samples(&player, samples, 735);
+    }
+
+    memcpy(sys->memory + 0x0300, mb_mix_alu, sizeof mb_mix_alu);
+    memcpy(sys->memory + 0x0400, mb_mix_memory, sizeof mb_mix_memory);
+    memcpy(sys->memory + 0x0800, mb_mix_control, sizeof mb_mix_control);
+
+    static struct mb_cpu cpu_alu, cpu_memory, cpu_control;
+    cpu_alu = (struct mb_cpu){ sys, 0x0300 };
+    cpu_memory = (struct mb_cpu){ sys, 0x0400 };
+    cpu_control = (struct mb_cpu){ sys, 0x0800 };
+
+    static struct ppu ppu_from;
+    ppu_clone(&ppu_from, &sys->ppu);
+    static struct mb_ppu ppu_render, ppu_timing;
+    ppu_render = (struct mb_ppu){ &ppu_from };
+    ppu_timing = (struct mb_ppu){ &ppu_from };
+    ppu_timing.skip_render = true;
+
+    static struct apu apu_from;
+    apu_from = sys->apu;
+    static struct mb_apu apu = { &apu_from };
+
+    // Not through the cache, which would only hash the PRG after the first time
+    static struct mb_imap code_map;
+    struct banked *mapper = player.mapper_data;
+    code_map = (struct mb_imap){ sys->decoder, mapper->rom.prg, mapper->rom.prg_size };
+    memcpy(code_map.windows, sys->imap->windows, sizeof code_map.windows);
+
+    static struct mb_blit blit1, blit3;
+    static uint32_t pixels[256*240*9];
+    blit1 = (struct mb_blit){ &ppu_from };
+    blit1.scale = 1;
+    blit1.pixels = pixels;
+    blit_lut_init(&blit1.lut, blit_palette, BLIT_RGBA8888);
+    blit3 = blit1;
+    blit3.scale = 3;
+
+    static struct mb_frame frame_logged, frame_inline;
+    frame_logged = (struct mb_frame){ &player };
+    frame_inline = (struct mb_frame){ &player };
+    frame_inline.inline_render = true;
+
+    // A frame is 341*262 dots and about 29780 CPU cycles
+    struct mb_bench benches[] = {
+        { "cpu_alu",         "instr",  1000000, mb_cpu_setup, mb_cpu_run, &cpu_alu },
+        { "cpu_memory",      "instr",  1000000, mb_cpu_setup, mb_cpu_run, &cpu_memory },
+        { "cpu_control",     "instr",  1000000, mb_cpu_setup, mb_cpu_run, &cpu_control },
+        { "ppu_render",      "dot",    341*262, mb_ppu_setup, mb_ppu_run, &ppu_render },
+        { "ppu_timing",      "dot",    341*262, mb_ppu_setup, mb_ppu_run, &ppu_timing },
+        { "apu_cycle",       "cycle",  29780,   mb_apu_setup, mb_apu_cycle_run, &apu },
+        { "apu_samples",     "sample", 735*8,   mb_apu_setup, mb_apu_samples_run, &apu },
+        { "mapper_prg_read", "read",   1000000, NULL,         mb_prg_run, sys },
+        { "imap_analyze",    "rom",    20,      NULL,         mb_imap_run, &code_map },
+        { "blit_x1",         "frame",  100,     NULL,         mb_blit_run, &blit1 },
+        { "blit_x3",         "frame",  20,      NULL,         mb_blit_run, &blit3 },
+        { "frame_logged",    "frame",  30,      NULL,         mb_frame_run, &frame_logged },
+        { "frame_inline",    "frame",  30,      NULL,         mb_frame_run, &frame_inline },
+    };
+    int count = sizeof benches / sizeof benches[0];
+
+    struct mb_result results[MB_MAX_BENCHES];
+
+    printf("%-16s %8s %12s %12s %12s\n", "benchmark", "unit", "min ns", "median ns", "mean ns");
+    for (int i = 0; i < count; i++)
+    {
+        results[i] = mb_measure(&benches[i], reps);
+        printf("%-16s %8s %12.2f %12.2f %12.2f\n", results[i].name, results[i].unit,
+            results[i].min_ns, results[i].median_ns, results[i].mean_ns);
+    }
+
+    if (cpu_alu.cpu.crash || cpu_memory.cpu.crash || cpu_control.cpu.crash)
+    {
+        printf("An instruction mix crashed the CPU, its numbers mean nothing\n");
+    }
+
+    FILE *fp = fopen(out_path, "w");
+    if (!fp)
+    {
+        printf("Can't write %s\n", out_path);
+        return 1;
+    }
+    mb_write_json(fp, rom_path, results, count);
+    fclose(fp);
+    printf("Wrote %s\n", out_path);
+
+    if (compare_path)
+    {
+        mb_compare(compare_path, results, count);
+    }
+
+    ppu_log_free(&frame_logged.log);
+    player_free(&player);
+
+    return 0;
+}
@@ -1,4 +1,7 @@
+#include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "SDL3/SDL_audio.h"
 #include "SDL3/SDL_dialog.h"
@@ -16,30 +19,12 @@
 #include "SDL3/SDL_rect.h"
 #include "SDL3/SDL_render.h"
 #include "SDL3/SDL_surface.h"
+#include "SDL3/SDL_thread.h"
 #include <SDL3/SDL.h>
 #include "SDL3/SDL_video.h"
 #include "SDL3/SDL_main.h"
 #include "neske.h"
 
-uint32_t pallete[] = {
-    0x626262ff, 0x001fb2ff, 0x2404c8ff, 0x5200b2ff,
-    0x730076ff, 0x800024ff, 0x730b00ff, 0x522800ff,
-    0x244400ff, 0x005700ff, 0x005c00ff, 0x005324ff,
-    0x003c76ff, 0x000000ff, 0x000000ff, 0x000000ff,
-    0xabababff, 0x0d57ffff, 0x4b30ffff, 0x8a13ffff,
-    0xbc08d6ff, 0xd21269ff, 0xc72e00ff, 0x9d5400ff,
-    0x607b00ff, 0x209800ff, 0x00a300ff, 0x009942ff,
-    0x007db4ff, 0x000000ff, 0x000000ff, 0x000000ff,
-    0xffffffff, 0x53aeffff, 0x9085ffff, 0xd365ffff,
-    0xff57ffff, 0xff5dcfff, 0xff7757ff, 0xfa9e00ff,
-    0xbdc700ff, 0x7ae700ff, 0x43f611ff, 0x26ef7eff,
-    0x2cd5f6ff, 0x4e4e4eff, 0x000000ff, 0x000000ff,
-    0xffffffff, 0xb6e1ffff, 0xced1ffff, 0xe9c3ffff,
-    0xffbcffff, 0xffbdf4ff, 0xffc6c3ff, 0xffd59aff,
-    0xe9e681ff, 0xcef481ff, 0xb6fb9aff, 0xa9fac3ff,
-    0xa9f0f4ff, 0xb8b8b8ff, 0x000000ff, 0x000000ff,
-};
-
 void sdl_mux_lock( void *mux )
 {
     SDL_LockMutex(mux);
@@ -59,6 +44,112 @@ struct mux_api sdl_mux_make()
     };
 }
 
+// Threads for pool_api, the thread calling run takes jobs too
+struct sdl_pool
+{
+    SDL_Mutex *mutex;
+    SDL_Condition *work_cond;
+    SDL_Condition *done_cond;
+
+    uint64_t generation;
+    void (*job)(void *arg, int index);
+    void *arg;
+    int count;
+    int next;
+    int done;
+};
+
+// Call with pool->mutex locked
+static void sdl_pool_take_jobs(struct sdl_pool *pool)
+{
+    while (pool->next < pool->count)
+    {
+        int index = pool->next++;
+
+        SDL_UnlockMutex(pool->mutex);
+        pool->job(pool->arg, index);
+        SDL_LockMutex(pool->mutex);
+
+        if (++pool->done == pool->count)
+        {
+            SDL_BroadcastCondition(pool->done_cond);
+        }
+    }
+}
+
+static int SDLCALL sdl_pool_worker(void *userdata)
+{
+    struct sdl_pool *pool = userdata;
+    uint64_t generation = 0;
+
+    SDL_LockMutex(pool->mutex);
+
+    for (;;)
+    {
+        while (pool->generation == generation)
+        {
+            SDL_WaitCondition(pool->work_cond, pool->mutex);
+        }
+
+        generation = pool->generation;
+        sdl_pool_take_jobs(pool);
+    }
+
+    return 0;
+}
+
+void sdl_pool_run(void *userdata, int count, void (*job)(void *arg, int index), void *arg)
+{
+    struct sdl_pool *pool = userdata;
+
+    SDL_LockMutex(pool->mutex);
+
+    pool->job = job;
+    pool->arg = arg;
+    pool->count = count;
+    pool->next = 0;
+    pool->done = 0;
+    pool->generation += 1;
+    SDL_BroadcastCondition(pool->work_cond);
+
+    sdl_pool_take_jobs(pool);
+    while (pool->done < pool->count)
+    {
+        SDL_WaitCondition(pool->done_cond, pool->mutex);
+    }
+
+    SDL_UnlockMutex(pool->mutex);
+}
+
+// Returns false if there's only one thread to run on
+bool sdl_pool_make(struct pool_api *api, int threads)
+{
+    if (threads < 2)
+    {
+        return false;
+    }
+
+    struct sdl_pool *pool = calloc(1, sizeof(struct sdl_pool));
+    assert(pool != NULL);
+
+    pool->mutex = SDL_CreateMutex();
+    pool->work_cond = SDL_CreateCondition();
+    pool->done_cond = SDL_CreateCondition();
+
+    for (int i = 1; i < threads; i++)
+    {
+        SDL_CreateThread(sdl_pool_worker, "sdl_pool", pool);
+    }
+
+    *api = (struct pool_api) {
+        pool,
+        threads,
+        sdl_pool_run,
+    };
+
+    return true;
+}
+
 SDL_HitTestResult hit_test(SDL_Window* win, const SDL_Point* pos, void *userdata)
 {
     int w, h;
@@ -81,27 +172,18 @@ void show_error(const char *title, const char *mesg, bool fatal)
     }
 }
 
-struct player load_rom_from_file(const char *path, struct mux_api apu_mux)
+struct player load_rom_from_file(struct rom_cache *roms, const char *path, struct mux_api apu_mux)
 {
-    FILE *fp = fopen(path, "rb");
-    if (!fp)
+    struct rom_image *image = rom_cache_open(roms, path);
+    if (!image)
     {
         show_error("Error loading ROM:", "Can't open the file", false);
         return (struct player){ 0 };
     }
-    fseek(fp, 0, SEEK_END);
-    size_t fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    uint8_t *rom = malloc(fsize);
-    fread(rom, 1, fsize, fp);
-    fclose(fp);
-
-    if (fsize < 16)
-    {
-        return (struct player){ 0 };
-    }
 
-    struct player player = player_init(rom, apu_mux);
+    // The player keeps its own reference
+    struct player player = player_init(image, apu_mux);
+    rom_image_release(image);
 
     if (!player.is_valid)
     {
@@ -125,17 +207,454 @@ enum ui_window
     WIN_FUN,
 };
 
-struct rtc_state
+// Renders frame N on a worker thread, replaying the PPU log recorded while
+// the emulation ran it, while the emulation goes on with frame N+1
+struct render_pipe
+{
+    SDL_Thread *thread;
+    SDL_Mutex *mutex;
+    SDL_Condition *cond;
+
+    struct ppu ppu;
+    struct ppu_log logs[2];
+    int recording;
+    int pending;
+    // The pending frame is only replayed for its state, nothing is drawn
+    bool skip;
+    bool quit;
+
+    // Band-parallel drawing of frames without mid-frame writes
+    bool has_bands;
+    struct pool_api bands;
+
+    bool has_result;
+    struct system_frame_result result;
+};
+
+static int SDLCALL render_pipe_worker(void *userdata)
+{
+    struct render_pipe *pipe = userdata;
+
+    SDL_LockMutex(pipe->mutex);
+
+    while (!pipe->quit)
+    {
+        if (pipe->pending == -1)
+        {
+            SDL_WaitCondition(pipe->cond, pipe->mutex);
+            continue;
+        }
+
+        struct ppu_log *log = &pipe->logs[pipe->pending];
+        bool skip = pipe->skip;
+        SDL_UnlockMutex(pipe->mutex);
+        // The screen keeps the last drawn frame, so the next one still finds its changed rows
+        pipe->ppu.skip_render = skip;
+        ppu_log_replay(&pipe->ppu, log, pipe->has_bands && !skip ? &pipe->bands : NULL);
+        pipe->ppu.skip_render = false;
+        SDL_LockMutex(pipe->mutex);
+
+        if (!skip)
+        {
+            memcpy(pipe->result.screen, pipe->ppu.screen, sizeof pipe->result.screen);
+            memcpy(pipe->result.dirty_rows, pipe->ppu.dirty_rows, sizeof pipe->result.dirty_rows);
+            memcpy(pipe->result.emphasis, pipe->ppu.emphasis, sizeof pipe->result.emphasis);
+            memset(pipe->ppu.dirty_rows, false, sizeof pipe->ppu.dirty_rows);
+            pipe->has_result = true;
+        }
+
+        pipe->pending = -1;
+        SDL_BroadcastCondition(pipe->cond);
+    }
+
+    SDL_UnlockMutex(pipe->mutex);
+
+    return 0;
+}
+
+struct render_pipe *render_pipe_make()
+{
+    struct render_pipe *pipe = calloc(1, sizeof(struct render_pipe));
+    assert(pipe != NULL);
+
+    pipe->mutex = SDL_CreateMutex();
+    pipe->cond = SDL_CreateCondition();
+    pipe->pending = -1;
+    // The emulation keeps a core busy
+    pipe->has_bands = sdl_pool_make(&pipe->bands, SDL_GetNumLogicalCPUCores()-1);
+    pipe->thread = SDL_CreateThread(render_pipe_worker, "render_pipe", pipe);
+
+    return pipe;
+}
+
+// Call with pipe->mutex locked
+static void render_pipe_wait_locked(struct render_pipe *pipe)
+{
+    while (pipe->pending != -1)
+    {
+        SDL_WaitCondition(pipe->cond, pipe->mutex);
+    }
+}
+
+// Waits for the worker to be done with the current frame, it may still use the ROM
+void render_pipe_wait(struct render_pipe *pipe)
+{
+    SDL_LockMutex(pipe->mutex);
+    render_pipe_wait_locked(pipe);
+    SDL_UnlockMutex(pipe->mutex);
+}
+
+// Starts rendering for sys, its PPU only does timing from now on
+void render_pipe_attach(struct render_pipe *pipe, struct system *sys)
+{
+    SDL_LockMutex(pipe->mutex);
+    render_pipe_wait_locked(pipe);
+
+    ppu_clone(&pipe->ppu, &sys->ppu);
+    memset(pipe->ppu.dirty_rows, true, sizeof pipe->ppu.dirty_rows);
+    pipe->has_result = false;
+    pipe->recording = 0;
+    ppu_log_clear(&pipe->logs[0]);
+    ppu_log_clear(&pipe->logs[1]);
+
+    sys->ppu.log = &pipe->logs[pipe->recording];
+    sys->ppu.skip_render = true;
+
+    SDL_UnlockMutex(pipe->mutex);
+}
+
+// Hands the frame sys just finished to the worker. Returns true if it drew the
+// previous one, which then goes to result; result is left alone otherwise.
+// Without draw the worker only keeps up with the PPU state, for frame skipping.
+bool render_pipe_submit(struct render_pipe *pipe, struct system *sys, struct system_frame_result *result, bool draw)
+{
+    SDL_LockMutex(pipe->mutex);
+    render_pipe_wait_locked(pipe);
+
+    bool drawn = pipe->has_result;
+    if (drawn)
+    {
+        *result = pipe->result;
+        pipe->has_result = false;
+    }
+
+    pipe->logs[pipe->recording].end_cycle = sys->ppu.cycles;
+    pipe->pending = pipe->recording;
+    pipe->skip = !draw;
+    pipe->recording ^= 1;
+    ppu_log_clear(&pipe->logs[pipe->recording]);
+    sys->ppu.log = &pipe->logs[pipe->recording];
+
+    SDL_SignalCondition(pipe->cond);
+    SDL_UnlockMutex(pipe->mutex);
+
+    return drawn;
+}
+
+// Writes battery saves on its own thread. The emulation hands over the pages
+// written each frame, the worker waits a bit for more before writing the file.
+#define SAVE_FLUSH_DELAY_MS 500
+
+struct save_flusher
+{
+    SDL_Thread *thread;
+    SDL_Mutex *mutex;
+    SDL_Condition *cond;
+
+    char *path;
+    uint8_t data[SAVE_RAM_SIZE];
+    bool pending;
+    bool writing;
+};
+
+static int SDLCALL save_flusher_worker(void *userdata)
+{
+    struct save_flusher *flusher = userdata;
+    uint8_t data[SAVE_RAM_SIZE];
+
+    SDL_LockMutex(flusher->mutex);
+
+    for (;;)
+    {
+        if (!flusher->pending)
+        {
+            SDL_WaitCondition(flusher->cond, flusher->mutex);
+            continue;
+        }
+
+        // Coalesce the writes of the next few frames into this one
+        SDL_UnlockMutex(flusher->mutex);
+        SDL_Delay(SAVE_FLUSH_DELAY_MS);
+        SDL_LockMutex(flusher->mutex);
+
+        char *path = flusher->path;
+        memcpy(data, flusher->data, SAVE_RAM_SIZE);
+        flusher->pending = false;
+        flusher->writing = true;
+
+        SDL_UnlockMutex(flusher->mutex);
+        if (!save_write_file_atomic(path, data, SAVE_RAM_SIZE))
+        {
+            printf("Can't write save file %s\n", path);
+        }
+        SDL_LockMutex(flusher->mutex);
+
+        flusher->writing = false;
+        SDL_BroadcastCondition(flusher->cond);
+    }
+
+    return 0;
+}
+
+struct save_flusher *save_flusher_make()
+{
+    struct save_flusher *flusher = calloc(1, sizeof(struct save_flusher));
+    assert(flusher != NULL);
+
+    flusher->mutex = SDL_CreateMutex();
+    flusher->cond = SDL_CreateCondition();
+    flusher->thread = SDL_CreateThread(save_flusher_worker, "save_flusher", flusher);
+
+    return flusher;
+}
+
+// Blocks until everything handed over is on disk
+void save_flusher_wait(struct save_flusher *flusher)
+{
+    SDL_LockMutex(flusher->mutex);
+    while (flusher->pending || flusher->writing)
+    {
+        SDL_WaitCondition(flusher->cond, flusher->mutex);
+    }
+    SDL_UnlockMutex(flusher->mutex);
+}
+
+// Starts saving ram, or nothing if its cart has no battery
+void save_flusher_attach(struct save_flusher *flusher, struct save_ram *ram)
+{
+    save_flusher_wait(flusher);
+
+    SDL_LockMutex(flusher->mutex);
+    free(flusher->path);
+    flusher->path = NULL;
+    if (ram && ram->battery)
+    {
+        flusher->path = malloc(strlen(ram->path)+1);
+        assert(flusher->path != NULL);
+        strcpy(flusher->path, ram->path);
+        memcpy(flusher->data, ram->data, SAVE_RAM_SIZE);
+        ram->dirty = 0;
+    }
+    SDL_UnlockMutex(flusher->mutex);
+}
+
+// Called after every frame, only copies the pages that changed
+void save_flusher_submit(struct save_flusher *flusher, struct save_ram *ram)
+{
+    if (!ram || !ram->battery || !ram->dirty)
+    {
+        return;
+    }
+
+    SDL_LockMutex(flusher->mutex);
+    for (int page = 0; page < SAVE_RAM_SIZE/SAVE_PAGE_SIZE; page++)
+    {
+        if (ram->dirty & (1u << page))
+        {
+            memcpy(flusher->data + page*SAVE_PAGE_SIZE, ram->data + page*SAVE_PAGE_SIZE, SAVE_PAGE_SIZE);
+        }
+    }
+    ram->dirty = 0;
+    flusher->pending = true;
+    SDL_SignalCondition(flusher->cond);
+    SDL_UnlockMutex(flusher->mutex);
+}
+
+// Records gameplay on its own thread. The emulation and the audio callback only
+// copy their data into a queue, encoding and writing the file happens here.
+// Frames that don't fit in the queue are dropped rather than slowing the game.
+#define CAPTURE_QUEUE_LEN 8
+
+struct capture_writer
+{
+    SDL_Thread *thread;
+    SDL_Mutex *mutex;
+    SDL_Condition *cond;
+
+    // NULL when not recording
+    struct capture *capture;
+    bool stopping;
+    uint32_t dropped;
+
+    uint8_t frames[CAPTURE_QUEUE_LEN][CAPTURE_FRAME_SIZE];
+    int first_frame;
+    int frame_count;
+
+    uint16_t *samples;
+    uint32_t sample_count;
+    uint32_t sample_cap;
+};
+
+static int SDLCALL capture_writer_worker(void *userdata)
+{
+    struct capture_writer *writer = userdata;
+    uint16_t *samples = NULL;
+    uint32_t samples_cap = 0;
+
+    SDL_LockMutex(writer->mutex);
+
+    for (;;)
+    {
+        struct capture *cap = writer->capture;
+
+        if (cap && writer->sample_count)
+        {
+            // Swap buffers so the audio callback can go on filling one
+            uint16_t *taken = writer->samples;
+            uint32_t count = writer->sample_count;
+            uint32_t cap_taken = writer->sample_cap;
+            writer->samples = samples;
+            writer->sample_cap = samples_cap;
+            writer->sample_count = 0;
+            samples = taken;
+            samples_cap = cap_taken;
+
+            SDL_UnlockMutex(writer->mutex);
+            capture_samples(cap, samples, count);
+            SDL_LockMutex(writer->mutex);
+        }
+        else if (cap && writer->frame_count)
+        {
+            // The slot stays taken until it's written, so it's safe to use unlocked
+            uint8_t *frame = writer->frames[writer->first_frame];
+
+            SDL_UnlockMutex(writer->mutex);
+            capture_frame(cap, frame);
+            SDL_LockMutex(writer->mutex);
+
+            writer->first_frame = (writer->first_frame+1) % CAPTURE_QUEUE_LEN;
+            writer->frame_count--;
+        }
+        else if (cap && writer->stopping)
+        {
+            printf("Captured %u frames, %u dropped, %.1f MB\n", cap->frames, writer->dropped, cap->bytes/1e6);
+            if (!capture_close(cap))
+            {
+                printf("Can't write the capture\n");
+            }
+            writer->capture = NULL;
+            writer->stopping = false;
+            SDL_BroadcastCondition(writer->cond);
+        }
+        else
+        {
+            SDL_WaitCondition(writer->cond, writer->mutex);
+        }
+    }
+
+    return 0;
+}
+
+struct capture_writer *capture_writer_make()
+{
+    struct capture_writer *writer = calloc(1, sizeof(struct capture_writer));
+    assert(writer != NULL);
+
+    writer->mutex = SDL_CreateMutex();
+    writer->cond = SDL_CreateCondition();
+    writer->thread = SDL_CreateThread(capture_writer_worker, "capture_writer", writer);
+
+    return writer;
+}
+
+bool capture_writer_recording(struct capture_writer *writer)
 {
-    int level;
-    int frames_since_last_pulse;
-};  
+    SDL_LockMutex(writer->mutex);
+    bool recording = writer->capture && !writer->stopping;
+    SDL_UnlockMutex(writer->mutex);
+
+    return recording;
+}
+
+bool capture_writer_start(struct capture_writer *writer, const char *path)
+{
+    struct capture *cap = capture_open(path);
+    if (!cap)
+    {
+        return false;
+    }
+
+    SDL_LockMutex(writer->mutex);
+    assert(writer->capture == NULL);
+    writer->capture = cap;
+    writer->dropped = 0;
+    writer->sample_count = 0;
+    SDL_UnlockMutex(writer->mutex);
+
+    return true;
+}
+
+// Blocks until everything queued is written and the file is closed
+void capture_writer_stop(struct capture_writer *writer)
+{
+    SDL_LockMutex(writer->mutex);
+    if (writer->capture)
+    {
+        writer->stopping = true;
+        SDL_SignalCondition(writer->cond);
+        while (writer->capture)
+        {
+            SDL_WaitCondition(writer->cond, writer->mutex);
+        }
+    }
+    SDL_UnlockMutex(writer->mutex);
+}
+
+void capture_writer_frame(struct capture_writer *writer, const struct system_frame_result *frame)
+{
+    SDL_LockMutex(writer->mutex);
+    if (writer->capture && !writer->stopping)
+    {
+        if (writer->frame_count == CAPTURE_QUEUE_LEN)
+        {
+            writer->dropped++;
+        }
+        else
+        {
+            uint8_t *slot = writer->frames[(writer->first_frame+writer->frame_count) % CAPTURE_QUEUE_LEN];
+            memcpy(slot, frame->screen, 256*240);
+            memcpy(slot + 256*240, frame->emphasis, 240);
+            writer->frame_count++;
+            SDL_SignalCondition(writer->cond);
+        }
+    }
+    SDL_UnlockMutex(writer->mutex);
+}
+
+void capture_writer_samples(struct capture_writer *writer, const uint16_t *samples, uint32_t count)
+{
+    SDL_LockMutex(writer->mutex);
+    if (writer->capture && !writer->stopping)
+    {
+        if (writer->sample_count+count > writer->sample_cap)
+        {
+            writer->sample_cap = (writer->sample_count+count)*2;
+            writer->samples = realloc(writer->samples, writer->sample_cap*sizeof(uint16_t));
+            assert(writer->samples != NULL);
+        }
+        memcpy(writer->samples + writer->sample_count, samples, count*sizeof(uint16_t));
+        writer->sample_count += count;
+        SDL_SignalCondition(writer->cond);
+    }
+    SDL_UnlockMutex(writer->mutex);
+}
 
 struct neske_ui
 {
     int scale;
-    struct player player;
+    struct emu_thread *emu;
     struct mux_api apu_mux;
+    struct rom_cache roms;
     SDL_Renderer *renderer;
     SDL_Window *window;
     SDL_Mutex *mutex;
@@ -148,12 +667,20 @@ struct neske_ui
     bool mouse_released;
     bool ctx_file;
     bool changing_control;
+    // ` held runs uncapped, F7 steps through the slow-motion speeds
+    bool turbo;
+    int slow_speed;
 
     enum ui_window show_window;
     struct controller_state controller;
     struct controls_spec controls;
     enum controller_btn btn_selected;
     SDL_Texture *tex_backbuffer;
+    struct render_pipe *render_pipe;
+    struct save_flusher *save_flusher;
+    struct capture_writer *capture_writer;
+    struct blit_lut blit_lut;
+    int blit_scale;
 
     SDL_Cursor *cursor;
     SDL_Texture *tex_menu;
@@ -226,35 +753,226 @@ static void set_default_controls(struct controls_spec *controls)
     controls->keys[BTN_RIGHT] = SDLK_RIGHT;
 }
 
-void rtc_iter(struct rtc_state *rtc, struct system *sys)
+// Runs the game on its own thread at the NES frame rate. The UI thread only
+// presents: frames come out through a triple buffer and the buttons go in
+// through an atomic mailbox, so neither side waits for the other.
+#define EMU_FRAME_NS 16639267
+#define EMU_FRESH 4
+// Speeds are in percent of real time, turbo runs as fast as it can
+#define EMU_SPEED_TURBO 0
+#define EMU_SPEED_NORMAL 100
+
+struct emu_thread
 {
-    if (rtc->level == 0) return;
-    rtc->frames_since_last_pulse++;
-    int frames = 20;
-    if (rtc->level == 1) frames = 10;
-    if (rtc->frames_since_last_pulse < frames) return;
-    rtc->frames_since_last_pulse = 0;
+    SDL_Thread *thread;
+    // Held while a frame runs, the UI takes it to load, reset or debug the game
+    SDL_Mutex *mutex;
+
+    struct player player;
+    struct render_pipe *render_pipe;
+    struct save_flusher *save_flusher;
+    struct capture_writer *capture_writer;
+    struct rtc_state rtc;
+    bool running;
+    bool break_reported;
+
+    // Latest picture from the render pipe, rows it didn't redraw keep their pixels
+    struct system_frame_result frame;
+    // Rows of a published frame the UI never took, they go out again with the next one
+    bool carry_rows[240];
+
+    // Index of the published slot, EMU_FRESH while the UI hasn't taken it
+    SDL_AtomicInt middle;
+    int back;
+    int front;
+    struct system_frame_result slots[3];
+
+    // One bit per button, in controller_btn order
+    SDL_AtomicInt buttons;
+    SDL_AtomicInt rtc_level;
+    SDL_AtomicInt crashed;
+
+    SDL_AtomicInt speed;
+    // Speed actually reached over the last second, in percent
+    SDL_AtomicInt measured_speed;
+    uint64_t measure_start;
+    int measure_frames;
+    uint64_t last_draw;
+};
+
+static void emu_thread_publish(struct emu_thread *emu)
+{
+    struct system_frame_result *slot = &emu->slots[emu->back];
 
-    uint16_t addr = rand()%0x2000;
-    while (addr >= 0x100 && addr < 0x200)
+    memcpy(slot->screen, emu->frame.screen, sizeof slot->screen);
+    memcpy(slot->emphasis, emu->frame.emphasis, sizeof slot->emphasis);
+    for (int i = 0; i < 240; i++)
     {
-        addr = rand()%0x2000;
+        slot->dirty_rows[i] = emu->frame.dirty_rows[i] || emu->carry_rows[i];
     }
 
-    uint8_t val = sys->memory[addr];
-    if (rtc->level == 2)
+    int old = SDL_SetAtomicInt(&emu->middle, emu->back | EMU_FRESH);
+    emu->back = old & 3;
+
+    if (old & EMU_FRESH)
     {
-        val = rand()%0x100;
+        memcpy(emu->carry_rows, emu->slots[emu->back].dirty_rows, sizeof emu->carry_rows);
     }
     else
     {
-        int delta = rand()%2 ? 1 : -1;
-        if (val == 0) delta = 1;
-        if (val == 0xFF) delta = -1;
-        val += delta;
+        memset(emu->carry_rows, false, sizeof emu->carry_rows);
+    }
+}
+
+// Call with emu->mutex locked
+static void emu_thread_frame(struct emu_thread *emu, bool draw)
+{
+    struct system *sys = player_get_system(&emu->player);
+
+    struct controller_state controller = { 0 };
+    int buttons = SDL_GetAtomicInt(&emu->buttons);
+    for (int i = 0; i < 8; i++)
+    {
+        controller.btns[i] = (buttons >> i) & 1;
+    }
+    player_set_controller(&emu->player, controller);
+
+    emu->rtc.level = SDL_GetAtomicInt(&emu->rtc_level);
+    rtc_iter(&emu->rtc, sys, NULL);
+
+    player_frame(&emu->player);
+    // The picture lags a frame behind, so it's published when the drawn one comes back
+    bool drawn = render_pipe_submit(emu->render_pipe, sys, &emu->frame, draw);
+    save_flusher_submit(emu->save_flusher, player_get_save_ram(&emu->player));
+    if (drawn)
+    {
+        emu_thread_publish(emu);
+        capture_writer_frame(emu->capture_writer, &emu->frame);
+    }
+
+    if (player_crash(&emu->player))
+    {
+        debug_report(sys);
+        emu->running = false;
+        SDL_SetAtomicInt(&emu->crashed, 1);
+    }
+    else if (sys->debug.paused && !emu->break_reported)
+    {
+        // F10 resumes
+        debug_report(sys);
+        emu->break_reported = true;
+    }
+}
+
+static int SDLCALL emu_thread_worker(void *userdata)
+{
+    struct emu_thread *emu = userdata;
+    uint64_t deadline = SDL_GetTicksNS();
+
+    for (;;)
+    {
+        int speed = SDL_GetAtomicInt(&emu->speed);
+        uint64_t now = SDL_GetTicksNS();
+
+        // In turbo only about one frame per display refresh gets drawn, a capture gets all of them
+        bool draw = speed != EMU_SPEED_TURBO || now - emu->last_draw >= EMU_FRAME_NS
+            || capture_writer_recording(emu->capture_writer);
+        if (draw)
+        {
+            emu->last_draw = now;
+        }
+
+        SDL_LockMutex(emu->mutex);
+        bool ran = emu->running;
+        if (ran)
+        {
+            emu_thread_frame(emu, draw);
+        }
+        SDL_UnlockMutex(emu->mutex);
+
+        now = SDL_GetTicksNS();
+        if (!ran)
+        {
+            emu->measure_start = now;
+            emu->measure_frames = 0;
+        }
+        else
+        {
+            emu->measure_frames++;
+            if (now - emu->measure_start >= 1000000000)
+            {
+                int measured = (int)((uint64_t)emu->measure_frames*EMU_FRAME_NS*EMU_SPEED_NORMAL / (now - emu->measure_start));
+                SDL_SetAtomicInt(&emu->measured_speed, measured);
+                if (speed != EMU_SPEED_NORMAL)
+                {
+                    printf("Speed: %d.%02dx\n", measured/100, measured%100);
+                }
+                emu->measure_start = now;
+                emu->measure_frames = 0;
+            }
+        }
+
+        if (speed == EMU_SPEED_TURBO && ran)
+        {
+            deadline = now;
+            continue;
+        }
+
+        deadline += (uint64_t)EMU_FRAME_NS*EMU_SPEED_NORMAL/(speed ? speed : EMU_SPEED_NORMAL);
+        if (now < deadline)
+        {
+            SDL_DelayNS(deadline - now);
+        }
+        else if (now - deadline > 4*EMU_FRAME_NS)
+        {
+            // Too far behind to catch up, drop the missed frames
+            deadline = now;
+        }
+    }
+
+    return 0;
+}
+
+struct emu_thread *emu_thread_make(struct render_pipe *render_pipe, struct save_flusher *save_flusher, struct capture_writer *capture_writer)
+{
+    struct emu_thread *emu = calloc(1, sizeof(struct emu_thread));
+    assert(emu != NULL);
+
+    emu->mutex = SDL_CreateMutex();
+    emu->render_pipe = render_pipe;
+    emu->save_flusher = save_flusher;
+    emu->capture_writer = capture_writer;
+    emu->rtc = rtc_make(0, time(NULL));
+    emu->back = 0;
+    SDL_SetAtomicInt(&emu->middle, 1);
+    emu->front = 2;
+    SDL_SetAtomicInt(&emu->speed, EMU_SPEED_NORMAL);
+    SDL_SetAtomicInt(&emu->measured_speed, EMU_SPEED_NORMAL);
+    emu->thread = SDL_CreateThread(emu_thread_worker, "emu_thread", emu);
+
+    return emu;
+}
+
+// Takes the newest frame if there is one the UI hasn't seen, NULL otherwise
+struct system_frame_result *emu_thread_take(struct emu_thread *emu)
+{
+    if (!(SDL_GetAtomicInt(&emu->middle) & EMU_FRESH))
+    {
+        return NULL;
     }
 
-    sys->memory[addr] = val;
+    emu->front = SDL_SetAtomicInt(&emu->middle, emu->front) & 3;
+    return &emu->slots[emu->front];
+}
+
+void emu_thread_set_controller(struct emu_thread *emu, struct controller_state controller)
+{
+    int buttons = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        buttons |= (controller.btns[i] != 0) << i;
+    }
+    SDL_SetAtomicInt(&emu->buttons, buttons);
 }
 
 struct neske_ui neske_ui_init(SDL_Renderer *renderer, SDL_Window *window, int ui_scale)
@@ -272,12 +990,24 @@ struct neske_ui neske_ui_init(SDL_Renderer *renderer, SDL_Window *window, int ui
 
 
     ui.apu_mux = sdl_mux_make();
+    ui.roms = rom_cache_make(sdl_mux_make());
+    // Its own pool, the render pipe's may be drawing while a ROM loads
+    static struct pool_api imap_pool;
+    if (sdl_pool_make(&imap_pool, SDL_GetNumLogicalCPUCores()))
+    {
+        ui.roms.pool = &imap_pool;
+    }
+    ui.render_pipe = render_pipe_make();
+    ui.save_flusher = save_flusher_make();
+    ui.capture_writer = capture_writer_make();
+    ui.emu = emu_thread_make(ui.render_pipe, ui.save_flusher, ui.capture_writer);
     ui.btn_selected = -1;
     ui.mutex = SDL_CreateMutex();
     ui.emulating = false;
     ui.renderer = renderer;
     ui.window = window;
     ui.scale = ui_scale;
+    ui.slow_speed = EMU_SPEED_NORMAL;
 
     set_default_controls(&ui.controls);
 
@@ -290,7 +1020,11 @@ struct neske_ui neske_ui_init(SDL_Renderer *renderer, SDL_Window *window, int ui
     ui.tex_about = load_ui_texture(renderer, "img/about.png");
     ui.tex_fun = load_ui_texture(renderer, "img/fun.png");
     ui.tex_userfont = load_ui_texture(renderer, "img/userfont.png");
-    ui.tex_backbuffer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 256, 240);
+
+    // The backbuffer is already scaled to the window so the renderer doesn't have to
+    ui.blit_scale = ui_scale > 4 ? 4 : ui_scale;
+    blit_lut_init(&ui.blit_lut, blit_palette, BLIT_RGBA8888);
+    ui.tex_backbuffer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, 256*ui.blit_scale, 240*ui.blit_scale);
     SDL_SetTextureScaleMode(ui.tex_backbuffer, SDL_SCALEMODE_NEAREST);
 
     SDL_Surface *cursor_surface = IMG_Load("img/cursor.png");
@@ -312,19 +1046,36 @@ struct neske_ui neske_ui_init(SDL_Renderer *renderer, SDL_Window *window, int ui
     return ui;
 }
 
-void draw_nes_emu(SDL_Renderer *renderer, SDL_Texture *sdltexture, struct system_frame_result result)
+// result is NULL when there's no new frame, the texture still has the last one
+void draw_nes_emu(SDL_Renderer *renderer, SDL_Texture *sdltexture, struct blit_lut *lut, int scale, const struct system_frame_result *result)
 {
-    uint32_t texture[240*256];
-
-    for (int i = 0; i < 240*256; i++)
+    // Only convert and upload the rows that changed, the texture keeps the rest
+    for (int from = 0; result && from < 240;)
     {
-        texture[i] = pallete[result.screen[i]];
-    }
+        if (!result->dirty_rows[from])
+        {
+            from++;
+            continue;
+        }
+
+        int to = from;
+        while (to < 240 && result->dirty_rows[to])
+        {
+            to++;
+        }
+
+        void *pixels;
+        int pitch;
+        if (SDL_LockTexture(sdltexture, &(SDL_Rect){0, from*scale, 256*scale, (to-from)*scale}, &pixels, &pitch))
+        {
+            blit_rows(lut, result->screen, result->emphasis, from, to, scale, pixels, pitch);
+            SDL_UnlockTexture(sdltexture);
+        }
 
-    SDL_UpdateTexture(sdltexture, NULL, texture, 256*4);
+        from = to;
+    }
 
-    SDL_FRect srcf = {0, 0, 128*8, 8};
-    SDL_FRect src = {0, 0, 256, 240};
+    SDL_FRect src = {0, 0, 256*scale, 240*scale};
     SDL_FRect dst = {1, 13, 256, 240};
     SDL_RenderTexture(renderer, sdltexture, &src, &dst);
 }
@@ -354,6 +1105,84 @@ bool draw_widget(struct neske_ui *ui, const char *name, int x, int y, int w, int
     return intersect && ui->mouse_released;
 }
 
+// NESKE_PROFILE=N profiles every Nth instruction of the game, the reports are
+// written to the working directory when the game is closed
+static void start_profile(struct neske_ui *ui)
+{
+    const char *every = getenv("NESKE_PROFILE");
+    if (every)
+    {
+        player_get_system(&ui->emu->player)->prof = prof_make(atoi(every));
+    }
+}
+
+static void finish_profile(struct neske_ui *ui)
+{
+    struct system *sys = player_get_system(&ui->emu->player);
+    if (sys && sys->prof)
+    {
+        prof_write_flat(sys->prof, "profile.txt", 100);
+        prof_write_folded(sys->prof, "profile.folded");
+        prof_free(sys->prof);
+        sys->prof = NULL;
+    }
+}
+
+// F9 starts the code/data log, pressing it again writes it next to the ROM.
+// Call with ui->emu->mutex locked.
+static void toggle_cdl(struct neske_ui *ui)
+{
+    struct player *player = &ui->emu->player;
+    struct system *sys = player_get_system(player);
+    struct cdl *cdl = player_get_cdl(player);
+
+    // The render worker marks CHR fetches, it has to be idle to swap the log
+    render_pipe_wait(ui->render_pipe);
+
+    if (cdl)
+    {
+        printf("Code/data log: %zu of %zu PRG bytes ran as code\n",
+            cdl_count(cdl->prg, cdl->prg_size, CDL_OPCODE|CDL_OPERAND), cdl->prg_size);
+        cdl_write_file(cdl);
+        player_enable_cdl(player, false);
+    }
+    else
+    {
+        player_enable_cdl(player, true);
+    }
+
+    render_pipe_attach(ui->render_pipe, sys);
+}
+
+// Turbo runs ahead of the audio callback, so a capture would lose the sound
+// of most frames. It waits while recording.
+static void update_speed(struct neske_ui *ui)
+{
+    bool turbo = ui->turbo && !capture_writer_recording(ui->capture_writer);
+    SDL_SetAtomicInt(&ui->emu->speed, turbo ? EMU_SPEED_TURBO : ui->slow_speed);
+}
+
+// F8 starts recording into the working directory, pressing it again stops.
+// bin/capexport turns the recording into a video and a sound file.
+static void toggle_capture(struct neske_ui *ui)
+{
+    if (capture_writer_recording(ui->capture_writer))
+    {
+        capture_writer_stop(ui->capture_writer);
+        update_speed(ui);
+        return;
+    }
+
+    char path[64];
+    time_t now = time(NULL);
+    strftime(path, sizeof path, "capture-%Y%m%d-%H%M%S.ncap", localtime(&now));
+    if (capture_writer_start(ui->capture_writer, path))
+    {
+        printf("Capturing to %s\n", path);
+        update_speed(ui);
+    }
+}
+
 bool neske_ui_event(struct neske_ui *ui, SDL_Event *event)
 {
     SDL_LockMutex(ui->mutex);
@@ -395,16 +1224,46 @@ bool neske_ui_event(struct neske_ui *ui, SDL_Event *event)
                     break;
                 }
 
-                if (ui->emulating)
-                {
-                    player_set_controller(&ui->player, ui->controller);
-                }
+                emu_thread_set_controller(ui->emu, ui->controller);
             }
             break;
         case SDL_EVENT_KEY_DOWN:
         case SDL_EVENT_KEY_UP:
             if (ui->show_window == WIN_NONE)
             {
+                if (ui->emulating && event->type == SDL_EVENT_KEY_DOWN && event->key.key == SDLK_F9 && !event->key.repeat)
+                {
+                    SDL_LockMutex(ui->emu->mutex);
+                    toggle_cdl(ui);
+                    SDL_UnlockMutex(ui->emu->mutex);
+                }
+
+                if (ui->emulating && event->type == SDL_EVENT_KEY_DOWN && event->key.key == SDLK_F8 && !event->key.repeat)
+                {
+                    toggle_capture(ui);
+                }
+
+                if (event->key.key == SDLK_GRAVE || (event->type == SDL_EVENT_KEY_DOWN && event->key.key == SDLK_F7 && !event->key.repeat))
+                {
+                    if (event->key.key == SDLK_GRAVE)
+                    {
+                        ui->turbo = event->type == SDL_EVENT_KEY_DOWN;
+                    }
+                    else
+                    {
+                        ui->slow_speed = ui->slow_speed == EMU_SPEED_NORMAL ? 50 : ui->slow_speed == 50 ? 25 : EMU_SPEED_NORMAL;
+                    }
+                    update_speed(ui);
+                }
+
+                if (ui->emulating && event->type == SDL_EVENT_KEY_DOWN && event->key.key == SDLK_F10)
+                {
+                    SDL_LockMutex(ui->emu->mutex);
+                    debug_resume(player_get_system(&ui->emu->player));
+                    ui->emu->break_reported = false;
+                    SDL_UnlockMutex(ui->emu->mutex);
+                }
+
                 const enum controller_btn buttons[] = { BTN_A, BTN_B, BTN_START, BTN_SELECT, BTN_UP, BTN_DOWN, BTN_LEFT, BTN_RIGHT };
 
                 for (int i = 0; i < 8; i++)
@@ -415,10 +1274,7 @@ bool neske_ui_event(struct neske_ui *ui, SDL_Event *event)
                     }
                 }
 
-                if (ui->emulating)
-                {
-                    player_set_controller(&ui->player, ui->controller);
-                }
+                emu_thread_set_controller(ui->emu, ui->controller);
             }
             else if (ui->show_window == WIN_CONFIG)
             {
@@ -449,24 +1305,48 @@ static void SDLCALL on_rom_open(void *userdata, const char *const *filelist, int
     }
 
     struct neske_ui *ui = userdata;
+    struct emu_thread *emu = ui->emu;
     
     SDL_LockMutex(ui->mutex);
+    SDL_LockMutex(emu->mutex);
     ui->emulating = false;
     ui->error = false;
     ui->crash = false;
-    if (ui->player.is_valid)
+    emu->running = false;
+    SDL_SetAtomicInt(&emu->crashed, 0);
+    if (emu->player.is_valid)
     {
-        player_free(&ui->player);
+        render_pipe_wait(ui->render_pipe);
+        save_flusher_submit(ui->save_flusher, player_get_save_ram(&emu->player));
+        if (player_get_cdl(&emu->player))
+        {
+            cdl_write_file(player_get_cdl(&emu->player));
+        }
+        finish_profile(ui);
+        player_free(&emu->player);
     }
-    ui->player = load_rom_from_file(*filelist, ui->apu_mux);
-    if (!ui->player.is_valid)
+    emu->player = load_rom_from_file(&ui->roms, *filelist, ui->apu_mux);
+    if (!emu->player.is_valid)
     {
         ui->error = true;
     }
     else
     {
+        // Breakpoints come from the environment, like "x:C000,rw:0300-03FF"
+        const char *breaks = getenv("NESKE_BREAK");
+        if (breaks && !debug_parse(&player_get_system(&emu->player)->debug, breaks))
+        {
+            printf("Can't parse NESKE_BREAK=%s\n", breaks);
+        }
+
+        start_profile(ui);
+        render_pipe_attach(ui->render_pipe, player_get_system(&emu->player));
         ui->emulating = true;
+        emu->running = true;
+        emu->break_reported = false;
     }
+    save_flusher_attach(ui->save_flusher, player_get_save_ram(&emu->player));
+    SDL_UnlockMutex(emu->mutex);
     SDL_UnlockMutex(ui->mutex);
 }
 
@@ -474,10 +1354,9 @@ void neske_ui_update(struct neske_ui *ui)
 {
     SDL_LockMutex(ui->mutex);
 
-    if (ui->player.is_valid)
+    if (SDL_SetAtomicInt(&ui->emu->crashed, 0))
     {
-        struct system *sys = player_get_system(&ui->player);
-        rtc_iter(&ui->rtc_state, sys);
+        ui->crash = true;
     }
 
     if (ui->crash)
@@ -494,10 +1373,14 @@ void neske_ui_update(struct neske_ui *ui)
     }
     else if (ui->emulating)
     {
-        draw_nes_emu(ui->renderer, ui->tex_backbuffer, player_frame(&ui->player));
-        if (player_crash(&ui->player))
+        draw_nes_emu(ui->renderer, ui->tex_backbuffer, &ui->blit_lut, ui->blit_scale, emu_thread_take(ui->emu));
+
+        // Speed reached, in percent of real time
+        if (SDL_GetAtomicInt(&ui->emu->speed) != EMU_SPEED_NORMAL)
         {
-            ui->crash = true;
+            char text[16];
+            snprintf(text, sizeof text, "%d", SDL_GetAtomicInt(&ui->emu->measured_speed));
+            draw_user_text(ui, text, 254-4*(int)strlen(text), 16);
         }
     }
     else
@@ -650,6 +1533,8 @@ void neske_ui_update(struct neske_ui *ui)
                     case 1: SDL_RenderRect(ui->renderer, &fun_btn_low); break;
                     case 2: SDL_RenderRect(ui->renderer, &fun_btn_hi); break;
                 }
+
+                SDL_SetAtomicInt(&ui->emu->rtc_level, ui->rtc_state.level);
             }
             break;
         case WIN_NONE:
@@ -673,15 +1558,22 @@ void neske_ui_update(struct neske_ui *ui)
 
         if (draw_widget(ui, "Unload ROM", 1, 25, 47, 11))
         {
-            player_reset(&ui->player);
+            SDL_LockMutex(ui->emu->mutex);
+            player_reset(&ui->emu->player);
+            ui->emu->running = false;
+            SDL_UnlockMutex(ui->emu->mutex);
             ui->emulating = false;
         }
 
         if (draw_widget(ui, "Reset", 1, 37, 47, 11))
         {
             printf("Reset\n");
+            SDL_LockMutex(ui->emu->mutex);
             ui->crash = false;
-            player_reset(&ui->player);
+            SDL_SetAtomicInt(&ui->emu->crashed, 0);
+            player_reset(&ui->emu->player);
+            ui->emu->running = ui->emulating;
+            SDL_UnlockMutex(ui->emu->mutex);
         }
     }
 
@@ -731,11 +1623,35 @@ void audio_callback(void *userdata, SDL_AudioStream *stream, int additional_amou
     struct neske_ui *ui = userdata;
 
     uint16_t buf[16384] = { 0 };
+    int count = additional_amount/2;
+    int speed = SDL_GetAtomicInt(&ui->emu->speed);
 
-    if (ui->player.is_valid)
+    if (ui->emu->player.is_valid)
     {
         // TODO: Maybe i should lock the apu mux here?
-        player_generate_samples(&ui->player, buf, additional_amount/2);
+        if (speed == EMU_SPEED_TURBO)
+        {
+            // Keeps the APU clocked, but many frames of register writes per buffer is just noise
+            player_generate_samples(&ui->emu->player, buf, count);
+            memset(buf, 0, count*sizeof(uint16_t));
+        }
+        else if (speed < EMU_SPEED_NORMAL)
+        {
+            // Stretch fewer samples over the buffer, from the back so it can be done in place
+            int generated = count*speed/EMU_SPEED_NORMAL;
+            player_generate_samples(&ui->emu->player, buf, generated);
+            // The capture gets the sound at the game's pace, like its frames
+            capture_writer_samples(ui->capture_writer, buf, generated);
+            for (int i = count-1; i >= 0; i--)
+            {
+                buf[i] = buf[i*generated/count];
+            }
+        }
+        else
+        {
+            player_generate_samples(&ui->emu->player, buf, count);
+            capture_writer_samples(ui->capture_writer, buf, count);
+        }
     }
 
     SDL_PutAudioStreamData(stream, buf, additional_amount);
@@ -754,8 +1670,6 @@ int _get_ui_scale()
 
 int main(int argc, char* argv[])
 {
-    srand(time(NULL));
-
     SDL_Window *window;
     SDL_Renderer *renderer;
     bool done = false;
@@ -824,6 +1738,15 @@ int main(int argc, char* argv[])
         SDL_RenderPresent(renderer);
     }
 
+    SDL_LockMutex(neske_ui.mutex);
+    SDL_LockMutex(neske_ui.emu->mutex);
+    neske_ui.emu->running = false;
+    finish_profile(&neske_ui);
+    SDL_UnlockMutex(neske_ui.emu->mutex);
+    SDL_UnlockMutex(neske_ui.mutex);
+    save_flusher_wait(neske_ui.save_flusher);
+    capture_writer_stop(neske_ui.capture_writer);
+
     // Close and destroy the window
     SDL_DestroyWindow(window);
 
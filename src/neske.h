@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 // RICOH.H
 
@@ -23,7 +24,10 @@ enum instr
     PHA, PHP, PLA, PLP,
     ROL, ROR, RTI, RTS,
     SBC, SEC, SED, SEI, STA, STX, STY,
-    TAX, TAY, TSX, TXA, TXS, TYA, _ICOUNT
+    TAX, TAY, TSX, TXA, TXS, TYA,
+    // Unofficial, the combined ones nestest checks
+    DCP, ISB, LAX, RLA, RRA, SAX, SLO, SRE,
+    _ICOUNT
 };
 
 enum addr_mode
@@ -40,6 +44,7 @@ struct instr_decoded
 {
     enum instr id;
     enum addr_mode addr_mode;
+    uint8_t opcode;
     uint8_t operand[2];
     size_t size;
 };
@@ -56,6 +61,9 @@ struct ricoh_state
     uint8_t a, x, y, sp, flags;
     uint64_t cycles;
 
+    // Level of the IRQ line, serviced by ricoh_poll_irq while the I flag is clear
+    bool irq;
+
     uint8_t crash;
 };
 
@@ -69,18 +77,60 @@ struct ricoh_mem_interface
 struct ricoh_decoder make_ricoh_decoder();
 const char *ricoh_instr_name(enum instr instr);
 struct instr_decoded ricoh_decode_instr(struct ricoh_decoder *decoder, struct ricoh_mem_interface *mem, uint16_t addr);
-void ricoh_format_decoded_instr(char *dest, struct instr_decoded decoded);
+void ricoh_format_decoded_instr(char *dest, size_t size, struct instr_decoded decoded);
 void ricoh_do_interrupt(
     struct ricoh_state *cpu,
     struct ricoh_mem_interface *mem,
     uint16_t newpc
 );
+bool ricoh_poll_irq(struct ricoh_state *cpu, struct ricoh_mem_interface *mem);
 void ricoh_run_instr(
     struct ricoh_state *cpu,
     struct instr_decoded instr,
     struct ricoh_mem_interface *mem
 );
 
+// POOL.H
+
+// Runs job(arg, index) for every index below count, possibly on several threads,
+// and returns once they're all done
+struct pool_api {
+    void *pool;
+    int threads;
+    void (*run)(void *pool, int count, void (*job)(void *arg, int index), void *arg);
+};
+
+// CDL.H
+
+// Code/data log, one flag byte for every PRG and CHR ROM byte. Flags are only ever set.
+#define CDL_OPCODE  (1<<0)
+#define CDL_OPERAND (1<<1)
+#define CDL_DATA    (1<<2)
+
+#define CDL_DRAWN   (1<<0)
+#define CDL_READ    (1<<1)
+
+struct cdl
+{
+    const uint8_t *prg_rom;
+    size_t prg_size;
+    uint8_t *prg;
+
+    const uint8_t *chr_rom;
+    size_t chr_size;
+    uint8_t *chr;
+
+    char *path;
+};
+
+struct cdl *cdl_make(const uint8_t *prg_rom, size_t prg_size, const uint8_t *chr_rom, size_t chr_size, const char *rom_path);
+void cdl_free(struct cdl *cdl);
+void cdl_clear(struct cdl *cdl);
+// Bytes of flags..flags+size with any of mask set
+size_t cdl_count(const uint8_t *flags, size_t size, uint8_t mask);
+// Writes the log next to the ROM in the FCEUX .cdl layout
+bool cdl_write_file(const struct cdl *cdl);
+
 // PPU.H
 
 enum ppu_ir
@@ -126,10 +176,48 @@ struct ppu_object
     uint8_t x;
 };
 
+enum ppu_event_type
+{
+    PPUEV_WRITE,
+    PPUEV_READ,
+    PPUEV_OAM,
+    PPUEV_MIRRORING,
+    PPUEV_CHR,
+};
+
+// Something the CPU side did to the PPU, tagged with ppu.cycles at the time
+struct ppu_event
+{
+    uint64_t cycle;
+    enum ppu_event_type type;
+    uint8_t io;
+    uint8_t value;
+    uint16_t offset;
+    uint16_t size;
+    const uint8_t *src;
+};
+
+// One frame of events, replayed by ppu_log_replay on another PPU.
+// CHR sources point into the ROM, OAM copies are kept in data.
+struct ppu_log
+{
+    struct ppu_event *events;
+    size_t count;
+    size_t cap;
+
+    uint8_t *data;
+    size_t data_size;
+    size_t data_cap;
+
+    uint64_t end_cycle;
+};
+
 struct ppu_pins
 {
     uint8_t chr[8192];
     enum ppu_mir mirroring_mode;
+    // 1 KB nametable slots for $2000, $2400, $2800 and $2C00, set with ppu_set_mirroring
+    uint8_t *nametables[4];
 };
 
 struct ppu
@@ -155,15 +243,41 @@ struct ppu
 
     // Rendering & Timing
     uint8_t screen[256*240];
+    // Rows of screen that changed since the last system_frame
+    bool dirty_rows[240];
+    // PPUMASK emphasis bits at the start of each row
+    uint8_t emphasis[240];
     uint16_t beam;
     int16_t scanline;
     uint64_t cycles;
     struct ppu_object preload_objects[8];
     uint8_t preload_objects_sprite_0;
     uint8_t preload_objects_count;
+
+    // Frame skip: don't draw into screen, only keep the status flags going
+    bool skip_render;
+
+    // Cycles at which sprite 0 hit and sprite overflow get set this frame,
+    // UINT64_MAX if they won't. Lets the CPU read PPUSTATUS ahead of the PPU.
+    bool predict_valid;
+    uint64_t predict_sprite_0;
+    uint64_t predict_overflow;
+
+    // When set, everything done to this PPU is recorded for ppu_log_replay
+    struct ppu_log *log;
+
+    // When set, pattern fetches are logged. CHR ROM each 1 KB window was loaded from.
+    struct cdl *cdl;
+    const uint8_t *chr_src[8];
 };
 
 struct ppu ppu_mk();
+void ppu_set_mirroring(struct ppu *ppu, enum ppu_mir mode);
+void ppu_load_chr(struct ppu *ppu, uint16_t offset, const uint8_t *src, size_t size);
+void ppu_clone(struct ppu *dest, const struct ppu *src);
+void ppu_log_clear(struct ppu_log *log);
+void ppu_log_free(struct ppu_log *log);
+void ppu_log_replay(struct ppu *ppu, struct ppu_log *log, struct pool_api *pool);
 void ppu_write(struct ppu *ppu, enum ppu_io io, uint8_t data);
 void ppu_vblank(struct ppu *ppu);
 uint8_t ppu_vram_read(struct ppu *ppu, uint16_t addr);
@@ -172,6 +286,10 @@ uint8_t ppu_read(struct ppu *ppu, enum ppu_io io);
 bool ppu_nmi_enabled(struct ppu *ppu);
 void ppu_write_oam(struct ppu *ppu, uint8_t *oamsrc);
 bool ppu_cycle(struct ppu *ppu, struct ricoh_mem_interface *mem);
+uint64_t ppu_vblank_cycle(struct ppu *ppu);
+uint64_t ppu_next_line_dot_cycle(struct ppu *ppu, uint64_t after, int beam);
+void ppu_predict_status(struct ppu *ppu);
+uint8_t ppu_read_status_ahead(struct ppu *ppu, uint64_t at);
 
 // APU.H
 
@@ -312,24 +430,63 @@ void apu_ring_read(struct apu *apu, uint16_t *dest, uint32_t count);
 void apu_catchup_cycles(struct apu *apu, uint64_t cycles);
 void apu_catchup_samples(struct apu *apu, uint32_t samples_added);
 
-// IMAP.H
+// BLIT.H
 
-struct print_instr
+enum blit_format
 {
-    uint16_t at;
-    struct print_instr *next;
-    struct print_instr *prev;
-    char value[512];
+    BLIT_RGBA8888,
+    BLIT_BGRA8888,
+    BLIT_RGB565,
 };
 
-struct imap
+struct blit_lut
+{
+    enum blit_format format;
+    bool use_avx2;
+    // Colors for each combination of the emphasis bits, already in the output format
+    uint32_t colors[8][64];
+};
+
+// NES colors as RGBA8888
+extern const uint32_t blit_palette[64];
+
+size_t blit_bytes_per_pixel(enum blit_format format);
+void blit_lut_init(struct blit_lut *lut, const uint32_t *rgba, enum blit_format format);
+void blit_rows(
+    const struct blit_lut *lut,
+    const uint8_t *screen,
+    const uint8_t *emphasis,
+    int from, int to,
+    int scale,
+    void *dest, size_t pitch
+);
+
+// CAPTURE.H
+
+// A frame as captured: the palette indices of the screen, then the emphasis bits of each row
+#define CAPTURE_FRAME_SIZE (256*240+240)
+#define CAPTURE_SAMPLE_RATE 44100
+
+// Gameplay recording. Frames go in as palette indices, 4 times smaller than
+// RGBA, are XORed with the frame before and packed, so a still screen costs
+// 5 bytes. capture_export makes a Y4M and a WAV out of it afterwards.
+struct capture
 {
-    struct print_instr *addr[1<<16];
+    void *file;
+    bool ok;
+    uint32_t frames;
+    uint64_t samples;
+    uint64_t bytes;
+    uint8_t prev[CAPTURE_FRAME_SIZE];
+    uint8_t delta[CAPTURE_FRAME_SIZE];
+    uint8_t *packed;
 };
 
-struct imap *imap_mk();
-void imap_populate(struct imap *imap, struct ricoh_decoder *decoder, struct ricoh_mem_interface *mem, uint16_t entry);
-void imap_list_range(struct imap *imap, uint16_t entry, struct print_instr **dest, int from, int to);
+struct capture *capture_open(const char *path);
+bool capture_frame(struct capture *cap, const uint8_t *frame);
+bool capture_samples(struct capture *cap, const uint16_t *samples, uint32_t count);
+bool capture_close(struct capture *cap);
+bool capture_export(const char *path, const char *y4m_path, const char *wav_path);
 
 // MUX.H
 
@@ -339,6 +496,293 @@ struct mux_api {
     void (*unlock)(void *mux);
 };
 
+// IMAP.H
+
+// PRG is analyzed in 8 KB banks, the smallest window any mapper switches
+#define IMAP_BANK_SIZE 0x2000
+#define IMAP_WINDOWS 4
+// Text of the longest instruction, "LDA ($FF),Y" and the like
+#define IMAP_TEXT_SIZE 16
+
+// Decoded instruction, text is only made by imap_format
+struct imap_instr
+{
+    // Address in the window the bank was analyzed at
+    uint16_t at;
+    uint16_t bank;
+    uint8_t opcode;
+    uint8_t operand[2];
+    uint8_t size;
+};
+
+struct imap_addrs
+{
+    uint16_t *addr;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+struct imap_bank
+{
+    uint16_t base;
+    bool mapped;
+    // Arena index + 1 of the instruction at each offset, 0 for none
+    uint16_t *index;
+    struct imap_instr *instrs;
+    uint32_t count;
+    uint32_t capacity;
+
+    // Only used while analyzing
+    const uint8_t *data;
+    struct imap_addrs seeds;
+    struct imap_addrs exits;
+};
+
+// Code map of a whole PRG ROM keyed by (bank, address), built from the vectors by
+// following jumps, calls and branches. Banks mapped at load time sit in their
+// windows, the others are guessed to switch into $8000-$BFFF.
+struct imap
+{
+    struct ricoh_decoder decoder;
+    // Bank mapped in each window at load time
+    uint16_t windows[IMAP_WINDOWS];
+    struct imap_bank *banks;
+    size_t bank_count;
+    int *round;
+
+    struct imap *next;
+    uint64_t hash;
+};
+
+struct imap_cache
+{
+    struct mux_api mux;
+    struct imap *imaps;
+};
+
+struct imap *imap_analyze(
+    struct ricoh_decoder decoder,
+    const uint8_t *prg, size_t prg_size,
+    const uint16_t windows[IMAP_WINDOWS],
+    struct pool_api *pool
+);
+void imap_free(struct imap *imap);
+const struct imap_instr *imap_find(struct imap *imap, uint16_t bank, uint16_t addr);
+void imap_format(struct imap *imap, const struct imap_instr *instr, char *dest, size_t size);
+void imap_list_range(struct imap *imap, uint16_t bank, uint16_t addr, const struct imap_instr **dest, int from, int to);
+// Fills dest with the instructions starting in lo..hi of a bank, in address order, returns how many
+int imap_list_addr_range(struct imap *imap, uint16_t bank, uint16_t lo, uint16_t hi, const struct imap_instr **dest, int max);
+
+// Analyzed maps are kept per PRG hash until the cache is freed
+struct imap_cache imap_cache_make(struct mux_api mux);
+struct imap *imap_cache_analyze(
+    struct imap_cache *cache,
+    struct ricoh_decoder decoder,
+    const uint8_t *prg, size_t prg_size,
+    const uint16_t windows[IMAP_WINDOWS],
+    struct pool_api *pool
+);
+void imap_cache_free(struct imap_cache *cache);
+
+// ROM.H
+
+// A ROM file mapped read-only, shared by every player running it.
+// Images are looked up by path and freed when the last reference goes.
+struct rom_image
+{
+    struct rom_cache *cache;
+    struct rom_image *next;
+    char *path;
+    int refs;
+
+    const uint8_t *data;
+    size_t size;
+};
+
+struct rom_cache
+{
+    struct mux_api mux;
+    struct rom_image *images;
+    // Code maps of the ROMs opened here, under the same mux
+    struct imap_cache imaps;
+    // Optional, analyzes the banks of a code map in parallel
+    struct pool_api *pool;
+};
+
+struct rom_cache rom_cache_make(struct mux_api mux);
+struct rom_image *rom_cache_open(struct rom_cache *cache, const char *path);
+struct rom_image *rom_image_retain(struct rom_image *image);
+void rom_image_release(struct rom_image *image);
+// ROM path with the extension swapped for ext, free it when done
+char *rom_sibling_path(const char *rom_path, const char *ext);
+
+// SAVE.H
+
+#define SAVE_RAM_SIZE 0x2000
+#define SAVE_PAGE_SIZE 0x100
+
+// PRG RAM at $6000-$7FFF, kept in a .sav file next to the ROM if the cart has a battery
+struct save_ram
+{
+    uint8_t data[SAVE_RAM_SIZE];
+    // One bit per page written since the front end last took a copy
+    uint32_t dirty;
+    bool battery;
+    char *path;
+};
+
+void save_ram_load(struct save_ram *ram, const char *rom_path);
+void save_ram_free(struct save_ram *ram);
+bool save_write_file_atomic(const char *path, const uint8_t *data, size_t size);
+
+// DEBUG.H
+
+#define DEBUG_EXEC  (1<<0)
+#define DEBUG_READ  (1<<1)
+#define DEBUG_WRITE (1<<2)
+#define DEBUG_MAX_POINTS 64
+
+struct debug_point
+{
+    uint16_t lo, hi;
+    uint8_t kinds;
+};
+
+struct debug_hit
+{
+    uint8_t kind;
+    uint16_t addr;
+    uint8_t value;
+    // Instruction that made the access
+    uint16_t pc;
+};
+
+// Execution, read and write breakpoints over address ranges. The CPU only
+// looks at the page flags, the points are searched when a flagged page is touched.
+struct debugger
+{
+    uint8_t pages[256];
+    struct debug_point points[DEBUG_MAX_POINTS];
+    int count;
+
+    // system_frame returns at the next instruction boundary and runs nothing until debug_resume
+    bool paused;
+    struct debug_hit hit;
+    uint64_t resume_cycles;
+};
+
+struct system;
+
+bool debug_add(struct debugger *debug, uint16_t lo, uint16_t hi, uint8_t kinds);
+void debug_remove(struct debugger *debug, uint16_t lo, uint16_t hi);
+void debug_clear(struct debugger *debug);
+// Adds points written like "x:C000,rw:0300-03FF"
+bool debug_parse(struct debugger *debug, const char *spec);
+bool debug_check(struct system *system, uint8_t kind, uint16_t addr, uint8_t value);
+void debug_resume(struct system *system);
+// Prints the hit, or the crash, with the CPU and PPU state
+void debug_report(struct system *system);
+
+// PROF.H
+
+enum prof_context
+{
+    PROF_MAIN,
+    PROF_NMI,
+    PROF_IRQ,
+    PROF_CONTEXTS
+};
+
+#define PROF_MAX_DEPTH 64
+// Call tree node of each context's root
+#define PROF_ROOT(context) (1+(context))
+
+// A routine called along one particular call stack
+struct prof_node
+{
+    uint32_t parent;
+    uint16_t addr;
+    uint16_t level;
+    uint64_t cycles;
+};
+
+struct prof_frame
+{
+    uint16_t ret;
+    uint32_t node;
+    uint8_t context;
+    bool interrupt;
+};
+
+// Guest profiler, charges CPU cycles to the PC and to the call stack that spent them.
+// Interrupt handlers get their own contexts. Every Nth instruction or interrupt entry
+// is counted N times.
+struct profiler
+{
+    uint32_t every;
+    uint32_t countdown;
+
+    enum prof_context context;
+    uint64_t pc_cycles[PROF_CONTEXTS][1<<16];
+
+    // Shadow of the guest stack, built from JSR, RTS, RTI and interrupts
+    struct prof_frame stack[PROF_MAX_DEPTH];
+    int depth;
+    uint32_t node;
+
+    struct prof_node *nodes;
+    uint32_t node_count;
+    uint32_t node_cap;
+    // (parent, addr) to node, open addressing
+    uint32_t *table;
+    uint32_t table_cap;
+};
+
+struct profiler *prof_make(uint32_t every);
+void prof_free(struct profiler *prof);
+void prof_instr(struct profiler *prof, uint16_t pc, struct instr_decoded decoded, uint16_t next_pc, uint32_t cycles);
+// cycles is what entering the handler took, 0 for BRK which already paid as an instruction
+void prof_interrupt(struct profiler *prof, enum prof_context context, uint16_t ret, uint16_t handler, uint32_t cycles);
+// Hottest PCs first, with the share of each context
+bool prof_write_flat(struct profiler *prof, const char *path, int top);
+// One "main;$C000;$C123 cycles" line per call stack, for flame graph tools
+bool prof_write_folded(struct profiler *prof, const char *path);
+
+// TRACE.H
+
+#define TRACE_SIZE (1<<16)
+
+// CPU state before an instruction, what a line of a nestest log holds
+struct trace_entry
+{
+    uint64_t cycles;
+    uint16_t pc;
+    uint8_t bytes[3];
+    uint8_t size;
+    uint8_t a, x, y, p, sp;
+    // enum instr and enum addr_mode, to disassemble without the memory
+    uint8_t id, addr_mode;
+};
+
+// The last TRACE_SIZE instructions. count goes on past the size, so a reader
+// that falls more than TRACE_SIZE behind knows it lost entries.
+struct trace
+{
+    struct trace_entry entries[TRACE_SIZE];
+    uint64_t count;
+};
+
+struct trace *trace_make();
+void trace_free(struct trace *trace);
+void trace_instr(struct trace *trace, struct ricoh_state *cpu, struct instr_decoded decoded);
+// Entry number index, NULL once it's overwritten or before it's recorded
+const struct trace_entry *trace_get(struct trace *trace, uint64_t index);
+// A line like nestest logs have, without the memory values
+void trace_format(char *dest, size_t size, const struct trace_entry *entry);
+// Names of the fields that differ, like " PC A", empty if none do. Only the
+// first want->size bytes are compared, so a parsed log can leave out the rest.
+void trace_diff(const struct trace_entry *got, const struct trace_entry *want, char *dest, size_t size);
+
 // SYSTEM.H
 
 enum vector
@@ -379,11 +823,33 @@ struct system
 
     uint8_t memory[1<<16];
     struct ricoh_mem_interface mem;
+
+    // CPU runs ahead of the PPU during the visible lines, until it touches the PPU
+    bool cpu_ahead;
+    // Never lets the CPU run ahead, the reference the run-ahead is checked against
+    bool lockstep;
+    uint64_t instr_cycles;
+    uint16_t instr_pc;
+
+    // PPU cycle at which the mapper pulls the IRQ line, UINT64_MAX if it won't
+    uint64_t irq_cycle;
+
+    // Reads are for decoding the instruction at cpu.pc
+    bool fetching;
+
+    struct debugger debug;
+    // Code map of the PRG as mapped at power on, owned by the ROM cache
+    struct imap *imap;
+    // Optional, owned by the front end
+    struct profiler *prof;
+    struct trace *trace;
 };
 
 struct system_frame_result
 {
     uint8_t screen[240*256];
+    bool dirty_rows[240];
+    uint8_t emphasis[240];
 };
 
 struct system system_init(struct mux_api apu_mux, struct ricoh_mem_interface mem);
@@ -396,31 +862,62 @@ uint8_t system_load(uint8_t *ines, struct system *out);
 struct ricoh_mem_interface system_get_memory_interface(struct system *system);
 struct system_frame_result system_frame(struct system *system);
 void system_reset(struct system *system);
+void system_sync_ppu(struct system *system);
+
+// RTC.H
+
+// Random RAM corruption below $2000, to find game states that break easily.
+// Level 1 nudges a byte by one every 10 frames, level 2 writes a random value every 20.
+struct rtc_state
+{
+    int level;
+    // Frames between corruptions, 0 for the level's own
+    int period;
+    int frames_since_last_pulse;
+    uint64_t rng;
+};
+
+struct rtc_poke
+{
+    uint16_t addr;
+    uint8_t value;
+};
+
+uint64_t rtc_rand(uint64_t *state);
+struct rtc_state rtc_make(int level, uint64_t seed);
+// Returns true and fills poke, if not NULL, when a byte was corrupted
+bool rtc_iter(struct rtc_state *rtc, struct system *sys, struct rtc_poke *poke);
 
 // PLAYER.H
 
+// PRG and CHR of a mapper, pointing into its ROM image
 struct mapper_rom
 {
+    struct rom_image *image;
     size_t prg_size;
     size_t chr_size;
-    uint8_t *prg;
-    uint8_t *chr;
+    const uint8_t *prg;
+    const uint8_t *chr;
 };
 
 struct mapper_data
 {
     bool is_valid;
-    uint8_t *ines;
+    struct rom_image *image;
+    const uint8_t *ines;
     uint8_t prg_banks;
     uint8_t chr_banks;
     uint8_t mapper_number;
     size_t prg_size;
     size_t chr_size;
     enum ppu_mir mirroring;
+    bool battery;
+    // Set by player_init for mappers built on BANKED.H
+    const struct banked_desc *banked;
 };
 
-struct mapper_data mapper_get_data(uint8_t *ines);
-struct mapper_rom mapper_rom_copy(struct mapper_data *data);
+struct mapper_data mapper_get_data(struct rom_image *image);
+struct mapper_rom mapper_rom_share(struct mapper_data *data);
 void mapper_rom_free(struct mapper_rom *rom);
 
 struct mapper_vtbl
@@ -433,6 +930,8 @@ struct mapper_vtbl
     bool (*crash)(void *mapper_data);
     void (*set_controller)(void *mapper_data, struct controller_state controller);
     struct system *(*get_system)(void *mapper_data);
+    struct save_ram *(*get_save_ram)(void *mapper_data);
+    struct cdl *(*enable_cdl)(void *mapper_data, bool enable);
 };
 
 struct player
@@ -442,7 +941,7 @@ struct player
     struct mapper_vtbl *vtbl;
 };
 
-struct player player_init(uint8_t *ines, struct mux_api apu_mux);
+struct player player_init(struct rom_image *image, struct mux_api apu_mux);
 void player_free(struct player *player);
 void player_reset(struct player *player);
 void player_set_controller(struct player *player, struct controller_state controller);
@@ -450,25 +949,86 @@ struct system_frame_result player_frame(struct player *player);
 void player_generate_samples(struct player *player, uint16_t *samples, uint32_t count);
 bool player_crash(struct player *player);
 struct system *player_get_system(struct player *player);
+void player_set_skip_render(struct player *player, bool skip);
+struct save_ram *player_get_save_ram(struct player *player);
+// Starts or stops the code/data log, returns the log while it runs
+struct cdl *player_enable_cdl(struct player *player, bool enable);
+struct cdl *player_get_cdl(struct player *player);
+// First controller of an FCEUX .fm2 movie, one state per frame. Free it when done.
+struct controller_state *player_load_movie(const char *path, int *count);
+
+// BANKED.H
+
+// A mapper declared as PRG/CHR bank windows. Its struct starts with struct banked,
+// write handles $8000-$FFFF register writes and update places the windows from the
+// registers with banked_map_prg/banked_map_chr. Windows are only recomputed after
+// register writes, reads are a single lookup. All of these share banked_vtbl.
+
+#define BANKED_PRG_WINDOW 0x2000
+#define BANKED_PRG_WINDOWS 4
+#define BANKED_CHR_WINDOW 0x400
+#define BANKED_CHR_WINDOWS 8
+
+struct banked;
+
+struct banked_desc
+{
+    size_t size;
+    // Optional, sets the registers up, returning false rejects the ROM
+    bool (*init)(struct banked *mapper, struct mapper_data *data);
+    // Optional, without it writes to $8000-$FFFF go to the system
+    void (*write)(struct banked *mapper, uint16_t addr, uint8_t val);
+    void (*update)(struct banked *mapper);
+    // Optional, resets the registers
+    void (*reset)(struct banked *mapper);
+    // Optional, sees writes below $8000 after the system handled them
+    void (*watch)(struct banked *mapper, uint16_t addr, uint8_t val);
+    // Optional, sees reads of $2000-$3FFF after the system handled them
+    void (*watch_read)(struct banked *mapper, uint16_t addr);
+};
+
+struct banked
+{
+    const struct banked_desc *desc;
+    struct mapper_rom rom;
+    struct system system;
+
+    // $8000-$FFFF in 8 KB windows
+    const uint8_t *prg[BANKED_PRG_WINDOWS];
+    // CHR ROM in 1 KB windows, NULL for CHR RAM
+    const uint8_t *chr[BANKED_CHR_WINDOWS];
+    const uint8_t *chr_loaded[BANKED_CHR_WINDOWS];
+    enum ppu_mir mirroring;
+    struct save_ram prg_ram;
+    struct cdl *cdl;
+};
+
+extern struct mapper_vtbl banked_vtbl;
+void* banked_new(struct mapper_data data, struct mux_api apu_mux);
+void banked_free(void *mapper_data);
+struct system_frame_result banked_frame(void *mapper_data);
+void banked_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
+void banked_reset(void *mapper_data);
+bool banked_crash(void *mapper_data);
+void banked_set_controller(void *mapper_data, struct controller_state controller);
+struct system *banked_get_system(void *mapper_data);
+struct save_ram *banked_get_save_ram(void *mapper_data);
+struct cdl *banked_enable_cdl(void *mapper_data, bool enable);
+// 8 KB PRG bank mapped at addr, 0xFFFF below $8000
+uint16_t banked_prg_bank(void *mapper_data, uint16_t addr);
+// Maps size bytes of bank number bank (counted in size units) at addr
+void banked_map_prg(struct banked *mapper, uint16_t addr, size_t size, size_t bank);
+void banked_map_chr(struct banked *mapper, uint16_t addr, size_t size, size_t bank);
+void banked_update(struct banked *mapper);
 
 // NROM.H
 
 struct nrom
 {
-    bool is_mirrored;
-    uint8_t *rom;
-    struct system system;
+    struct banked banked;
 };
 
-extern struct mapper_vtbl nrom_vtbl;
-void* nrom_new(struct mapper_data data, struct mux_api apu_mux);
-void nrom_free(void *mapper_data);
-struct system_frame_result nrom_frame(void *mapper_data);
-void nrom_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void nrom_reset(void *mapper_data);
-bool nrom_crash(void *mapper_data);
-void nrom_set_controller(void *mapper_data, struct controller_state controller);
-struct system *nrom_get_system(void *mapper_data);
+extern const struct banked_desc nrom_banked;
 
 // MMC1.H
 
@@ -482,8 +1042,7 @@ struct shift_register_result
 
 struct mmc1
 {
-    struct mapper_rom rom;
-    struct system system;
+    struct banked banked;
     shift_register shift_register;
     uint8_t reg_ctrl;
     uint8_t reg_prg_bank;
@@ -491,93 +1050,73 @@ struct mmc1
     uint8_t reg_chr_bank_2;
 };
 
-extern struct mapper_vtbl mmc1_vtbl;
-void* mmc1_new(struct mapper_data data, struct mux_api apu_mux);
-void mmc1_free(void *mapper_data);
-struct system_frame_result mmc1_frame(void *mapper_data);
-void mmc1_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void mmc1_reset(void *mapper_data);
-bool mmc1_crash(void *mapper_data);
-void mmc1_set_controller(void *mapper_data, struct controller_state controller);
-struct system *mmc1_get_system(void *mapper_data);
+extern const struct banked_desc mmc1_banked;
 
 // UNROM.H
 
 struct unrom
 {
-    struct mapper_rom rom;
-    struct system system;
+    struct banked banked;
     uint8_t prg_select;
 };
 
-extern struct mapper_vtbl unrom_vtbl;
-void* unrom_new(struct mapper_data data, struct mux_api apu_mux);
-void unrom_free(void *mapper_data);
-struct system_frame_result unrom_frame(void *mapper_data);
-void unrom_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void unrom_reset(void *mapper_data);
-bool unrom_crash(void *mapper_data);
-void unrom_set_controller(void *mapper_data, struct controller_state controller);
-struct system *unrom_get_system(void *mapper_data);
+extern const struct banked_desc unrom_banked;
 
 // M228.H -- MAKE YOUR SELECTION, NOW!
 
 struct m228
 {
-    struct mapper_rom rom;
-    struct system system;
+    struct banked banked;
     uint8_t reg_data;
     uint16_t reg_addr;
     uint8_t serial_id;
 };
 
-extern struct mapper_vtbl m228_vtbl;
-void* m228_new(struct mapper_data data, struct mux_api apu_mux);
-void m228_free(void *mapper_data);
-struct system_frame_result m228_frame(void *mapper_data);
-void m228_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void m228_reset(void *mapper_data);
-bool m228_crash(void *mapper_data);
-void m228_set_controller(void *mapper_data, struct controller_state controller);
-struct system *m228_get_system(void *mapper_data);
+extern const struct banked_desc m228_banked;
 
 // CNROM.H
 
 struct cnrom
 {
-    struct mapper_rom rom;
-    struct system system;
+    struct banked banked;
     uint8_t chr_bank;
 };
 
-extern struct mapper_vtbl cnrom_vtbl;
-void* cnrom_new(struct mapper_data data, struct mux_api apu_mux);
-void cnrom_free(void *mapper_data);
-struct system_frame_result cnrom_frame(void *mapper_data);
-void cnrom_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void cnrom_reset(void *mapper_data);
-bool cnrom_crash(void *mapper_data);
-void cnrom_set_controller(void *mapper_data, struct controller_state controller);
-struct system *cnrom_get_system(void *mapper_data);
+extern const struct banked_desc cnrom_banked;
 
 // AXROM.H
 
 struct axrom
 {
-    struct mapper_rom rom;
-    struct system system;
+    struct banked banked;
     uint8_t prg_bank;
 };
 
-extern struct mapper_vtbl axrom_vtbl;
-void* axrom_new(struct mapper_data data, struct mux_api apu_mux);
-void axrom_free(void *mapper_data);
-struct system_frame_result axrom_frame(void *mapper_data);
-void axrom_generate_samples(void *mapper_data, uint16_t *samples, uint32_t count);
-void axrom_reset(void *mapper_data);
-bool axrom_crash(void *mapper_data);
-void axrom_set_controller(void *mapper_data, struct controller_state controller);
-struct system *axrom_get_system(void *mapper_data);
+extern const struct banked_desc axrom_banked;
+
+// MMC3.H
+
+struct mmc3
+{
+    struct banked banked;
+    uint8_t bank_select;
+    uint8_t regs[8];
+
+    // Scanline counter, clocked by PPU A12 rising once per rendered line.
+    // It's only brought up to date on writes that can change it, the IRQ
+    // is scheduled ahead in system.irq_cycle.
+    uint8_t irq_latch;
+    uint8_t irq_counter;
+    bool irq_reload;
+    bool irq_enabled;
+    // PPU cycle the counter is up to date with, and the dot it gets clocked on, -1 if not clocked
+    uint64_t irq_synced;
+    int irq_dot;
+    // A12 as PPUADDR and PPUDATA left it outside rendering, and when
+    bool a12;
+    uint64_t a12_cycle;
+};
 
+extern const struct banked_desc mmc3_banked;
 
 #endif
\ No newline at end of file
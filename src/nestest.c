@@ -0,0 +1,279 @@
+// CPU conformance check: runs nestest from $C000 like its automated mode, with
+// the CPU trace on, and compares every instruction with a reference log as it
+// goes. Stops at the first difference and shows the instructions before it.
+#include "neske.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// CPU cycles in an NTSC frame, rounded down
+#define NESTEST_FRAME_CYCLES 29780
+
+struct nestest_ref
+{
+    struct trace_entry *entries;
+    char (*lines)[128];
+    int count;
+};
+
+// Reads a Nintendulator style log: "C000  4C F5 C5  JMP $C5F5   A:00 X:00 Y:00 P:24 SP:FD ... CYC:7"
+static bool nestest_load_ref(const char *path, struct nestest_ref *ref)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        printf("Can't open %s\n", path);
+        return false;
+    }
+
+    int cap = 0;
+    char line[256];
+    int line_number = 0;
+
+    while (fgets(line, sizeof line, fp))
+    {
+        line_number++;
+        line[strcspn(line, "\r\n")] = 0;
+        if (!line[0])
+        {
+            continue;
+        }
+
+        if (ref->count == cap)
+        {
+            cap = cap ? cap*2 : 8192;
+            ref->entries = realloc(ref->entries, cap*sizeof(struct trace_entry));
+            ref->lines = realloc(ref->lines, cap*sizeof *ref->lines);
+            assert(ref->entries && ref->lines);
+        }
+
+        struct trace_entry *entry = &ref->entries[ref->count];
+        memset(entry, 0, sizeof *entry);
+
+        unsigned pc, a, x, y, p, sp;
+        unsigned long long cycles;
+        const char *regs = strlen(line) > 16 ? strstr(line+16, "A:") : NULL;
+        const char *cyc = strstr(line, "CYC:");
+        if (sscanf(line, "%4x", &pc) != 1 || !regs || !cyc
+            || sscanf(regs, "A:%x X:%x Y:%x P:%x SP:%x", &a, &x, &y, &p, &sp) != 5
+            || sscanf(cyc, "CYC:%llu", &cycles) != 1)
+        {
+            printf("%s:%d: not a trace line\n", path, line_number);
+            fclose(fp);
+            return false;
+        }
+
+        // Instruction bytes are in columns 6 to 14
+        for (int i = 0; i < 3 && line[6+i*3] != ' '; i++)
+        {
+            unsigned byte;
+            if (sscanf(line+6+i*3, "%2x", &byte) != 1)
+            {
+                break;
+            }
+            entry->bytes[i] = byte;
+            entry->size++;
+        }
+
+        entry->pc = pc;
+        entry->a = a;
+        entry->x = x;
+        entry->y = y;
+        entry->p = p;
+        entry->sp = sp;
+        entry->cycles = cycles;
+
+        snprintf(ref->lines[ref->count], sizeof *ref->lines, "%s", line);
+        ref->count++;
+    }
+
+    fclose(fp);
+    return ref->count > 0;
+}
+
+// The code map built when the ROM loaded has to agree with nestest's reset code
+static bool nestest_check_code_map(struct system *sys)
+{
+    static const char *want[] = { "SEI", "CLD", "LDX #$FF", "TXS", "LDA $2002" };
+    const int count = sizeof want / sizeof want[0];
+    const struct imap_instr *instrs[sizeof want / sizeof want[0]];
+
+    // $C004 is in the window at $C000
+    imap_list_range(sys->imap, sys->imap->windows[2], 0xC004, instrs, 0, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        char text[IMAP_TEXT_SIZE*2] = "nothing";
+        if (instrs[i])
+        {
+            imap_format(sys->imap, instrs[i], text, sizeof text);
+            // Implied operands leave a space at the end
+            size_t len = strlen(text);
+            while (len > 0 && text[len-1] == ' ')
+            {
+                text[--len] = 0;
+            }
+        }
+        if (!instrs[i] || strcmp(text, want[i]) != 0)
+        {
+            printf("Code map has %s where the reset code has %s, instruction %d from $C004\n", text, want[i], i+1);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void nestest_usage()
+{
+    printf("usage: nestest [ROM] [REF] [-c LINES]\n");
+    printf("  ROM  misc/nestest.nes by default\n");
+    printf("  REF  log to compare with, misc/ref.txt by default\n");
+    printf("  -c   instructions to show before a difference, 16 by default\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *rom_path = NULL;
+    const char *ref_path = NULL;
+    int context = 16;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0 && i+1 < argc) context = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && !rom_path)      rom_path = argv[i];
+        else if (argv[i][0] != '-' && !ref_path)      ref_path = argv[i];
+        else
+        {
+            nestest_usage();
+            return 1;
+        }
+    }
+
+    if (context < 0 || context > TRACE_SIZE)
+    {
+        nestest_usage();
+        return 1;
+    }
+    if (!rom_path)
+    {
+        rom_path = "misc/nestest.nes";
+    }
+    if (!ref_path)
+    {
+        ref_path = "misc/ref.txt";
+    }
+
+    struct nestest_ref ref = { 0 };
+    if (!nestest_load_ref(ref_path, &ref))
+    {
+        return 1;
+    }
+
+    struct mux_api mux = { NULL, headless_mux_nop, headless_mux_nop };
+    struct rom_cache roms = rom_cache_make(mux);
+    struct rom_image *image = rom_cache_open(&roms, rom_path);
+    if (!image)
+    {
+        return 1;
+    }
+
+    struct player player = player_init(image, mux);
+    rom_image_release(image);
+    if (!player.is_valid)
+    {
+        printf("Can't run %s\n", rom_path);
+        return 1;
+    }
+
+    struct system *sys = player_get_system(&player);
+    player_set_skip_render(&player, true);
+
+    if (!nestest_check_code_map(sys))
+    {
+        player_free(&player);
+        free(ref.entries);
+        free(ref.lines);
+        return 2;
+    }
+
+    // The automated mode starts at $C000 instead of the reset vector
+    sys->cpu.pc = 0xC000;
+    sys->trace = trace_make();
+
+    // A few frames more than the log covers, in case the CPU is slower than it should be
+    int max_frames = ref.entries[ref.count-1].cycles/NESTEST_FRAME_CYCLES + 60;
+
+    uint64_t start = headless_now_ns();
+    uint64_t checked = 0;
+    int result = 0;
+
+    for (int frame = 0; checked < (uint64_t)ref.count && result == 0; frame++)
+    {
+        if (frame == max_frames)
+        {
+            printf("Stopped after %d frames with %d of %d instructions run\n", frame, (int)checked, ref.count);
+            result = 2;
+            break;
+        }
+
+        player_frame(&player);
+
+        if (sys->trace->count-checked > TRACE_SIZE)
+        {
+            printf("The trace lost instructions, more than %d ran in a frame\n", TRACE_SIZE);
+            result = 2;
+            break;
+        }
+
+        for (; checked < sys->trace->count && checked < (uint64_t)ref.count; checked++)
+        {
+            const struct trace_entry *got = trace_get(sys->trace, checked);
+            char fields[64];
+            trace_diff(got, &ref.entries[checked], fields, sizeof fields);
+            if (!fields[0])
+            {
+                continue;
+            }
+
+            char line[160];
+            uint64_t first = checked > (uint64_t)context ? checked-context : 0;
+            for (uint64_t i = first; i < checked; i++)
+            {
+                trace_format(line, sizeof line, trace_get(sys->trace, i));
+                printf("      %5d  %s\n", (int)i+1, line);
+            }
+            trace_format(line, sizeof line, got);
+            printf("want  %5d  %s\n", (int)checked+1, ref.lines[checked]);
+            printf("got   %5d  %s\n", (int)checked+1, line);
+            printf("Instruction %d of %s differs in%s\n", (int)checked+1, ref_path, fields);
+            result = 2;
+            break;
+        }
+
+        if (result == 0 && checked < (uint64_t)ref.count && player_crash(&player))
+        {
+            printf("CPU crashed after %d of %d instructions\n", (int)checked, ref.count);
+            debug_report(sys);
+            result = 2;
+        }
+    }
+
+    double seconds = (headless_now_ns() - start) / 1e9;
+
+    if (result == 0)
+    {
+        // nestest leaves the number of the first failed official and unofficial test in $02 and $03
+        printf("%d instructions match %s in %.1f ms, $02=%02X $03=%02X\n",
+            ref.count, ref_path, seconds*1e3, sys->memory[0x02], sys->memory[0x03]);
+    }
+
+    trace_free(sys->trace);
+    sys->trace = NULL;
+    player_free(&player);
+    free(ref.entries);
+    free(ref.lines);
+
+    return result;
+}
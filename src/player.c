@@ -4,16 +4,17 @@
 #include <string.h>
 #include <assert.h>
 
-struct mapper_data mapper_get_data(uint8_t *ines)
+struct mapper_data mapper_get_data(struct rom_image *image)
 {
     struct mapper_data data = { 0 };
+    const uint8_t *ines = image->data;
 
-    if (!(ines[0] == 'N' && ines[1] == 'E' && ines[2] == 'S' && ines[3] == 0x1A))
+    if (image->size < 16 || !(ines[0] == 'N' && ines[1] == 'E' && ines[2] == 'S' && ines[3] == 0x1A))
     {
         return data;
     }
     
-    data.is_valid = true;
+    data.image = image;
     data.ines = ines;
 
     data.prg_banks = ines[4];
@@ -22,38 +23,38 @@ struct mapper_data mapper_get_data(uint8_t *ines)
     data.chr_size = data.chr_banks*0x2000;
     data.mapper_number = (ines[6] >> 4) | (ines[7] & 0xF0);
     data.mirroring = (ines[6] & 1) ? PPUMIR_VER : PPUMIR_HOR;
+    data.battery = (ines[6] & 2) != 0;
 
     printf("Mapper number: %d\n", data.mapper_number);
 
-    assert(data.prg_size != 0);
+    if (data.prg_size == 0 || 16+data.prg_size+data.chr_size > image->size)
+    {
+        printf("ROM is smaller than its header says\n");
+        return data;
+    }
+
+    data.is_valid = true;
 
     return data;
 }
 
-struct mapper_rom mapper_rom_copy(struct mapper_data *data)
+struct mapper_rom mapper_rom_share(struct mapper_data *data)
 {
-    uint8_t *data_copy = malloc(data->prg_size+data->chr_size);
-    if (!data_copy)
-    {
-        return (struct mapper_rom){ 0 };
-    }
-
-    memcpy(data_copy, data->ines+16, data->prg_size+data->chr_size);
-
-    return (struct mapper_rom){ data->prg_size, data->chr_size, data_copy, data_copy+data->prg_size };
+    const uint8_t *rom = data->ines+16;
+    return (struct mapper_rom){ rom_image_retain(data->image), data->prg_size, data->chr_size, rom, rom+data->prg_size };
 }
 
 void mapper_rom_free(struct mapper_rom *rom)
 {
-    free(rom->prg);
+    rom_image_release(rom->image);
 }
 
-struct player player_init(uint8_t *ines, struct mux_api apu_mux)
+struct player player_init(struct rom_image *image, struct mux_api apu_mux)
 {
     printf("player_init\n");
     struct player player = { 0 };
 
-    struct mapper_data data = mapper_get_data(ines);
+    struct mapper_data data = mapper_get_data(image);
 
     if (!data.is_valid)
     {
@@ -62,15 +63,18 @@ struct player player_init(uint8_t *ines, struct mux_api apu_mux)
 
     switch (data.mapper_number)
     {
-        case 0: player.vtbl = &nrom_vtbl; break;
-        case 1: player.vtbl = &mmc1_vtbl; break;
-        case 2: player.vtbl = &unrom_vtbl; break;
-        case 3: player.vtbl = &cnrom_vtbl; break;
-        case 7: player.vtbl = &axrom_vtbl; break;
-        case 228: player.vtbl = &m228_vtbl; break;
+        case 0: data.banked = &nrom_banked; break;
+        case 1: data.banked = &mmc1_banked; break;
+        case 2: data.banked = &unrom_banked; break;
+        case 3: data.banked = &cnrom_banked; break;
+        case 4: data.banked = &mmc3_banked; break;
+        case 7: data.banked = &axrom_banked; break;
+        case 228: data.banked = &m228_banked; break;
         default: return player;
     }
 
+    player.vtbl = &banked_vtbl;
+
     player.mapper_data = player.vtbl->new(data, apu_mux);
 
     if (!player.mapper_data)
@@ -80,6 +84,12 @@ struct player player_init(uint8_t *ines, struct mux_api apu_mux)
 
     player.is_valid = true;
 
+    struct save_ram *save_ram = player_get_save_ram(&player);
+    if (save_ram && data.battery)
+    {
+        save_ram_load(save_ram, image->path);
+    }
+
     printf("player_init done\n");
 
     return player;
@@ -149,3 +159,89 @@ struct system *player_get_system(struct player *player)
 
     return NULL;
 }
+
+
+void player_set_skip_render(struct player *player, bool skip)
+{
+    struct system *system = player_get_system(player);
+
+    if (system)
+    {
+        system->ppu.skip_render = skip;
+    }
+}
+
+struct save_ram *player_get_save_ram(struct player *player)
+{
+    if (player->is_valid && player->vtbl->get_save_ram)
+    {
+        return player->vtbl->get_save_ram(player->mapper_data);
+    }
+
+    return NULL;
+}
+
+struct cdl *player_enable_cdl(struct player *player, bool enable)
+{
+    if (player->is_valid && player->vtbl->enable_cdl)
+    {
+        return player->vtbl->enable_cdl(player->mapper_data, enable);
+    }
+
+    return NULL;
+}
+
+struct cdl *player_get_cdl(struct player *player)
+{
+    struct system *system = player_get_system(player);
+
+    return system ? system->ppu.cdl : NULL;
+}
+
+// Reads the first controller out of an FCEUX .fm2 movie, one state per frame
+struct controller_state *player_load_movie(const char *path, int *count)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        return NULL;
+    }
+
+    // fm2 keeps the buttons of a frame as "|commands|RLDUTSBA|...", '.' for released
+    static const enum controller_btn order[8] = { BTN_RIGHT, BTN_LEFT, BTN_DOWN, BTN_UP, BTN_START, BTN_SELECT, BTN_B, BTN_A };
+
+    struct controller_state *frames = NULL;
+    int cap = 0;
+    char line[256];
+
+    *count = 0;
+    while (fgets(line, sizeof line, fp))
+    {
+        if (line[0] != '|')
+        {
+            continue;
+        }
+
+        char *pad = strchr(line+1, '|');
+        if (!pad || strlen(pad+1) < 8)
+        {
+            continue;
+        }
+
+        if (*count == cap)
+        {
+            cap = cap ? cap*2 : 1024;
+            frames = realloc(frames, cap*sizeof(struct controller_state));
+        }
+
+        struct controller_state *state = &frames[(*count)++];
+        memset(state, 0, sizeof *state);
+        for (int i = 0; i < 8; i++)
+        {
+            state->btns[order[i]] = pad[1+i] != '.' && pad[1+i] != ' ';
+        }
+    }
+
+    fclose(fp);
+    return frames;
+}
@@ -1,7 +1,41 @@
 #include "neske.h"
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
+static void ppu_log_push(struct ppu *ppu, struct ppu_event event)
+{
+    struct ppu_log *log = ppu->log;
+
+    if (log->count == log->cap)
+    {
+        log->cap = log->cap ? log->cap*2 : 1024;
+        log->events = realloc(log->events, log->cap*sizeof(struct ppu_event));
+        assert(log->events != NULL);
+    }
+
+    event.cycle = ppu->cycles;
+    log->events[log->count++] = event;
+}
+
+static size_t ppu_log_push_data(struct ppu *ppu, const uint8_t *data, size_t size)
+{
+    struct ppu_log *log = ppu->log;
+
+    while (log->data_size + size > log->data_cap)
+    {
+        log->data_cap = log->data_cap ? log->data_cap*2 : 4096;
+        log->data = realloc(log->data, log->data_cap);
+        assert(log->data != NULL);
+    }
+
+    size_t at = log->data_size;
+    memcpy(log->data + at, data, size);
+    log->data_size += size;
+
+    return at;
+}
+
 uint8_t *ppu_vram_get_ptr(struct ppu *ppu, uint16_t addr)
 {
     if (addr >= 0x0000 && addr < 0x2000)
@@ -11,37 +45,7 @@ uint8_t *ppu_vram_get_ptr(struct ppu *ppu, uint16_t addr)
 
     if (addr >= 0x2000 && addr < 0x3000)
     {
-        switch (ppu->pins.mirroring_mode)
-        {
-            case PPUMIR_HOR:
-                if (addr >= 0x2400 && addr < 0x2800)
-                {
-                    addr -= 0x400;
-                }
-                else if (addr >= 0x2800 && addr < 0x2C00)
-                {
-                    addr -= 0x400;
-                }
-                else if (addr >= 0x2C00 && addr < 0x3000)
-                {
-                    addr -= 0x800;
-                }
-                break;
-            case PPUMIR_VER:
-                if (addr >= 0x2800 && addr < 0x3000)
-                {
-                    addr -= 0x800;
-                }
-                break;
-            case PPUMIR_ONE_ALT:
-                addr = addr % 0x400 + 0x2400;
-                break;
-            case PPUMIR_ONE:
-                addr = addr % 0x400 + 0x2000;
-                break;
-        }
-
-        return ppu->vram + (addr-0x2000);
+        return ppu->pins.nametables[(addr>>10)&3] + (addr&0x3FF);
     }
 
     if (addr >= 0x3F00 && addr <= 0x4000)
@@ -60,7 +64,7 @@ uint8_t *ppu_vram_get_ptr(struct ppu *ppu, uint16_t addr)
     return NULL;
 }
 
-uint8_t ppu_vram_read(struct ppu *ppu, uint16_t addr)
+static uint8_t ppu_vram_fetch(struct ppu *ppu, uint16_t addr, uint8_t cdl_flag)
 {
     uint8_t *ptr = ppu_vram_get_ptr(ppu, addr);
     if (ptr == NULL)
@@ -68,9 +72,21 @@ uint8_t ppu_vram_read(struct ppu *ppu, uint16_t addr)
         return 0;
     }
 
+    // A PPU feeding a log leaves it to the one replaying it
+    if (ppu->cdl && !ppu->log && addr < 0x2000 && ppu->chr_src[addr>>10])
+    {
+        const uint8_t *src = ppu->chr_src[addr>>10] + (addr&0x3FF);
+        ppu->cdl->chr[src - ppu->cdl->chr_rom] |= cdl_flag;
+    }
+
     return ptr[0];
 }
 
+uint8_t ppu_vram_read(struct ppu *ppu, uint16_t addr)
+{
+    return ppu_vram_fetch(ppu, addr, CDL_DRAWN);
+}
+
 void ppu_vram_write(struct ppu *ppu, uint16_t addr, uint8_t val)
 {
     uint8_t *ptr = ppu_vram_get_ptr(ppu, addr);
@@ -82,9 +98,50 @@ void ppu_vram_write(struct ppu *ppu, uint16_t addr, uint8_t val)
     ptr[0] = val;
 }
 
+void ppu_set_mirroring(struct ppu *ppu, enum ppu_mir mode)
+{
+    // Offsets of the four logical nametables ($2000, $2400, $2800, $2C00) in VRAM
+    static const uint16_t slots[][4] = {
+        [PPUMIR_ONE]     = { 0x000, 0x000, 0x000, 0x000 },
+        [PPUMIR_ONE_ALT] = { 0x400, 0x400, 0x400, 0x400 },
+        [PPUMIR_VER]     = { 0x000, 0x400, 0x000, 0x400 },
+        [PPUMIR_HOR]     = { 0x000, 0x000, 0x400, 0x400 },
+    };
+
+    if (ppu->log)
+    {
+        ppu_log_push(ppu, (struct ppu_event){ .type = PPUEV_MIRRORING, .value = mode });
+    }
+
+    ppu->pins.mirroring_mode = mode;
+
+    for (int i = 0; i < 4; i++)
+    {
+        ppu->pins.nametables[i] = ppu->vram + slots[mode][i];
+    }
+}
+
+void ppu_load_chr(struct ppu *ppu, uint16_t offset, const uint8_t *src, size_t size)
+{
+    if (ppu->log)
+    {
+        // ROM doesn't change, so only the pointer is kept
+        ppu_log_push(ppu, (struct ppu_event){ .type = PPUEV_CHR, .offset = offset, .size = size, .src = src });
+    }
+
+    memcpy(ppu->pins.chr + offset, src, size);
+
+    for (size_t i = 0; i < size/0x400; i++)
+    {
+        ppu->chr_src[offset/0x400 + i] = src + i*0x400;
+    }
+}
+
 struct ppu ppu_mk()
 {
     struct ppu ppu = { 0 };
+    // Nothing was presented yet
+    memset(ppu.dirty_rows, true, sizeof ppu.dirty_rows);
     return ppu;
 }
 
@@ -100,6 +157,11 @@ void ppu_set_addr(struct ppu *ppu, uint16_t addr)
 
 void ppu_write(struct ppu *ppu, enum ppu_io io, uint8_t data)
 {
+    if (ppu->log)
+    {
+        ppu_log_push(ppu, (struct ppu_event){ .type = PPUEV_WRITE, .io = io, .value = data });
+    }
+
     switch (io)
     {
         case PPUIO_CTRL:
@@ -167,6 +229,12 @@ void ppu_vblank(struct ppu *ppu)
 
 uint8_t ppu_read(struct ppu *ppu, enum ppu_io io)
 {
+    // These reads change the PPU
+    if (ppu->log && (io == PPUIO_STATUS || io == PPUIO_DATA))
+    {
+        ppu_log_push(ppu, (struct ppu_event){ .type = PPUEV_READ, .io = io });
+    }
+
     switch (io)
     {
         case PPUIO_STATUS: 
@@ -181,7 +249,7 @@ uint8_t ppu_read(struct ppu *ppu, enum ppu_io io)
         case PPUIO_DATA:
             {
                 uint8_t value = ppu->regs[PPUIR_DATA];
-                ppu->regs[PPUIR_DATA] = ppu_vram_read(ppu, ppu_get_addr(ppu));
+                ppu->regs[PPUIR_DATA] = ppu_vram_fetch(ppu, ppu_get_addr(ppu), CDL_READ);
                 if (ppu->regs[PPUIR_CTRL] & (1 << 2))
                 {
                     ppu_set_addr(ppu, ppu_get_addr(ppu)+32);
@@ -206,6 +274,11 @@ bool ppu_nmi_enabled(struct ppu *ppu)
 
 void ppu_write_oam(struct ppu *ppu, uint8_t *oamsrc)
 {
+    if (ppu->log)
+    {
+        ppu_log_push(ppu, (struct ppu_event){ .type = PPUEV_OAM, .offset = ppu_log_push_data(ppu, oamsrc, 256) });
+    }
+
     memcpy(ppu->oam, oamsrc, 256);
 }
 
@@ -220,42 +293,20 @@ struct ppu_nametable_result ppu_read_nametable(struct ppu *ppu, uint8_t x, uint8
     x %= 64;
     y %= 60;
 
-    if (ppu->pins.mirroring_mode == PPUMIR_HOR)
-    {
-        x %= 32;
-    }
-    else if (ppu->pins.mirroring_mode == PPUMIR_VER)
-    {
-        y %= 30;
-    }
-    else
-    {
-        x %= 32;
-        y %= 30;
-    }
-
-    uint16_t addr = 0x2000;
+    uint8_t *nametable = ppu->pins.nametables[(x>=32)|((y>=30)<<1)];
 
-    if (x >= 32) 
-    {
-        addr += 0x400;
-        x -= 32;
-    }
-    if (y >= 30) 
-    {
-        addr += 0x800;
-        y -= 30;
-    }
+    x %= 32;
+    y %= 30;
 
     uint8_t octx =  (x>>2);   // 0 0
     uint8_t octy =  (y>>2);   // 1 1
     uint8_t quadx = (x>>1)&1; // 0 1
     uint8_t quady = (y>>1)&1; // 0 0
     uint8_t q = (quadx|(quady<<1))<<1; // right
-    uint8_t palidx = (ppu_vram_read(ppu, addr+0x3C0+octx+octy*8)>>q)&3;
+    uint8_t palidx = (nametable[0x3C0+octx+octy*8]>>q)&3;
 
     return (struct ppu_nametable_result) {
-        ppu_vram_read(ppu, addr + x + y * 32),
+        nametable[x + y * 32],
         palidx
     };
 }
@@ -275,40 +326,101 @@ void ppu_get_scroll(struct ppu *ppu, uint16_t *sx, uint16_t *sy)
     *sy += ((ppu->t&(1<<11)) ? 240 : 0);
 }
 
-uint8_t ppu_get_pixel(struct ppu *ppu, int x, int y)
+// Returns the 2-bit color index of the background at x, y, 0 is transparent
+static uint8_t ppu_get_bg_color(struct ppu *ppu, int x, int y, uint8_t *palidx)
 {
-    uint8_t pixel = 15;
-    bool opaque = false;
+    uint16_t scroll_x = 0, scroll_y = 0;
+    ppu_get_scroll(ppu, &scroll_x, &scroll_y);
 
-    bool leftrgn = x < 8;
-    bool bgvisible = (ppu->regs[PPUIR_MASK]&(1<<3)) && (!leftrgn || (ppu->regs[PPUIR_MASK]&(1<<1)));
-    bool objvisible = (ppu->regs[PPUIR_MASK]&(1<<4)) && (!leftrgn || (ppu->regs[PPUIR_MASK]&(1<<2)));
+    int sx = (x + scroll_x);
+    int sy = (y + scroll_y);
 
-    // Get tile pixel
-    if (bgvisible)
+    int tile_x = sx/8;
+    int tile_y = sy/8;
+
+    struct ppu_nametable_result ntr = ppu_read_nametable(ppu, tile_x, tile_y);
+
+    uint16_t tile = ntr.tile;
+    *palidx = ntr.palidx;
+
+    if (ppu->regs[PPUIR_CTRL] & (1<<4)) tile += 0x100;
+
+    int tx = sx%8;
+    int ty = sy%8;
+
+    uint8_t lo = (ppu_vram_read(ppu, (uint16_t)tile*16+ty)>>(7-tx))&1;
+    uint8_t hi = (ppu_vram_read(ppu, (uint16_t)tile*16+8+ty)>>(7-tx))&1;
+
+    return lo | (hi << 1);
+}
+
+// Returns the 2-bit color index of the object at x, y, 0 if transparent or not covering the pixel
+static uint8_t ppu_get_obj_color(struct ppu *ppu, struct ppu_object obj, int x, int y)
+{
+    uint16_t tile = obj.tile;
+    int tx = x-obj.x;
+    int ty = y-obj.y;
+
+    if (obj.y == 0) return 0;
+
+    if (ppu->regs[PPUIR_CTRL]&(1<<5))
     {
-        uint16_t scroll_x = 0, scroll_y = 0;
-        ppu_get_scroll(ppu, &scroll_x, &scroll_y);
+        if (tx >= 8 || tx < 0 || ty >= 16 || ty < 0)
+        {
+            return 0;
+        }
 
-        int sx = (x + scroll_x);
-        int sy = (y + scroll_y);
+        if (obj.attr & (1<<7)) ty = 16-ty-1;
 
-        int tile_x = sx/8;
-        int tile_y = sy/8;
+        tile = (obj.tile&~1)+((obj.tile&1)*0x100);
+        if (ty >= 8) tile += 1;
+        ty %= 8;
+    }
+    else
+    {
+        if (tx >= 8 || tx < 0 || ty >= 8 || ty < 0)
+        {
+            return 0;
+        }
 
-        struct ppu_nametable_result ntr = ppu_read_nametable(ppu, tile_x, tile_y);
+        if (obj.attr & (1<<7)) ty = 8-ty-1;
+        if (ppu->regs[PPUIR_CTRL] & (1<<3)) tile += 0x100;
+    }
 
-        uint16_t tile = ntr.tile;
-        uint8_t palidx = ntr.palidx;
+    if (obj.attr & (1<<6)) tx = 8-tx-1;
 
-        if (ppu->regs[PPUIR_CTRL] & (1<<4)) tile += 0x100;
+    uint8_t lo = (ppu_vram_read(ppu, tile*16+ty)>>(7-tx))&1;
+    uint8_t hi = (ppu_vram_read(ppu, tile*16+8+ty)>>(7-tx))&1;
 
-        int tx = sx%8;
-        int ty = sy%8;
+    return lo | (hi << 1);
+}
 
-        uint8_t lo = (ppu_vram_read(ppu, (uint16_t)tile*16+ty)>>(7-tx))&1;
-        uint8_t hi = (ppu_vram_read(ppu, (uint16_t)tile*16+8+ty)>>(7-tx))&1;
-        uint8_t palcoloridx = lo | (hi << 1);
+static bool ppu_bg_visible(struct ppu *ppu, int x)
+{
+    return (ppu->regs[PPUIR_MASK]&(1<<3)) && (x >= 8 || (ppu->regs[PPUIR_MASK]&(1<<1)));
+}
+
+static bool ppu_obj_visible(struct ppu *ppu, int x)
+{
+    return (ppu->regs[PPUIR_MASK]&(1<<4)) && (x >= 8 || (ppu->regs[PPUIR_MASK]&(1<<2)));
+}
+
+// Pixel at x, y with the given objects on the line, hit is set on a sprite 0 hit
+static uint8_t ppu_get_line_pixel(
+    struct ppu *ppu,
+    const struct ppu_object *objects, uint8_t objects_count, uint8_t objects_sprite_0,
+    int x, int y,
+    bool *hit
+)
+{
+    uint8_t pixel = 15;
+    bool opaque = false;
+
+    // Get tile pixel
+    if (ppu_bg_visible(ppu, x))
+    {
+        uint8_t palidx = 0;
+        uint8_t palcoloridx = ppu_get_bg_color(ppu, x, y, &palidx);
         uint8_t palcolor = ppu_vram_read(ppu, 0x3F00+palidx*4+palcoloridx);
         if (palcoloridx == 0)
         {
@@ -319,102 +431,265 @@ uint8_t ppu_get_pixel(struct ppu *ppu, int x, int y)
         pixel = palcolor;
     }
 
-    if (objvisible)
+    if (ppu_obj_visible(ppu, x))
     {
-        if (ppu->regs[PPUIR_CTRL]&(1<<5))
-            for (int o = 0; o < ppu->preload_objects_count; o++)
-            {
-                struct ppu_object obj = ppu->preload_objects[o];
-               
-                uint16_t tile1 = (obj.tile&~1)+((obj.tile&1)*0x100);
-                uint16_t tile2 = tile1+1;
+        for (int o = 0; o < objects_count; o++)
+        {
+            struct ppu_object obj = objects[o];
 
-                if (obj.y == 0) continue;
+            uint8_t palcoloridx = ppu_get_obj_color(ppu, obj, x, y);
 
-                if (x-obj.x >= 8 || x-obj.x < 0 || y-obj.y >= 16 || y-obj.y < 0)
-                {
-                    continue;
-                }
+            if (palcoloridx == 0)
+            {
+                continue;
+            }
 
-                int tx = x-obj.x;
-                if (obj.attr & (1<<6)) tx = 8-tx-1;
-                int ty = y-obj.y;
-                if (obj.attr & (1<<7))
-                {
-                    ty = 16-ty-1;
-                }
-                
-                uint16_t tile = ty >= 8 ? tile2 : tile1;
-                uint8_t palidx = obj.attr&3;
-                ty %= 8;
-
-                uint8_t lo = (ppu_vram_read(ppu, tile*16+ty)>>(7-tx))&1;
-                uint8_t hi = (ppu_vram_read(ppu, tile*16+8+ty)>>(7-tx))&1;
-                uint8_t palcoloridx = lo | (hi << 1);
-                uint8_t palcolor = ppu_vram_read(ppu, 0x3F10+palidx*4+palcoloridx);
-             
-                if (palcoloridx == 0) 
-                {
-                    continue;
-                }
+            uint8_t palcolor = ppu_vram_read(ppu, 0x3F10+(obj.attr&3)*4+palcoloridx);
 
-                if (opaque && o == 0 && ppu->preload_objects_sprite_0)
-                {
-                    ppu->regs[PPUIO_STATUS] = ppu->regs[PPUIO_STATUS]|(1<<6);
-                }
-                
-                if (!(obj.attr & (1<<5)) || !opaque)
-                {
-                    pixel = palcolor;
-                    break;
-                }
+            if (opaque && o == 0 && objects_sprite_0)
+            {
+                *hit = true;
             }
-        else
-            for (int o = 0; o < ppu->preload_objects_count; o++)
+
+            if (!(obj.attr & (1<<5)) || !opaque)
             {
-                struct ppu_object obj = ppu->preload_objects[o];
+                pixel = palcolor;
+                break;
+            }
+        }
+    }
 
-                uint16_t tile = obj.tile;
+    return pixel;
+}
 
-                if (obj.y == 0) continue;
+uint8_t ppu_get_pixel(struct ppu *ppu, int x, int y)
+{
+    bool hit = false;
+    uint8_t pixel = ppu_get_line_pixel(
+        ppu,
+        ppu->preload_objects, ppu->preload_objects_count, ppu->preload_objects_sprite_0,
+        x, y,
+        &hit
+    );
+
+    if (hit)
+    {
+        ppu->regs[PPUIR_STATUS] |= 1<<6;
+    }
 
-                if (x-obj.x >= 8 || x-obj.x < 0 || y-obj.y >= 8 || y-obj.y < 0)
-                {
-                    continue;
-                }
+    return pixel;
+}
 
-                int tx = x-obj.x;
-                if (obj.attr & (1<<6)) tx = 8-tx-1;
-                int ty = y-obj.y;
-                if (obj.attr & (1<<7)) ty = 8-ty-1;
+// Picks the first 8 objects on scanline, returns true if there are more
+static bool ppu_eval_objects(struct ppu *ppu, int scanline, struct ppu_object *objects, uint8_t *count, uint8_t *sprite_0)
+{
+    int height = ppu->regs[PPUIR_CTRL]&(1<<5) ? 16 : 8;
 
-                if (ppu->regs[PPUIR_CTRL] & (1<<3)) tile += 0x100;
-                uint8_t palidx = obj.attr&3;
+    *count = 0;
+    *sprite_0 = 0;
 
-                uint8_t lo = (ppu_vram_read(ppu, tile*16+ty)>>(7-tx))&1;
-                uint8_t hi = (ppu_vram_read(ppu, tile*16+8+ty)>>(7-tx))&1;
-                uint8_t palcoloridx = lo | (hi << 1);
-                uint8_t palcolor = ppu_vram_read(ppu, 0x3F10+palidx*4+palcoloridx);
-             
-                if (palcoloridx == 0) 
-                {
-                    continue;
-                }
+    for (int o = 0; o < 64; o++)
+    {
+        struct ppu_object obj = ppu->oam[o];
+        // @TODO: Maybe not here
+        obj.y += 1;
 
-                if (opaque && o == 0 && ppu->preload_objects_sprite_0)
-                {
-                    ppu->regs[PPUIO_STATUS] = ppu->regs[PPUIO_STATUS]|(1<<6);
-                }
-                
-                if (!(obj.attr & (1<<5)) || !opaque)
+        if (scanline >= obj.y && scanline < obj.y+height)
+        {
+            if (*count == 8)
+            {
+                return true;
+            }
+
+            if (o == 0)
+                *sprite_0 = 1;
+
+            objects[(*count)++] = obj;
+        }
+    }
+
+    return false;
+}
+
+// Draws a row into screen the way ppu_cycle would, without touching anything else
+static void ppu_draw_row(struct ppu *ppu, int y)
+{
+    struct ppu_object objects[8];
+    uint8_t objects_count, objects_sprite_0;
+    ppu_eval_objects(ppu, y, objects, &objects_count, &objects_sprite_0);
+
+    if (ppu->emphasis[y] != ppu->regs[PPUIR_MASK]>>5)
+    {
+        ppu->emphasis[y] = ppu->regs[PPUIR_MASK]>>5;
+        ppu->dirty_rows[y] = true;
+    }
+
+    for (int x = 0; x < 256; x++)
+    {
+        bool hit = false;
+        uint8_t pixel = ppu_get_line_pixel(ppu, objects, objects_count, objects_sprite_0, x, y, &hit);
+
+        if (ppu->screen[x+y*256] != pixel)
+        {
+            ppu->screen[x+y*256] = pixel;
+            ppu->dirty_rows[y] = true;
+        }
+    }
+}
+
+static bool ppu_sprite_0_hit_at(struct ppu *ppu, struct ppu_object obj, int x, int y)
+{
+    if (!ppu_bg_visible(ppu, x) || !ppu_obj_visible(ppu, x))
+    {
+        return false;
+    }
+
+    if (ppu_get_obj_color(ppu, obj, x, y) == 0)
+    {
+        return false;
+    }
+
+    uint8_t palidx = 0;
+    return ppu_get_bg_color(ppu, x, y, &palidx) != 0;
+}
+
+// Frame skip counterpart of ppu_get_pixel, only does the sprite 0 hit test
+static void ppu_test_sprite_0(struct ppu *ppu, int x, int y)
+{
+    if (!ppu->preload_objects_sprite_0 || (ppu->regs[PPUIR_STATUS] & (1<<6)))
+    {
+        return;
+    }
+
+    if (ppu_sprite_0_hit_at(ppu, ppu->preload_objects[0], x, y))
+    {
+        ppu->regs[PPUIR_STATUS] |= 1<<6;
+    }
+}
+
+// Value of ppu->cycles during the ppu_cycle call that handles the given dot of this frame
+static uint64_t ppu_dot_cycle(struct ppu *ppu, int scanline, int beam)
+{
+    return ppu->cycles + 1 + (int64_t)(scanline - ppu->scanline)*341 + beam - ppu->beam;
+}
+
+uint64_t ppu_vblank_cycle(struct ppu *ppu)
+{
+    return ppu_dot_cycle(ppu, 241, 0);
+}
+
+// Value of ppu->cycles during the first call after the one at cycle after that
+// handles the given dot of a rendering line (-1 to 239), in this frame or the next
+uint64_t ppu_next_line_dot_cycle(struct ppu *ppu, uint64_t after, int beam)
+{
+    const int64_t frame = 262*341+1;
+
+    // Position in the frame of the dot handled at after+1, line -1 starts at 0
+    int64_t pos = (ppu->scanline+1)*341 + ppu->beam + (int64_t)(after - ppu->cycles);
+    pos = (pos%frame + frame)%frame;
+
+    int64_t line = pos/341;
+    int64_t dot = pos%341;
+    int64_t wait;
+
+    if (line <= 240 && dot <= beam)
+    {
+        wait = beam - dot;
+    }
+    else if (line < 240)
+    {
+        wait = 341 - dot + beam;
+    }
+    else
+    {
+        wait = frame - pos + beam;
+    }
+
+    return after + 1 + wait;
+}
+
+void ppu_predict_status(struct ppu *ppu)
+{
+    int height = ppu->regs[PPUIR_CTRL]&(1<<5) ? 16 : 8;
+
+    ppu->predict_valid = true;
+    ppu->predict_sprite_0 = UINT64_MAX;
+    ppu->predict_overflow = UINT64_MAX;
+
+    if (!(ppu->regs[PPUIR_STATUS] & (1<<6)))
+    {
+        for (int y = ppu->scanline; y < 240 && ppu->predict_sprite_0 == UINT64_MAX; y++)
+        {
+            struct ppu_object obj = ppu->oam[0];
+            int from = 0;
+
+            if (y == ppu->scanline)
+            {
+                // Objects for the current line are already loaded
+                if (y < 0 || ppu->beam > 340 || !ppu->preload_objects_sprite_0) continue;
+                obj = ppu->preload_objects[0];
+                from = ppu->beam;
+            }
+            else
+            {
+                obj.y += 1;
+                if (!(y >= obj.y && y < obj.y+height)) continue;
+            }
+
+            for (int x = obj.x; x < obj.x+8 && x < 256; x++)
+            {
+                if (x >= from && ppu_sprite_0_hit_at(ppu, obj, x, y))
                 {
-                    pixel = palcolor;
+                    ppu->predict_sprite_0 = ppu_dot_cycle(ppu, y, x);
                     break;
                 }
             }
+        }
     }
 
-    return pixel;
+    if (!(ppu->regs[PPUIR_STATUS] & (1<<5)))
+    {
+        // Objects per line, as a difference array over the object ranges
+        int16_t lines[262+16] = { 0 };
+        for (int o = 0; o < 64; o++)
+        {
+            uint8_t y = ppu->oam[o].y+1;
+            lines[y] += 1;
+            lines[y+height] -= 1;
+        }
+
+        int count = 0;
+        for (int line = 0; line <= 240; line++)
+        {
+            count += lines[line];
+            if (line > ppu->scanline && count > 8)
+            {
+                ppu->predict_overflow = ppu_dot_cycle(ppu, line, 0);
+                break;
+            }
+        }
+    }
+}
+
+uint8_t ppu_read_status_ahead(struct ppu *ppu, uint64_t at)
+{
+    if (!ppu->predict_valid)
+    {
+        ppu_predict_status(ppu);
+    }
+
+    // Vblank is never set while the CPU is ahead, see system_frame
+    if (ppu->log)
+    {
+        ppu_log_push(ppu, (struct ppu_event){ .type = PPUEV_READ, .io = PPUIO_STATUS });
+    }
+
+    uint8_t result = ppu->regs[PPUIR_STATUS];
+    if (ppu->predict_sprite_0 <= at) result |= 1<<6;
+    if (ppu->predict_overflow <= at) result |= 1<<5;
+    ppu->w = 0;
+
+    return result;
 }
 
 bool ppu_cycle(struct ppu *ppu, struct ricoh_mem_interface *mem)
@@ -428,6 +703,7 @@ bool ppu_cycle(struct ppu *ppu, struct ricoh_mem_interface *mem)
         // I didn't look into this properly but I assume you need to reset the sprite overflow flag
         ppu->regs[PPUIR_STATUS] &= ~(1<<5);
         ppu->regs[PPUIO_STATUS] &= ~(1<<7);
+        ppu->predict_valid = false;
     }
 
     if (ppu->beam > 340)
@@ -438,32 +714,12 @@ bool ppu_cycle(struct ppu *ppu, struct ricoh_mem_interface *mem)
         }
         ppu->scanline += 1;
         ppu->beam = 0;
-        ppu->preload_objects_count = 0;
-        ppu->preload_objects_sprite_0 = 0;
 
-        for (int o = 0; o < 64; o++)
+        if (ppu_eval_objects(ppu, ppu->scanline, ppu->preload_objects, &ppu->preload_objects_count, &ppu->preload_objects_sprite_0))
         {
-            struct ppu_object obj = ppu->oam[o];
-            // @TODO: Maybe not here
-            obj.y += 1;
-
-            int height = ppu->regs[PPUIR_CTRL]&(1<<5) ? 16 : 8;
-
-            if (ppu->scanline >= obj.y && ppu->scanline < obj.y+height)
-            {
-                if (ppu->preload_objects_count == 8) 
-                {
-                    // Sprite overflow, but this isn't a proper way to handle it
-                    // there's a bug in the original hardware, I cba to implement it right now -.-
-                    ppu->regs[PPUIR_STATUS] |= 1<<5;
-                    break;
-                }
-
-                if (o == 0)
-                    ppu->preload_objects_sprite_0 = 1;
-
-                ppu->preload_objects[ppu->preload_objects_count++] = obj;
-            }
+            // Sprite overflow, but this isn't a proper way to handle it
+            // there's a bug in the original hardware, I cba to implement it right now -.-
+            ppu->regs[PPUIR_STATUS] |= 1<<5;
         }
     }
  
@@ -478,9 +734,26 @@ bool ppu_cycle(struct ppu *ppu, struct ricoh_mem_interface *mem)
             int x = ppu->beam;
             int y = ppu->scanline;
 
-            uint8_t pixel = ppu_get_pixel(ppu, x, y);
+            if (ppu->skip_render)
+            {
+                ppu_test_sprite_0(ppu, x, y);
+            }
+            else
+            {
+                uint8_t pixel = ppu_get_pixel(ppu, x, y);
+
+                if (x == 0 && ppu->emphasis[y] != ppu->regs[PPUIR_MASK]>>5)
+                {
+                    ppu->emphasis[y] = ppu->regs[PPUIR_MASK]>>5;
+                    ppu->dirty_rows[y] = true;
+                }
 
-            ppu->screen[x+y*256] = pixel;
+                if (ppu->screen[x+y*256] != pixel)
+                {
+                    ppu->screen[x+y*256] = pixel;
+                    ppu->dirty_rows[y] = true;
+                }
+            }
         }
     }
     else if (ppu->scanline == 240)
@@ -502,3 +775,124 @@ bool ppu_cycle(struct ppu *ppu, struct ricoh_mem_interface *mem)
 
     return nmi_occured;
 }
+
+void ppu_clone(struct ppu *dest, const struct ppu *src)
+{
+    *dest = *src;
+    dest->log = NULL;
+    dest->skip_render = false;
+    // Nametable slots point into the VRAM they were set up with
+    ppu_set_mirroring(dest, src->pins.mirroring_mode);
+}
+
+void ppu_log_clear(struct ppu_log *log)
+{
+    log->count = 0;
+    log->data_size = 0;
+    log->end_cycle = 0;
+}
+
+void ppu_log_free(struct ppu_log *log)
+{
+    free(log->events);
+    free(log->data);
+    *log = (struct ppu_log){ 0 };
+}
+
+struct ppu_band_job
+{
+    struct ppu *ppu;
+    int bands;
+};
+
+static void ppu_draw_band(void *arg, int band)
+{
+    struct ppu_band_job *job = arg;
+
+    for (int y = band*240/job->bands; y < (band+1)*240/job->bands; y++)
+    {
+        ppu_draw_row(job->ppu, y);
+    }
+}
+
+// True if nothing that changes the picture happens in log from event next until cycle end
+static bool ppu_log_quiet_until(struct ppu_log *log, size_t next, uint64_t end)
+{
+    if (log->end_cycle < end)
+    {
+        return false;
+    }
+
+    for (size_t i = next; i < log->count && log->events[i].cycle < end; i++)
+    {
+        // Reads only touch v, w, the read buffer and the status flags, drawing uses none of them
+        if (log->events[i].type != PPUEV_READ)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Renders the frame recorded in log, ppu must be in the state the log started from.
+// With a pool, when nothing changes the picture from row 0 to the last visible dot,
+// the rows only depend on the state at the start of row 0. They're drawn in
+// parallel bands, and the frame goes on in skip_render mode for the status flags.
+void ppu_log_replay(struct ppu *ppu, struct ppu_log *log, struct pool_api *pool)
+{
+    uint64_t bands_end = 0;
+
+    // Bands would all mark the same CHR flags, a code/data log draws row by row
+    if (ppu->cdl)
+    {
+        pool = NULL;
+    }
+
+    for (size_t i = 0; i <= log->count; i++)
+    {
+        uint64_t until = i < log->count ? log->events[i].cycle : log->end_cycle;
+
+        while (ppu->cycles < until)
+        {
+            // Right before row 0
+            if (pool && !bands_end && ppu->scanline == -1 && ppu->beam > 340)
+            {
+                uint64_t end = ppu_dot_cycle(ppu, 239, 255);
+
+                if (ppu_log_quiet_until(log, i, end))
+                {
+                    struct ppu_band_job job = { ppu, pool->threads*2 };
+                    pool->run(pool->pool, job.bands, ppu_draw_band, &job);
+
+                    bands_end = end;
+                    ppu->skip_render = true;
+                }
+            }
+
+            ppu_cycle(ppu, NULL);
+
+            if (bands_end && ppu->cycles == bands_end)
+            {
+                bands_end = 0;
+                ppu->skip_render = false;
+            }
+        }
+
+        if (i == log->count)
+        {
+            break;
+        }
+
+        struct ppu_event *event = &log->events[i];
+
+        switch (event->type)
+        {
+            case PPUEV_WRITE: ppu_write(ppu, event->io, event->value); break;
+            case PPUEV_READ: ppu_read(ppu, event->io); break;
+            case PPUEV_OAM: ppu_write_oam(ppu, log->data + event->offset); break;
+            case PPUEV_MIRRORING: ppu_set_mirroring(ppu, event->value); break;
+            case PPUEV_CHR: ppu_load_chr(ppu, event->offset, event->src, event->size); break;
+        }
+    }
+}
@@ -0,0 +1,282 @@
+#include "neske.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROF_NODES_INITIAL 1024
+
+static const char *prof_context_names[PROF_CONTEXTS] = { "main", "nmi", "irq" };
+
+static uint32_t prof_hash(uint32_t parent, uint16_t addr)
+{
+    return (parent*2654435761u) ^ (addr*40503u);
+}
+
+static void prof_grow(struct profiler *prof)
+{
+    uint32_t old_cap = prof->table_cap;
+    uint32_t *old_table = prof->table;
+
+    // The table stays at most half full
+    prof->table_cap = old_cap ? old_cap*2 : PROF_NODES_INITIAL*2;
+    prof->table = calloc(prof->table_cap, sizeof(uint32_t));
+    assert(prof->table != NULL);
+
+    for (uint32_t i = 0; i < old_cap; i++)
+    {
+        uint32_t node = old_table[i];
+        if (node)
+        {
+            uint32_t slot = prof_hash(prof->nodes[node].parent, prof->nodes[node].addr) & (prof->table_cap-1);
+            while (prof->table[slot]) slot = (slot+1) & (prof->table_cap-1);
+            prof->table[slot] = node;
+        }
+    }
+
+    free(old_table);
+
+    prof->node_cap = prof->table_cap/2;
+    prof->nodes = realloc(prof->nodes, prof->node_cap*sizeof(struct prof_node));
+    assert(prof->nodes != NULL);
+}
+
+static uint32_t prof_new_node(struct profiler *prof, uint32_t parent, uint16_t addr)
+{
+    if (prof->node_count == prof->node_cap)
+    {
+        prof_grow(prof);
+    }
+
+    uint32_t node = prof->node_count++;
+    uint16_t level = parent ? prof->nodes[parent].level+1 : 0;
+    prof->nodes[node] = (struct prof_node){ parent, addr, level, 0 };
+
+    return node;
+}
+
+// Node for a call to addr made from parent
+static uint32_t prof_child(struct profiler *prof, uint32_t parent, uint16_t addr)
+{
+    if (prof->node_count == prof->node_cap)
+    {
+        prof_grow(prof);
+    }
+
+    uint32_t slot = prof_hash(parent, addr) & (prof->table_cap-1);
+    while (prof->table[slot])
+    {
+        struct prof_node *node = &prof->nodes[prof->table[slot]];
+        if (node->parent == parent && node->addr == addr)
+        {
+            return prof->table[slot];
+        }
+        slot = (slot+1) & (prof->table_cap-1);
+    }
+
+    uint32_t node = prof_new_node(prof, parent, addr);
+    prof->table[slot] = node;
+
+    return node;
+}
+
+struct profiler *prof_make(uint32_t every)
+{
+    struct profiler *prof = calloc(1, sizeof(struct profiler));
+    assert(prof != NULL);
+
+    prof->every = every ? every : 1;
+    prof->countdown = prof->every;
+
+    prof_grow(prof);
+
+    // Node 0 means "no node" in the table, the roots come right after it
+    prof_new_node(prof, 0, 0);
+    for (int i = 0; i < PROF_CONTEXTS; i++)
+    {
+        prof_new_node(prof, 0, 0);
+    }
+    prof->node = PROF_ROOT(PROF_MAIN);
+
+    return prof;
+}
+
+void prof_free(struct profiler *prof)
+{
+    free(prof->table);
+    free(prof->nodes);
+    free(prof);
+}
+
+static void prof_push(struct profiler *prof, uint16_t ret, bool interrupt)
+{
+    if (prof->depth == PROF_MAX_DEPTH)
+    {
+        // Runaway recursion, or a stack the game unwinds itself; drop the oldest frame
+        memmove(prof->stack, prof->stack+1, (PROF_MAX_DEPTH-1)*sizeof(struct prof_frame));
+        prof->depth--;
+    }
+
+    prof->stack[prof->depth++] = (struct prof_frame){ ret, prof->node, prof->context, interrupt };
+}
+
+// Charges cycles to pc and the current node if this one is sampled
+static void prof_charge(struct profiler *prof, uint16_t pc, uint32_t cycles)
+{
+    if (--prof->countdown == 0)
+    {
+        prof->countdown = prof->every;
+        prof->pc_cycles[prof->context][pc] += cycles*prof->every;
+        prof->nodes[prof->node].cycles += cycles*prof->every;
+    }
+}
+
+void prof_interrupt(struct profiler *prof, enum prof_context context, uint16_t ret, uint16_t handler, uint32_t cycles)
+{
+    prof_push(prof, ret, true);
+    prof->context = context;
+    prof->node = prof_child(prof, PROF_ROOT(context), handler);
+
+    // Pushing the return address and reading the vector, spent for the handler
+    if (cycles)
+    {
+        prof_charge(prof, handler, cycles);
+    }
+}
+
+void prof_instr(struct profiler *prof, uint16_t pc, struct instr_decoded decoded, uint16_t next_pc, uint32_t cycles)
+{
+    prof_charge(prof, pc, cycles);
+
+    switch (decoded.id)
+    {
+        case JSR:
+            prof_push(prof, pc+3, false);
+            // Calls that never return would grow the tree forever
+            if (prof->nodes[prof->node].level < PROF_MAX_DEPTH)
+            {
+                prof->node = prof_child(prof, prof->node, next_pc);
+            }
+            break;
+        case BRK:
+            prof_interrupt(prof, PROF_IRQ, pc+2, next_pc, 0);
+            break;
+        case RTS:
+        case RTI:
+            // Unwind to the frame that returns here. Returning anywhere else is
+            // a jump as far as the call tree goes, like pushing an address and RTS.
+            for (int i = prof->depth-1; i >= 0; i--)
+            {
+                struct prof_frame *frame = &prof->stack[i];
+                if (decoded.id == RTS && frame->interrupt)
+                {
+                    break;
+                }
+                if (frame->interrupt == (decoded.id == RTI) && frame->ret == next_pc)
+                {
+                    prof->node = frame->node;
+                    prof->context = frame->context;
+                    prof->depth = i;
+                    break;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void prof_write_stack(FILE *fp, struct profiler *prof, uint32_t node)
+{
+    if (node < PROF_ROOT(PROF_CONTEXTS))
+    {
+        fprintf(fp, "%s", prof_context_names[node-PROF_ROOT(0)]);
+        return;
+    }
+
+    prof_write_stack(fp, prof, prof->nodes[node].parent);
+    fprintf(fp, ";$%04X", prof->nodes[node].addr);
+}
+
+bool prof_write_folded(struct profiler *prof, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        printf("Can't write profile %s\n", path);
+        return false;
+    }
+
+    for (uint32_t i = PROF_ROOT(0); i < prof->node_count; i++)
+    {
+        if (prof->nodes[i].cycles)
+        {
+            prof_write_stack(fp, prof, i);
+            fprintf(fp, " %llu\n", (unsigned long long)prof->nodes[i].cycles);
+        }
+    }
+
+    return fclose(fp) == 0;
+}
+
+struct prof_entry
+{
+    uint64_t cycles;
+    uint16_t pc;
+    uint8_t context;
+};
+
+static int prof_entry_cmp(const void *a, const void *b)
+{
+    const struct prof_entry *ea = a, *eb = b;
+    return ea->cycles < eb->cycles ? 1 : ea->cycles > eb->cycles ? -1 : 0;
+}
+
+bool prof_write_flat(struct profiler *prof, const char *path, int top)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        printf("Can't write profile %s\n", path);
+        return false;
+    }
+
+    struct prof_entry *entries = malloc(PROF_CONTEXTS*0x10000*sizeof(struct prof_entry));
+    assert(entries != NULL);
+
+    size_t count = 0;
+    uint64_t totals[PROF_CONTEXTS] = { 0 };
+    uint64_t total = 0;
+
+    for (int c = 0; c < PROF_CONTEXTS; c++)
+    {
+        for (uint32_t pc = 0; pc < 0x10000; pc++)
+        {
+            if (prof->pc_cycles[c][pc])
+            {
+                entries[count++] = (struct prof_entry){ prof->pc_cycles[c][pc], pc, c };
+                totals[c] += prof->pc_cycles[c][pc];
+            }
+        }
+        total += totals[c];
+    }
+
+    qsort(entries, count, sizeof(struct prof_entry), prof_entry_cmp);
+
+    fprintf(fp, "%llu cycles, 1 in %u instructions sampled\n", (unsigned long long)total, prof->every);
+    for (int c = 0; c < PROF_CONTEXTS; c++)
+    {
+        fprintf(fp, "%-5s %12llu %6.2f%%\n", prof_context_names[c], (unsigned long long)totals[c], total ? 100.0*totals[c]/total : 0.0);
+    }
+    fprintf(fp, "\n");
+
+    for (size_t i = 0; i < count && (int)i < top; i++)
+    {
+        fprintf(fp, "%-5s $%04X %12llu %6.2f%%\n",
+            prof_context_names[entries[i].context], entries[i].pc,
+            (unsigned long long)entries[i].cycles, 100.0*entries[i].cycles/total);
+    }
+
+    free(entries);
+    return fclose(fp) == 0;
+}
@@ -0,0 +1,521 @@
+// Headless regression runner: plays a list of ROMs, each with an optional input
+// movie, across cores and checks hashes of the picture, the audio and RAM
+// against golden ones saved by an earlier run. Each hash takes in every frame
+// up to the checkpoint, so a difference anywhere before it is caught.
+#include "neske.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REGRESS_SAMPLE_RATE 44100
+#define REGRESS_FPS 60
+#define REGRESS_MAX_ENTRIES 256
+#define REGRESS_PATH_MAX 512
+
+enum regress_part
+{
+    REGRESS_SCREEN,
+    REGRESS_AUDIO,
+    REGRESS_RAM,
+    REGRESS_PARTS
+};
+
+static const char *regress_part_names[REGRESS_PARTS] = { "screen", "audio", "ram" };
+
+struct regress_checkpoint
+{
+    uint32_t frame;
+    uint64_t hashes[REGRESS_PARTS];
+};
+
+// One line of the suite
+struct regress_entry
+{
+    char rom_path[REGRESS_PATH_MAX];
+    // "-" for no input
+    char movie_path[REGRESS_PATH_MAX];
+    int frames;
+
+    struct regress_checkpoint *checkpoints;
+    int checkpoint_count;
+    // Set when the game crashed, the checkpoints stop before it
+    int crash_frame;
+    bool failed_to_run;
+
+    struct regress_checkpoint *golden;
+    int golden_count;
+    int golden_crash_frame;
+};
+
+static uint64_t regress_hash(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Suite lines are "ROM MOVIE FRAMES", MOVIE is "-" for none, # starts a comment
+static int regress_read_suite(const char *path, struct regress_entry *entries)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        printf("Can't open suite %s\n", path);
+        return -1;
+    }
+
+    char line[2*REGRESS_PATH_MAX];
+    int count = 0;
+    int line_number = 0;
+
+    while (fgets(line, sizeof line, fp))
+    {
+        line_number++;
+
+        char *comment = strchr(line, '#');
+        if (comment)
+        {
+            *comment = 0;
+        }
+        if (strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+
+        if (count == REGRESS_MAX_ENTRIES)
+        {
+            printf("%s: more than %d entries\n", path, REGRESS_MAX_ENTRIES);
+            break;
+        }
+
+        struct regress_entry *entry = &entries[count];
+        memset(entry, 0, sizeof *entry);
+        if (sscanf(line, "%511s %511s %d", entry->rom_path, entry->movie_path, &entry->frames) != 3 || entry->frames <= 0)
+        {
+            printf("%s:%d: expected ROM MOVIE FRAMES\n", path, line_number);
+            fclose(fp);
+            return -1;
+        }
+        entry->crash_frame = -1;
+        entry->golden_crash_frame = -1;
+        count++;
+    }
+
+    fclose(fp);
+    return count;
+}
+
+static struct regress_entry *regress_find(struct regress_entry *entries, int count, const char *rom_path, const char *movie_path)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(entries[i].rom_path, rom_path) == 0 && strcmp(entries[i].movie_path, movie_path) == 0)
+        {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void regress_add_golden(struct regress_entry *entry, struct regress_checkpoint checkpoint)
+{
+    // Golden files are written in order, so growing one at a time is enough
+    entry->golden = realloc(entry->golden, (entry->golden_count+1)*sizeof(struct regress_checkpoint));
+    assert(entry->golden != NULL);
+    entry->golden[entry->golden_count++] = checkpoint;
+}
+
+// Golden lines are "ROM MOVIE FRAME SCREEN AUDIO RAM" or "ROM MOVIE crash FRAME".
+// Lines for ROMs that aren't in the suite are skipped.
+static bool regress_read_golden(const char *path, struct regress_entry *entries, int count)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        printf("Can't open golden hashes %s, make them with -u\n", path);
+        return false;
+    }
+
+    char line[2*REGRESS_PATH_MAX + 128];
+    char rom_path[REGRESS_PATH_MAX], movie_path[REGRESS_PATH_MAX];
+    unsigned long long hashes[REGRESS_PARTS];
+    unsigned frame;
+
+    while (fgets(line, sizeof line, fp))
+    {
+        if (line[0] == '#')
+        {
+            continue;
+        }
+
+        if (sscanf(line, "%511s %511s crash %u", rom_path, movie_path, &frame) == 3)
+        {
+            struct regress_entry *entry = regress_find(entries, count, rom_path, movie_path);
+            if (entry)
+            {
+                entry->golden_crash_frame = frame;
+            }
+        }
+        else if (sscanf(line, "%511s %511s %u %llx %llx %llx", rom_path, movie_path, &frame, &hashes[0], &hashes[1], &hashes[2]) == 6)
+        {
+            struct regress_entry *entry = regress_find(entries, count, rom_path, movie_path);
+            if (entry)
+            {
+                regress_add_golden(entry, (struct regress_checkpoint){ frame, { hashes[0], hashes[1], hashes[2] } });
+            }
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+static bool regress_write_golden(const char *path, const char *suite_path, struct regress_entry *entries, int count)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        printf("Can't write %s\n", path);
+        return false;
+    }
+
+    fprintf(fp, "# neske golden hashes, made with: regress %s -g %s -u\n", suite_path, path);
+    fprintf(fp, "# ROM MOVIE FRAME SCREEN AUDIO RAM\n");
+    for (int i = 0; i < count; i++)
+    {
+        struct regress_entry *entry = &entries[i];
+        for (int c = 0; c < entry->checkpoint_count; c++)
+        {
+            struct regress_checkpoint *checkpoint = &entry->checkpoints[c];
+            fprintf(fp, "%s %s %u %016llx %016llx %016llx\n", entry->rom_path, entry->movie_path, checkpoint->frame,
+                (unsigned long long)checkpoint->hashes[REGRESS_SCREEN],
+                (unsigned long long)checkpoint->hashes[REGRESS_AUDIO],
+                (unsigned long long)checkpoint->hashes[REGRESS_RAM]);
+        }
+        if (entry->crash_frame >= 0)
+        {
+            fprintf(fp, "%s %s crash %d\n", entry->rom_path, entry->movie_path, entry->crash_frame);
+        }
+    }
+
+    return fclose(fp) == 0;
+}
+
+struct regress_job
+{
+    workers_mutex mutex;
+    struct rom_cache *roms;
+    struct regress_entry *entries;
+    int count;
+    int every;
+    bool replay_log;
+
+    int next;
+};
+
+// Plays one entry from power on, with a blank cartridge RAM so .sav files
+// next to the ROM don't change the results
+static void regress_run(struct regress_job *job, struct regress_entry *entry)
+{
+    struct controller_state *movie = NULL;
+    int movie_frames = 0;
+    if (strcmp(entry->movie_path, "-") != 0 && !(movie = player_load_movie(entry->movie_path, &movie_frames)))
+    {
+        printf("Can't read movie %s\n", entry->movie_path);
+        entry->failed_to_run = true;
+        return;
+    }
+
+    // The cache locks the job's mutex itself
+    struct rom_image *image = rom_cache_open(job->roms, entry->rom_path);
+
+    struct player player = { 0 };
+    if (image)
+    {
+        player = player_init(image, (struct mux_api){ NULL, headless_mux_nop, headless_mux_nop });
+        rom_image_release(image);
+    }
+    if (!player.is_valid)
+    {
+        printf("Can't run %s\n", entry->rom_path);
+        entry->failed_to_run = true;
+        free(movie);
+        return;
+    }
+
+    struct system *sys = player_get_system(&player);
+    struct save_ram *save_ram = player_get_save_ram(&player);
+    if (save_ram)
+    {
+        memset(save_ram->data, 0, SAVE_RAM_SIZE);
+    }
+
+    // -l draws like the SDL front end, from the log the emulating PPU keeps
+    struct headless_replay *replay = job->replay_log ? headless_replay_make(sys) : NULL;
+    struct ppu *drawn = replay ? &replay->replica : &sys->ppu;
+
+    entry->checkpoints = malloc((entry->frames/job->every + 1)*sizeof(struct regress_checkpoint));
+    assert(entry->checkpoints != NULL);
+
+    uint16_t samples[REGRESS_SAMPLE_RATE/REGRESS_FPS];
+    uint64_t hashes[REGRESS_PARTS];
+    for (int i = 0; i < REGRESS_PARTS; i++)
+    {
+        hashes[i] = 1469598103934665603ULL;
+    }
+
+    for (int frame = 1; frame <= entry->frames; frame++)
+    {
+        if (movie)
+        {
+            int index = frame-1 < movie_frames ? frame-1 : movie_frames-1;
+            player_set_controller(&player, movie[index]);
+        }
+
+        player_frame(&player);
+        if (player_crash(&player))
+        {
+            entry->crash_frame = frame;
+            break;
+        }
+
+        if (replay)
+        {
+            headless_replay_frame(replay, sys);
+        }
+
+        player_generate_samples(&player, samples, REGRESS_SAMPLE_RATE/REGRESS_FPS);
+
+        hashes[REGRESS_SCREEN] = regress_hash(hashes[REGRESS_SCREEN], drawn->screen, sizeof drawn->screen);
+        hashes[REGRESS_SCREEN] = regress_hash(hashes[REGRESS_SCREEN], drawn->emphasis, sizeof drawn->emphasis);
+        hashes[REGRESS_AUDIO] = regress_hash(hashes[REGRESS_AUDIO], samples, sizeof samples);
+        hashes[REGRESS_RAM] = regress_hash(hashes[REGRESS_RAM], sys->memory, 0x800);
+        if (save_ram)
+        {
+            hashes[REGRESS_RAM] = regress_hash(hashes[REGRESS_RAM], save_ram->data, SAVE_RAM_SIZE);
+        }
+
+        if (frame % job->every == 0 || frame == entry->frames)
+        {
+            struct regress_checkpoint *checkpoint = &entry->checkpoints[entry->checkpoint_count++];
+            checkpoint->frame = frame;
+            memcpy(checkpoint->hashes, hashes, sizeof hashes);
+        }
+    }
+
+    if (replay)
+    {
+        headless_replay_free(replay, sys);
+    }
+    player_free(&player);
+    free(movie);
+}
+
+static void regress_worker(void *arg)
+{
+    struct regress_job *job = arg;
+
+    for (;;)
+    {
+        workers_lock(&job->mutex);
+        int index = job->next++;
+        workers_unlock(&job->mutex);
+
+        if (index >= job->count)
+        {
+            break;
+        }
+
+        regress_run(job, &job->entries[index]);
+    }
+}
+
+// Prints how the entry compares to its golden hashes, returns whether it matched
+static bool regress_check(struct regress_entry *entry)
+{
+    const char *name = entry->rom_path;
+
+    if (entry->failed_to_run)
+    {
+        printf("FAIL %s: didn't run\n", name);
+        return false;
+    }
+    if (!entry->golden_count && entry->golden_crash_frame < 0)
+    {
+        printf("FAIL %s %s: no golden hashes, make them with -u\n", name, entry->movie_path);
+        return false;
+    }
+
+    // The first checkpoint that differs. Hashes take in every frame before them,
+    // so everything up to the one before it is known to match.
+    uint32_t last_match = 0;
+    for (int c = 0; c < entry->golden_count; c++)
+    {
+        struct regress_checkpoint *golden = &entry->golden[c];
+        if (c >= entry->checkpoint_count || entry->checkpoints[c].frame != golden->frame)
+        {
+            if (entry->crash_frame >= 0)
+            {
+                printf("FAIL %s: crashed at frame %d, golden run didn't (matched up to frame %u)\n", name, entry->crash_frame, last_match);
+            }
+            else
+            {
+                printf("FAIL %s: checkpoints differ from the golden ones after frame %u, was it run with other frames or -k?\n", name, last_match);
+            }
+            return false;
+        }
+
+        struct regress_checkpoint *got = &entry->checkpoints[c];
+        if (memcmp(got->hashes, golden->hashes, sizeof got->hashes) != 0)
+        {
+            printf("FAIL %s: frames %u-%u differ in", name, last_match+1, golden->frame);
+            for (int p = 0; p < REGRESS_PARTS; p++)
+            {
+                if (got->hashes[p] != golden->hashes[p])
+                {
+                    printf(" %s", regress_part_names[p]);
+                }
+            }
+            printf("\n");
+            return false;
+        }
+
+        last_match = golden->frame;
+    }
+
+    if (entry->checkpoint_count > entry->golden_count)
+    {
+        printf("FAIL %s: golden run stopped at frame %u, this one went on\n", name, last_match);
+        return false;
+    }
+    if (entry->crash_frame != entry->golden_crash_frame)
+    {
+        if (entry->golden_crash_frame < 0)
+        {
+            printf("FAIL %s: crashed at frame %d, golden run didn't\n", name, entry->crash_frame);
+        }
+        else
+        {
+            printf("FAIL %s: golden run crashed at frame %d, this one at %d\n", name, entry->golden_crash_frame, entry->crash_frame);
+        }
+        return false;
+    }
+
+    printf("ok   %s: %u frames\n", name, last_match);
+    return true;
+}
+
+static void regress_usage()
+{
+    printf("usage: regress SUITE [-g GOLDEN] [-u] [-k EVERY] [-j THREADS] [-l]\n");
+    printf("  SUITE  lines of ROM MOVIE.fm2 FRAMES, - for no movie\n");
+    printf("  -g  golden hashes, SUITE with .golden in place of its extension by default\n");
+    printf("  -u  save this run as the golden hashes instead of checking it\n");
+    printf("  -k  frames between checkpoints, 60 by default, 1 to find the exact frame\n");
+    printf("  -j  threads, one per core by default\n");
+    printf("  -l  draw by replaying the PPU log like the SDL front end\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *suite_path = NULL;
+    const char *golden_path = NULL;
+    bool update = false;
+    bool replay_log = false;
+    int every = 60;
+    int threads = workers_cpu_count();
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-g") == 0 && i+1 < argc)      golden_path = argv[++i];
+        else if (strcmp(argv[i], "-k") == 0 && i+1 < argc) every = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && i+1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-u") == 0)               update = true;
+        else if (strcmp(argv[i], "-l") == 0)               replay_log = true;
+        else if (argv[i][0] != '-' && !suite_path)         suite_path = argv[i];
+        else
+        {
+            regress_usage();
+            return 1;
+        }
+    }
+
+    if (!suite_path || every <= 0 || threads <= 0)
+    {
+        regress_usage();
+        return 1;
+    }
+
+    char *default_golden = NULL;
+    if (!golden_path)
+    {
+        golden_path = default_golden = rom_sibling_path(suite_path, ".golden");
+    }
+
+    static struct regress_entry entries[REGRESS_MAX_ENTRIES];
+    int count = regress_read_suite(suite_path, entries);
+    if (count <= 0)
+    {
+        printf("%s has no ROMs to run\n", suite_path);
+        return 1;
+    }
+    if (!update && !regress_read_golden(golden_path, entries, count))
+    {
+        return 1;
+    }
+
+    struct regress_job job = { 0 };
+    workers_mutex_init(&job.mutex);
+    struct rom_cache roms = rom_cache_make((struct mux_api){ &job.mutex, workers_lock, workers_unlock });
+    job.roms = &roms;
+    job.entries = entries;
+    job.count = count;
+    job.every = every;
+    job.replay_log = replay_log;
+
+    if (threads > count)
+    {
+        threads = count;
+    }
+
+    workers_run(threads, regress_worker, &job);
+
+    int failed = 0;
+    if (update)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            failed += entries[i].failed_to_run;
+        }
+        if (failed || !regress_write_golden(golden_path, suite_path, entries, count))
+        {
+            printf("Golden hashes not saved\n");
+            failed = failed ? failed : 1;
+        }
+        else
+        {
+            printf("Saved golden hashes of %d runs to %s\n", count, golden_path);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < count; i++)
+        {
+            failed += !regress_check(&entries[i]);
+        }
+        printf("%d of %d passed\n", count-failed, count);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        free(entries[i].checkpoints);
+        free(entries[i].golden);
+    }
+    free(default_golden);
+
+    return failed ? 2 : 0;
+}
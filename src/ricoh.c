@@ -26,7 +26,8 @@ const char *ricoh_instr_to_str[] =
     "PHA", "PHP", "PLA", "PLP",
     "ROL", "ROR", "RTI", "RTS",
     "SBC", "SEC", "SED", "SEI", "STA", "STX", "STY",
-    "TAX", "TAY", "TSX", "TXA", "TXS", "TYA", "???"
+    "TAX", "TAY", "TSX", "TXA", "TXS", "TYA",
+    "DCP", "ISB", "LAX", "RLA", "RRA", "SAX", "SLO", "SRE", "???"
 };
 
 // 0xFF - Invalid addressing mode
@@ -67,7 +68,7 @@ const uint8_t ricoh_opc_to_instr[] =
 /*LDX*/ 0xFF,0xAE,0xFF,0xBE,0xA2,0xFF,0xFF,0xFF,0xFF,0xFF,0xA6,0xFF,0xB6,
 /*LDY*/ 0xFF,0xAC,0xBC,0xFF,0xA0,0xFF,0xFF,0xFF,0xFF,0xFF,0xA4,0xB4,0xFF,
 /*LSR*/ 0x4A,0x4E,0x5E,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0x46,0x56,0xFF,
-/*NOP*/ 0xFF,0xFF,0xFF,0xFF,0xFF,0xEA,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+/*NOP*/ 0xFF,0x0C,0x1C,0xFF,0x80,0xEA,0xFF,0xFF,0xFF,0xFF,0x04,0x14,0xFF,
 /*ORA*/ 0xFF,0x0D,0x1D,0x19,0x09,0xFF,0xFF,0x01,0x11,0xFF,0x05,0x15,0xFF,
 /*PHA*/ 0xFF,0xFF,0xFF,0xFF,0xFF,0x48,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
 /*PHP*/ 0xFF,0xFF,0xFF,0xFF,0xFF,0x08,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
@@ -90,6 +91,31 @@ const uint8_t ricoh_opc_to_instr[] =
 /*TXA*/ 0xFF,0xFF,0xFF,0xFF,0xFF,0x8A,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
 /*TXS*/ 0xFF,0xFF,0xFF,0xFF,0xFF,0x9A,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
 /*TYA*/ 0xFF,0xFF,0xFF,0xFF,0xFF,0x98,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+/*DCP*/ 0xFF,0xCF,0xDF,0xDB,0xFF,0xFF,0xFF,0xC3,0xD3,0xFF,0xC7,0xD7,0xFF,
+/*ISB*/ 0xFF,0xEF,0xFF,0xFB,0xFF,0xFF,0xFF,0xE3,0xF3,0xFF,0xE7,0xF7,0xFF,
+/*LAX*/ 0xFF,0xAF,0xFF,0xBF,0xFF,0xFF,0xFF,0xA3,0xB3,0xFF,0xA7,0xFF,0xB7,
+/*RLA*/ 0xFF,0x2F,0x3F,0x3B,0xFF,0xFF,0xFF,0x23,0x33,0xFF,0x27,0x37,0xFF,
+/*RRA*/ 0xFF,0x6F,0x7F,0x7B,0xFF,0xFF,0xFF,0x63,0x73,0xFF,0x67,0x77,0xFF,
+/*SAX*/ 0xFF,0x8F,0xFF,0xFF,0xFF,0xFF,0xFF,0x83,0xFF,0xFF,0x87,0xFF,0x97,
+/*SLO*/ 0xFF,0x0F,0x1F,0x1B,0xFF,0xFF,0xFF,0x03,0x13,0xFF,0x07,0x17,0xFF,
+/*SRE*/ 0xFF,0x4F,0x5F,0x5B,0xFF,0xFF,0xFF,0x43,0x53,0xFF,0x47,0x57,0xFF,
+};
+
+// Unofficial opcodes that repeat an instruction and addressing mode already
+// in the table above, and ISB $nnnn,X whose opcode is its invalid mark,
+// as { opcode, instruction, addressing mode }
+const uint8_t ricoh_opc_aliases[][3] =
+{
+    { 0x1A, NOP, AM_IMP }, { 0x3A, NOP, AM_IMP }, { 0x5A, NOP, AM_IMP },
+    { 0x7A, NOP, AM_IMP }, { 0xDA, NOP, AM_IMP }, { 0xFA, NOP, AM_IMP },
+    { 0x82, NOP, AM_IMM }, { 0x89, NOP, AM_IMM }, { 0xC2, NOP, AM_IMM }, { 0xE2, NOP, AM_IMM },
+    { 0x44, NOP, AM_ZPG }, { 0x64, NOP, AM_ZPG },
+    { 0x34, NOP, AM_ZPX }, { 0x54, NOP, AM_ZPX }, { 0x74, NOP, AM_ZPX },
+    { 0xD4, NOP, AM_ZPX }, { 0xF4, NOP, AM_ZPX },
+    { 0x3C, NOP, AM_ABX }, { 0x5C, NOP, AM_ABX }, { 0x7C, NOP, AM_ABX },
+    { 0xDC, NOP, AM_ABX }, { 0xFC, NOP, AM_ABX },
+    { 0xEB, SBC, AM_IMM },
+    { 0xFF, ISB, AM_ABX },
 };  
 
 // 0 - Invalid
@@ -130,7 +156,7 @@ const uint8_t ricoh_cycle_tbl[] =
 /*LDX*/ 0,  4,  0,  4,  2,  0,  0,  0,  0,  0,  3,  0,  4,  
 /*LDY*/ 0,  4,  4,  0,  2,  0,  0,  0,  0,  0,  3,  4,  0,  
 /*LSR*/ 2,  6,  7,  0,  0,  0,  0,  0,  0,  0,  5,  6,  0,  
-/*NOP*/ 0,  0,  0,  0,  0,  2,  0,  0,  0,  0,  0,  0,  0,  
+/*NOP*/ 0,  4,  4,  0,  2,  2,  0,  0,  0,  0,  3,  4,  0,  
 /*ORA*/ 0,  4,  4,  4,  2,  0,  0,  6,  5,  0,  3,  4,  0,  
 /*PHA*/ 0,  0,  0,  0,  0,  3,  0,  0,  0,  0,  0,  0,  0,  
 /*PHP*/ 0,  0,  0,  0,  0,  3,  0,  0,  0,  0,  0,  0,  0,  
@@ -153,6 +179,14 @@ const uint8_t ricoh_cycle_tbl[] =
 /*TXA*/ 0,  0,  0,  0,  0,  2,  0,  0,  0,  0,  0,  0,  0,  
 /*TXS*/ 0,  0,  0,  0,  0,  2,  0,  0,  0,  0,  0,  0,  0,  
 /*TYA*/ 0,  0,  0,  0,  0,  2,  0,  0,  0,  0,  0,  0,  0,  
+/*DCP*/ 0,  6,  7,  7,  0,  0,  0,  8,  8,  0,  5,  6,  0,  
+/*ISB*/ 0,  6,  7,  7,  0,  0,  0,  8,  8,  0,  5,  6,  0,  
+/*LAX*/ 0,  4,  0,  4,  0,  0,  0,  6,  5,  0,  3,  0,  4,  
+/*RLA*/ 0,  6,  7,  7,  0,  0,  0,  8,  8,  0,  5,  6,  0,  
+/*RRA*/ 0,  6,  7,  7,  0,  0,  0,  8,  8,  0,  5,  6,  0,  
+/*SAX*/ 0,  4,  0,  0,  0,  0,  0,  6,  0,  0,  3,  0,  4,  
+/*SLO*/ 0,  6,  7,  7,  0,  0,  0,  8,  8,  0,  5,  6,  0,  
+/*SRE*/ 0,  6,  7,  7,  0,  0,  0,  8,  8,  0,  5,  6,  0,  
 };
 
 
@@ -172,6 +206,12 @@ struct ricoh_decoder make_ricoh_decoder()
         }
     }
 
+    for (size_t i = 0; i < sizeof(ricoh_opc_aliases)/sizeof(ricoh_opc_aliases[0]); i++)
+    {
+        decoder.itbl[ricoh_opc_aliases[i][0]] = ricoh_opc_aliases[i][1];
+        decoder.atbl[ricoh_opc_aliases[i][0]] = ricoh_opc_aliases[i][2];
+    }
+
     return decoder;
 }
 
@@ -191,6 +231,7 @@ struct instr_decoded ricoh_decode_instr(struct ricoh_decoder *decoder, struct ri
 {
     struct instr_decoded decoded = { 0 };
     uint8_t opc = mem->get(mem->instance, addr);
+    decoded.opcode = opc;
     decoded.id = decoder->itbl[opc];
     decoded.addr_mode = decoder->atbl[opc];
 
@@ -231,26 +272,27 @@ struct instr_decoded ricoh_decode_instr(struct ricoh_decoder *decoder, struct ri
     return decoded;
 }
 
-void ricoh_format_decoded_instr(char *dest, struct instr_decoded decoded)
+void ricoh_format_decoded_instr(char *dest, size_t size, struct instr_decoded decoded)
 {
-    int i = 0;
-    i += sprintf(dest, "%s ", ricoh_instr_name(decoded.id));
+    const char *name = ricoh_instr_name(decoded.id);
+    uint16_t word = decoded.operand[0] | (decoded.operand[1]<<8);
+    uint8_t byte = decoded.operand[0];
 
     switch (decoded.addr_mode)
     {
-        case AM_ACC: sprintf(dest+i, "A"); break;
-        case AM_ABS: sprintf(dest+i, "$%04X", *(uint16_t*)decoded.operand); break;
-        case AM_ABX: sprintf(dest+i, "$%04X,X", *(uint16_t*)decoded.operand); break;
-        case AM_ABY: sprintf(dest+i, "$%04X,Y", *(uint16_t*)decoded.operand); break;
-        case AM_IMM: sprintf(dest+i, "#$%02X", decoded.operand[0]); break;
-        case AM_IMP: break;
-        case AM_IND: sprintf(dest+i, "($%04X)", *(uint16_t*)decoded.operand); break;
-        case AM_XND: sprintf(dest+i, "($%02X,X)", decoded.operand[0]); break;
-        case AM_INY: sprintf(dest+i, "($%02X),Y", decoded.operand[0]); break;
-        case AM_REL: sprintf(dest+i, "$%02X", decoded.operand[0]); break;
-        case AM_ZPG: sprintf(dest+i, "$%02X", decoded.operand[0]); break;
-        case AM_ZPX: sprintf(dest+i, "$%02X,X", decoded.operand[0]); break;
-        case AM_ZPY: sprintf(dest+i, "$%02X,Y", decoded.operand[0]); break;
+        case AM_ACC: snprintf(dest, size, "%s A", name); break;
+        case AM_ABS: snprintf(dest, size, "%s $%04X", name, word); break;
+        case AM_ABX: snprintf(dest, size, "%s $%04X,X", name, word); break;
+        case AM_ABY: snprintf(dest, size, "%s $%04X,Y", name, word); break;
+        case AM_IMM: snprintf(dest, size, "%s #$%02X", name, byte); break;
+        case AM_IMP: snprintf(dest, size, "%s ", name); break;
+        case AM_IND: snprintf(dest, size, "%s ($%04X)", name, word); break;
+        case AM_XND: snprintf(dest, size, "%s ($%02X,X)", name, byte); break;
+        case AM_INY: snprintf(dest, size, "%s ($%02X),Y", name, byte); break;
+        case AM_REL: snprintf(dest, size, "%s $%02X", name, byte); break;
+        case AM_ZPG: snprintf(dest, size, "%s $%02X", name, byte); break;
+        case AM_ZPX: snprintf(dest, size, "%s $%02X,X", name, byte); break;
+        case AM_ZPY: snprintf(dest, size, "%s $%02X,Y", name, byte); break;
     }
 }
 
@@ -366,9 +408,24 @@ static void setreg(struct ricoh_state *cpu, int reg, int8_t value)
     }
 }
 
-static uint16_t pagecross(struct ricoh_state *cpu, uint16_t a, uint16_t b)
+// Stores and read-modify-writes always spend the cycle fixing the high byte,
+// it's in their table entry. Only reads skip it when no page is crossed.
+static bool pays_pagecross(enum instr id)
 {
-    if (((a + b) >> 8) != (a >> 8))
+    switch (id)
+    {
+        case STA: case STX: case STY:
+        case ASL: case LSR: case ROL: case ROR: case INC: case DEC:
+        case DCP: case ISB: case RLA: case RRA: case SAX: case SLO: case SRE:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static uint16_t pagecross(struct ricoh_state *cpu, enum instr id, uint16_t a, uint16_t b)
+{
+    if (pays_pagecross(id) && ((a + b) >> 8) != (a >> 8))
     {
         cpu->cycles++;
     }
@@ -402,13 +459,13 @@ struct ricoh_address make_address(
     {
         case AM_ACC: addr.is_acc = true; break;
         case AM_ABS: addr.addr = *(uint16_t*)instr.operand; break;
-        case AM_ABX: addr.addr = pagecross(cpu, *(uint16_t*)instr.operand, cpu->x); break;
-        case AM_ABY: addr.addr = pagecross(cpu, *(uint16_t*)instr.operand, cpu->y); break;
+        case AM_ABX: addr.addr = pagecross(cpu, instr.id, *(uint16_t*)instr.operand, cpu->x); break;
+        case AM_ABY: addr.addr = pagecross(cpu, instr.id, *(uint16_t*)instr.operand, cpu->y); break;
         case AM_IMM: addr.is_imm = true; addr.imm = instr.operand[0]; break;
         case AM_IMP: addr.is_invalid = true; break;
         case AM_IND: addr.addr = read_16(cpu, mem, *(uint16_t*)instr.operand); break;
         case AM_XND: addr.addr = read_16zp(cpu, mem, (uint8_t)(instr.operand[0] + cpu->x)); break;
-        case AM_INY: addr.addr = pagecross(cpu, read_16zp(cpu, mem, instr.operand[0]), cpu->y); break;
+        case AM_INY: addr.addr = pagecross(cpu, instr.id, read_16zp(cpu, mem, instr.operand[0]), cpu->y); break;
         case AM_REL: addr.is_invalid = true; break;
         case AM_ZPG: addr.addr = instr.operand[0]; break;
         case AM_ZPX: addr.addr = (uint8_t)(instr.operand[0] + cpu->x); break;
@@ -511,6 +568,23 @@ void ricoh_do_interrupt(
     cpu->cycles += 7;
 }
 
+// Takes the IRQ if the line is asserted and interrupts aren't disabled
+bool ricoh_poll_irq(struct ricoh_state *cpu, struct ricoh_mem_interface *mem)
+{
+    if (!cpu->irq || getflag(cpu, FLAG_INT))
+    {
+        return false;
+    }
+
+    push16(cpu, mem, cpu->pc);
+    push8(cpu, mem, (cpu->flags & ~(1 << FLAG_BRK)) | (1 << FLAG_BI5));
+    setflag(cpu, FLAG_INT, true);
+    cpu->pc = read_16(cpu, mem, 0xFFFE);
+    cpu->cycles += 7;
+
+    return true;
+}
+
 void ricoh_run_instr(
     struct ricoh_state *cpu,
     struct instr_decoded instr,
@@ -654,6 +728,11 @@ void ricoh_run_instr(
             setflag(cpu, FLAG_CAR, (rmw_temp&1) > 0);
             break;
         case NOP:
+            // The unofficial ones with an operand still read it
+            if (!addr.is_invalid)
+            {
+                do_read(cpu, addr, mem);
+            }
             break;
         case ORA:
             setreg(cpu, REG_A, cpu->a | do_read(cpu, addr, mem));
@@ -729,6 +808,59 @@ void ricoh_run_instr(
             setreg(cpu, REG_A, cpu->y);
             cpu->a = cpu->y;
             break;
+        case DCP:
+            rmw_temp = do_read(cpu, addr, mem);
+            do_write(cpu, addr, mem, rmw_temp);
+            do_write(cpu, addr, mem, rmw_temp-1);
+            do_cmp(cpu, cpu->a, rmw_temp-1);
+            break;
+        case ISB:
+            rmw_temp = do_read(cpu, addr, mem);
+            do_write(cpu, addr, mem, rmw_temp);
+            do_write(cpu, addr, mem, rmw_temp+1);
+            setreg(cpu, REG_A, do_sub_carry(cpu, cpu->a, rmw_temp+1, true, true));
+            break;
+        case LAX:
+            setreg(cpu, REG_A, do_read(cpu, addr, mem));
+            cpu->x = cpu->a;
+            break;
+        case RLA:
+            {
+                rmw_temp = do_read(cpu, addr, mem);
+                uint8_t res = (rmw_temp<<1)|getflag(cpu, FLAG_CAR);
+                do_write(cpu, addr, mem, rmw_temp);
+                do_write(cpu, addr, mem, res);
+                setflag(cpu, FLAG_CAR, (rmw_temp&0x80) > 0);
+                setreg(cpu, REG_A, cpu->a & res);
+            }
+            break;
+        case RRA:
+            {
+                rmw_temp = do_read(cpu, addr, mem);
+                uint8_t res = (rmw_temp>>1)|(getflag(cpu, FLAG_CAR)<<7);
+                do_write(cpu, addr, mem, rmw_temp);
+                do_write(cpu, addr, mem, res);
+                setflag(cpu, FLAG_CAR, (rmw_temp&0x1) > 0);
+                setreg(cpu, REG_A, do_add_carry(cpu, cpu->a, res));
+            }
+            break;
+        case SAX:
+            do_write(cpu, addr, mem, cpu->a & cpu->x);
+            break;
+        case SLO:
+            rmw_temp = do_read(cpu, addr, mem);
+            do_write(cpu, addr, mem, rmw_temp);
+            do_write(cpu, addr, mem, rmw_temp<<1);
+            setflag(cpu, FLAG_CAR, (rmw_temp&0x80) > 0);
+            setreg(cpu, REG_A, cpu->a | (uint8_t)(rmw_temp<<1));
+            break;
+        case SRE:
+            rmw_temp = do_read(cpu, addr, mem);
+            do_write(cpu, addr, mem, rmw_temp);
+            do_write(cpu, addr, mem, rmw_temp>>1);
+            setflag(cpu, FLAG_CAR, (rmw_temp&1) > 0);
+            setreg(cpu, REG_A, cpu->a ^ (rmw_temp>>1));
+            break;
         case _ICOUNT:
             printf("OPCODE: %02X\n", mem->get(mem->instance, start));
             cpu->crash = 1;
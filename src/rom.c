@@ -0,0 +1,190 @@
+#include "neske.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static bool rom_map_file(const char *path, struct rom_image *image)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+    {
+        return false;
+    }
+
+    // The view keeps the mapping alive
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data)
+    {
+        return false;
+    }
+
+    image->data = data;
+    image->size = size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    image->data = data;
+    image->size = st.st_size;
+#endif
+
+    return true;
+}
+
+static void rom_unmap_file(struct rom_image *image)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(image->data);
+#else
+    munmap((void *)image->data, image->size);
+#endif
+}
+
+char *rom_sibling_path(const char *rom_path, const char *ext)
+{
+    size_t len = strlen(rom_path);
+    const char *dot = strrchr(rom_path, '.');
+    const char *slash = strrchr(rom_path, '/');
+    const char *backslash = strrchr(rom_path, '\\');
+
+    if (backslash > slash) slash = backslash;
+    if (dot && dot > slash) len = dot - rom_path;
+
+    char *path = malloc(len+strlen(ext)+1);
+    assert(path != NULL);
+    memcpy(path, rom_path, len);
+    strcpy(path+len, ext);
+
+    return path;
+}
+
+struct rom_cache rom_cache_make(struct mux_api mux)
+{
+    return (struct rom_cache){ mux, NULL, imap_cache_make(mux), NULL };
+}
+
+struct rom_image *rom_cache_open(struct rom_cache *cache, const char *path)
+{
+    cache->mux.lock(cache->mux.mux);
+
+    for (struct rom_image *image = cache->images; image; image = image->next)
+    {
+        if (strcmp(image->path, path) == 0)
+        {
+            image->refs += 1;
+            cache->mux.unlock(cache->mux.mux);
+            return image;
+        }
+    }
+
+    struct rom_image *image = calloc(1, sizeof(struct rom_image));
+    assert(image != NULL);
+
+    if (!rom_map_file(path, image))
+    {
+        cache->mux.unlock(cache->mux.mux);
+        printf("Can't map ROM file %s\n", path);
+        free(image);
+        return NULL;
+    }
+
+    image->path = malloc(strlen(path)+1);
+    assert(image->path != NULL);
+    strcpy(image->path, path);
+
+    image->cache = cache;
+    image->refs = 1;
+    image->next = cache->images;
+    cache->images = image;
+
+    cache->mux.unlock(cache->mux.mux);
+
+    return image;
+}
+
+struct rom_image *rom_image_retain(struct rom_image *image)
+{
+    struct rom_cache *cache = image->cache;
+
+    cache->mux.lock(cache->mux.mux);
+    image->refs += 1;
+    cache->mux.unlock(cache->mux.mux);
+
+    return image;
+}
+
+void rom_image_release(struct rom_image *image)
+{
+    struct rom_cache *cache = image->cache;
+
+    cache->mux.lock(cache->mux.mux);
+
+    assert(image->refs > 0);
+    image->refs -= 1;
+
+    if (image->refs > 0)
+    {
+        cache->mux.unlock(cache->mux.mux);
+        return;
+    }
+
+    for (struct rom_image **link = &cache->images; *link; link = &(*link)->next)
+    {
+        if (*link == image)
+        {
+            *link = image->next;
+            break;
+        }
+    }
+
+    cache->mux.unlock(cache->mux.mux);
+
+    rom_unmap_file(image);
+    free(image->path);
+    free(image);
+}
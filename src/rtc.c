@@ -0,0 +1,55 @@
+#include "neske.h"
+
+// splitmix64, every caller keeps its own state so runs can be repeated
+uint64_t rtc_rand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+struct rtc_state rtc_make(int level, uint64_t seed)
+{
+    return (struct rtc_state){ .level = level, .rng = seed };
+}
+
+bool rtc_iter(struct rtc_state *rtc, struct system *sys, struct rtc_poke *poke)
+{
+    if (rtc->level == 0) return false;
+    rtc->frames_since_last_pulse++;
+    int frames = 20;
+    if (rtc->level == 1) frames = 10;
+    if (rtc->period) frames = rtc->period;
+    if (rtc->frames_since_last_pulse < frames) return false;
+    rtc->frames_since_last_pulse = 0;
+
+    // The stack is left alone, it crashes the game too easily
+    uint16_t addr = rtc_rand(&rtc->rng)%0x2000;
+    while (addr >= 0x100 && addr < 0x200)
+    {
+        addr = rtc_rand(&rtc->rng)%0x2000;
+    }
+
+    uint8_t val = sys->memory[addr];
+    if (rtc->level == 2)
+    {
+        val = rtc_rand(&rtc->rng)%0x100;
+    }
+    else
+    {
+        int delta = rtc_rand(&rtc->rng)%2 ? 1 : -1;
+        if (val == 0) delta = 1;
+        if (val == 0xFF) delta = -1;
+        val += delta;
+    }
+
+    sys->memory[addr] = val;
+
+    if (poke)
+    {
+        *poke = (struct rtc_poke){ addr, val };
+    }
+
+    return true;
+}
@@ -0,0 +1,69 @@
+#include "neske.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+void save_ram_load(struct save_ram *ram, const char *rom_path)
+{
+    ram->battery = true;
+    ram->path = rom_sibling_path(rom_path, ".sav");
+
+    FILE *fp = fopen(ram->path, "rb");
+    if (!fp)
+    {
+        return;
+    }
+
+    if (fread(ram->data, 1, SAVE_RAM_SIZE, fp) != SAVE_RAM_SIZE)
+    {
+        printf("Save file %s is short, rest is zeroed\n", ram->path);
+    }
+    fclose(fp);
+}
+
+void save_ram_free(struct save_ram *ram)
+{
+    free(ram->path);
+    ram->path = NULL;
+}
+
+bool save_write_file_atomic(const char *path, const uint8_t *data, size_t size)
+{
+    size_t len = strlen(path);
+    char *tmp = malloc(len+5);
+    assert(tmp != NULL);
+    memcpy(tmp, path, len);
+    strcpy(tmp+len, ".tmp");
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp)
+    {
+        free(tmp);
+        return false;
+    }
+
+    bool ok = fwrite(data, 1, size, fp) == size;
+    ok = fclose(fp) == 0 && ok;
+
+    // Readers see either the old file or the whole new one
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH);
+#else
+    ok = ok && rename(tmp, path) == 0;
+#endif
+
+    if (!ok)
+    {
+        remove(tmp);
+    }
+
+    free(tmp);
+    return ok;
+}
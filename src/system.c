@@ -10,6 +10,7 @@ struct system system_init(struct mux_api apu_mux, struct ricoh_mem_interface mem
     system.decoder = make_ricoh_decoder();
     system.ppu = ppu_mk();
     system.mem = mem;
+    system.debug.resume_cycles = UINT64_MAX;
     system_reset(&system);
     return system;
 }
@@ -26,6 +27,11 @@ void system_mem_write(struct system *system, uint16_t addr, uint8_t data)
     if (addr >= 0x2000 && addr < 0x4000)
     {
         addr = 0x2000 + addr % 8;
+        system_sync_ppu(system);
+    }
+    else if (addr == 0x4014)
+    {
+        system_sync_ppu(system);
     }
 
     switch (addr)
@@ -91,6 +97,13 @@ uint8_t system_mem_read(struct system *system, uint16_t addr)
     if (addr >= 0x2000 && addr < 0x4000)
     {
         addr = 0x2000  +((addr-0x2000)%8);
+
+        if (addr == 0x2002 && system->cpu_ahead)
+        {
+            return ppu_read_status_ahead(&system->ppu, system->instr_cycles*3+1);
+        }
+
+        system_sync_ppu(system);
     }
 
     uint8_t val = 0;
@@ -151,11 +164,45 @@ void system_reset(struct system *system)
     system->cpu.flags = 0x24;
     system->cpu.sp = 0xFD;
     system->cpu.cycles = 7;
+    system->irq_cycle = UINT64_MAX;
     system->apu = (struct apu){ 0 };
     apu_init(&system->apu);
     printf("system_reset done\n");
 }
 
+// Must be called before anything that changes PPU state, so the PPU
+// catches up with the CPU instruction that does it
+void system_sync_ppu(struct system *system)
+{
+    system->ppu.predict_valid = false;
+
+    if (!system->cpu_ahead)
+    {
+        return;
+    }
+
+    while (system->ppu.cycles <= system->instr_cycles*3)
+    {
+        ppu_cycle(&system->ppu, &system->mem);
+    }
+
+    system->cpu_ahead = false;
+}
+
+// The CPU can run ahead during the visible lines, status flags that can
+// change there are predicted. It must not pass the vblank, where NMI happens.
+static bool system_can_run_ahead(struct system *system)
+{
+    struct ppu *ppu = &system->ppu;
+
+    if (system->lockstep || ppu->scanline >= 240 || (ppu->scanline == -1 && ppu->beam == 0))
+    {
+        return false;
+    }
+
+    return system->cpu.cycles*3+1 < ppu_vblank_cycle(ppu);
+}
+
 enum
 {
     DEV_CPU,
@@ -165,15 +212,17 @@ enum
 struct system_frame_result system_frame(struct system *system)
 {
     uint64_t cycles_start = system->cpu.cycles;
+    bool stopped = false;
 
-    while (!system->cpu.crash && (system->cpu.cycles-cycles_start) < 500000)
+    while (!stopped && !system->cpu.crash && (system->cpu.cycles-cycles_start) < 500000)
     {
         bool nmi_occured = false;
 
         int dev = DEV_CPU;
         uint64_t devc = system->cpu.cycles;
 
-        if (devc*3 >= system->ppu.cycles) {
+        // A paused CPU waits for the PPU to catch up, so the state it reports is in step
+        if (devc*3 >= system->ppu.cycles && (system->debug.paused || !system_can_run_ahead(system))) {
             devc = system->ppu.cycles/3;
             dev = DEV_PPU;
         }
@@ -182,13 +231,63 @@ struct system_frame_result system_frame(struct system *system)
         {
         case DEV_CPU:
             {
+                if (system->debug.paused)
+                {
+                    stopped = true;
+                    break;
+                }
+
+                if (system->irq_cycle <= system->cpu.cycles*3+1)
+                {
+                    system->cpu.irq = true;
+                    system->irq_cycle = UINT64_MAX;
+                }
+
+                uint16_t pc = system->cpu.pc;
+                uint64_t cycles = system->cpu.cycles;
+                if (ricoh_poll_irq(&system->cpu, &system->mem))
+                {
+                    if (system->prof)
+                    {
+                        prof_interrupt(system->prof, PROF_IRQ, pc, system->cpu.pc, system->cpu.cycles - cycles);
+                    }
+                    break;
+                }
+
+                if ((system->debug.pages[system->cpu.pc>>8] & DEBUG_EXEC) && debug_check(system, DEBUG_EXEC, system->cpu.pc, 0))
+                {
+                    break;
+                }
+
+                system->instr_cycles = system->cpu.cycles;
+                system->instr_pc = system->cpu.pc;
+                system->cpu_ahead = system->cpu.cycles*3 >= system->ppu.cycles;
+
+                system->fetching = true;
                 struct instr_decoded decoded = ricoh_decode_instr(&system->decoder, &system->mem, system->cpu.pc);
+                system->fetching = false;
+
+                if (system->trace)
+                {
+                    trace_instr(system->trace, &system->cpu, decoded);
+                }
+
                 ricoh_run_instr(&system->cpu, decoded, &system->mem);
+
+                if (system->prof)
+                {
+                    prof_instr(system->prof, pc, decoded, system->cpu.pc, system->cpu.cycles - system->instr_cycles);
+                }
+
+                system->cpu_ahead = false;
             }
             break;
         case DEV_PPU:
             {
-                nmi_occured = ppu_cycle(&system->ppu, &system->mem);
+                while (!nmi_occured && system->cpu.cycles*3 >= system->ppu.cycles)
+                {
+                    nmi_occured = ppu_cycle(&system->ppu, &system->mem);
+                }
             }
             break;
         }
@@ -197,7 +296,14 @@ struct system_frame_result system_frame(struct system *system)
         {
             if (ppu_nmi_enabled(&system->ppu))
             {
+                uint16_t pc = system->cpu.pc;
+                uint64_t cycles = system->cpu.cycles;
                 ricoh_do_interrupt(&system->cpu, &system->mem, system_get_vector(system, VEC_NMI));
+
+                if (system->prof)
+                {
+                    prof_interrupt(system->prof, PROF_NMI, pc, system->cpu.pc, system->cpu.cycles - cycles);
+                }
             }
             break;
         }
@@ -206,6 +312,9 @@ struct system_frame_result system_frame(struct system *system)
     struct system_frame_result result = { 0 };
 
     memcpy(result.screen, system->ppu.screen, sizeof result.screen);
+    memcpy(result.dirty_rows, system->ppu.dirty_rows, sizeof result.dirty_rows);
+    memcpy(result.emphasis, system->ppu.emphasis, sizeof result.emphasis);
+    memset(system->ppu.dirty_rows, false, sizeof system->ppu.dirty_rows);
 
     return result;
 }
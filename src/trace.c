@@ -0,0 +1,83 @@
+#include "neske.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct trace *trace_make()
+{
+    struct trace *trace = calloc(1, sizeof(struct trace));
+    assert(trace != NULL);
+
+    return trace;
+}
+
+void trace_free(struct trace *trace)
+{
+    free(trace);
+}
+
+void trace_instr(struct trace *trace, struct ricoh_state *cpu, struct instr_decoded decoded)
+{
+    struct trace_entry *entry = &trace->entries[trace->count++ & (TRACE_SIZE-1)];
+
+    entry->cycles = cpu->cycles;
+    entry->pc = cpu->pc;
+    entry->bytes[0] = decoded.opcode;
+    entry->bytes[1] = decoded.operand[0];
+    entry->bytes[2] = decoded.operand[1];
+    entry->size = decoded.size;
+    entry->a = cpu->a;
+    entry->x = cpu->x;
+    entry->y = cpu->y;
+    entry->p = cpu->flags;
+    entry->sp = cpu->sp;
+    entry->id = decoded.id;
+    entry->addr_mode = decoded.addr_mode;
+}
+
+const struct trace_entry *trace_get(struct trace *trace, uint64_t index)
+{
+    if (index >= trace->count || trace->count-index > TRACE_SIZE)
+    {
+        return NULL;
+    }
+
+    return &trace->entries[index & (TRACE_SIZE-1)];
+}
+
+void trace_format(char *dest, size_t size, const struct trace_entry *entry)
+{
+    char bytes[12] = "";
+    for (int i = 0; i < entry->size && i < 3; i++)
+    {
+        snprintf(bytes+i*3, sizeof bytes-i*3, "%02X ", entry->bytes[i]);
+    }
+
+    struct instr_decoded decoded = { entry->id, entry->addr_mode, entry->bytes[0], { entry->bytes[1], entry->bytes[2] }, entry->size };
+    char text[32];
+    ricoh_format_decoded_instr(text, sizeof text, decoded);
+
+    snprintf(dest, size, "%04X  %-9s %-31s A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu",
+        entry->pc, bytes, text, entry->a, entry->x, entry->y, entry->p, entry->sp, (unsigned long long)entry->cycles);
+}
+
+void trace_diff(const struct trace_entry *got, const struct trace_entry *want, char *dest, size_t size)
+{
+    dest[0] = 0;
+    size_t len = 0;
+
+#define TRACE_FIELD(name, differs) \
+    if ((differs) && len < size) len += snprintf(dest+len, size-len, " " name)
+
+    TRACE_FIELD("PC", got->pc != want->pc);
+    TRACE_FIELD("bytes", got->size != want->size || memcmp(got->bytes, want->bytes, want->size) != 0);
+    TRACE_FIELD("A", got->a != want->a);
+    TRACE_FIELD("X", got->x != want->x);
+    TRACE_FIELD("Y", got->y != want->y);
+    TRACE_FIELD("P", got->p != want->p);
+    TRACE_FIELD("SP", got->sp != want->sp);
+    TRACE_FIELD("CYC", got->cycles != want->cycles);
+
+#undef TRACE_FIELD
+}
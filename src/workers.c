@@ -0,0 +1,81 @@
+// Threads for the headless tools that spread runs across cores. Tools that
+// include it need -pthread outside Windows.
+#include "neske.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION workers_mutex;
+void workers_mutex_init(workers_mutex *mutex) { InitializeCriticalSection(mutex); }
+void workers_lock(void *mutex) { EnterCriticalSection(mutex); }
+void workers_unlock(void *mutex) { LeaveCriticalSection(mutex); }
+#else
+typedef pthread_mutex_t workers_mutex;
+void workers_mutex_init(workers_mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+void workers_lock(void *mutex) { pthread_mutex_lock(mutex); }
+void workers_unlock(void *mutex) { pthread_mutex_unlock(mutex); }
+#endif
+
+int workers_cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+}
+
+struct workers_start
+{
+    void (*run)(void *arg);
+    void *arg;
+};
+
+#ifdef _WIN32
+DWORD WINAPI workers_main(void *arg)
+#else
+void *workers_main(void *arg)
+#endif
+{
+    struct workers_start *start = arg;
+    start->run(start->arg);
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// Calls run(arg) on that many threads at once and returns when all are done
+void workers_run(int threads, void (*run)(void *arg), void *arg)
+{
+    struct workers_start start = { run, arg };
+
+#ifdef _WIN32
+    HANDLE *handles = malloc(threads*sizeof(HANDLE));
+    for (int i = 0; i < threads; i++) handles[i] = CreateThread(NULL, 0, workers_main, &start, 0, NULL);
+    // One at a time, WaitForMultipleObjects takes at most 64
+    for (int i = 0; i < threads; i++)
+    {
+        WaitForSingleObject(handles[i], INFINITE);
+        CloseHandle(handles[i]);
+    }
+#else
+    pthread_t *handles = malloc(threads*sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) pthread_create(&handles[i], NULL, workers_main, &start);
+    for (int i = 0; i < threads; i++) pthread_join(handles[i], NULL);
+#endif
+    free(handles);
+}